@@ -0,0 +1,15 @@
+#ifndef __ANN_OPTIONS_HPP__
+#define __ANN_OPTIONS_HPP__
+
+// Shape of the Annoy forest and effort of its queries (see AnnTree).
+// More trees give a better recall for a bigger ann_tree.ann and a longer build. searchK is the number of
+// nodes a query inspects, -1 for Annoy's default of trees * n, and trades recall for latency without a rebuild.
+// 0 in either keeps the value saved in ann_tree.meta, or the default when there is none.
+// threads is the number of build threads, -1 for one per hardware thread.
+struct AnnOptions {
+	int trees = 0;
+	int searchK = 0;
+	int threads = -1;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#include "ann_tree.hpp"
+#define ANNOYLIB_MULTITHREADED_BUILD
+#include "annoylib.h"
+#include "kissrandom.h"
+#include <fstream>
+#include <iostream>
+#include <cstring>
+
+namespace {
+	const char annMagic[8] = { 'I', 'P', 'A', 'N', 'N', 'M', 'T', '\0' };
+
+	struct AnnTreeMeta {
+		char magic[8];
+		uint32_t version;
+		uint32_t dimensions;
+		uint64_t rows;
+		uint64_t checksum;
+		int32_t trees;
+		int32_t searchK;
+	};
+}
+
+AnnTree::AnnTree() {}
+
+AnnTree::~AnnTree() {
+	close();
+}
+
+void AnnTree::close() {
+	if (m_index) {
+		m_index->unload();
+		m_index.reset();
+	}
+}
+
+bool AnnTree::open(const std::filesystem::path& dbPath, const FeatureStore& store, const AnnOptions& options) {
+	close();
+	if (!store.isOpen() || !store.rows()) {
+		return false;
+	}
+	m_dbPath = dbPath;
+	m_rows = store.rows();
+	m_checksum = store.checksum();
+	if (load(options)) {
+		return true;
+	}
+	return build(store, options);
+}
+
+bool AnnTree::load(const AnnOptions& options) {
+	const auto treePath = m_dbPath / fileName;
+	std::ifstream file(m_dbPath / metaFileName, std::ios::binary);
+	AnnTreeMeta meta;
+	if (!std::filesystem::exists(treePath) ||
+		!file.read(reinterpret_cast<char*>(&meta), sizeof(meta)) ||
+		std::memcmp(meta.magic, annMagic, sizeof(annMagic)) != 0 ||
+		meta.version != version ||
+		meta.dimensions != DESCRIPTORS_NUM ||
+		meta.rows != m_rows ||
+		meta.checksum != m_checksum ||
+		meta.trees <= 0 ||
+		(options.trees > 0 && meta.trees != options.trees)) {
+		return false;
+	}
+	m_index = std::make_unique<Index>(DESCRIPTORS_NUM);
+	if (!m_index->load(treePath.string().c_str()) || (uint64_t)m_index->get_n_items() != m_rows) {
+		close();
+		return false;
+	}
+	m_trees = meta.trees;
+	m_searchK = options.searchK ? options.searchK : meta.searchK;
+	return true;
+}
+
+bool AnnTree::build(const FeatureStore& store, const AnnOptions& options) {
+	m_trees = options.trees > 0 ? options.trees : defaultTrees;
+	m_searchK = options.searchK ? options.searchK : defaultSearchK;
+	std::cout << "Building " << fileName << " with " << m_trees << " trees for " << m_rows << " shapes..." << std::endl;
+	// The meta file goes first, a build that does not finish leaves no meta to match
+	std::filesystem::remove(m_dbPath / metaFileName);
+
+	m_index = std::make_unique<Index>(DESCRIPTORS_NUM);
+	std::vector<float> row(DESCRIPTORS_NUM);
+	for (size_t i = 0; i < store.rows(); i++) {
+		store.copyRow(i, row.data());
+		m_index->add_item((int)i, row.data());
+	}
+	// The trees are independent, the multithreaded policy grows them on options.threads threads
+	m_index->build(m_trees, options.threads);
+
+	const auto treePath = m_dbPath / fileName;
+	if (!m_index->save(treePath.string().c_str())) {
+		// The forest in memory still answers queries, it is just built again next time
+		std::cout << "Unable to write " << treePath << std::endl;
+		std::error_code error;
+		std::filesystem::remove(treePath, error);
+		return true;
+	}
+	saveOptions();
+	return true;
+}
+
+bool AnnTree::saveOptions() const {
+	if (!isOpen() || !std::filesystem::exists(m_dbPath / fileName)) {
+		return false;
+	}
+	AnnTreeMeta meta;
+	std::memset(&meta, 0, sizeof(meta));
+	std::memcpy(meta.magic, annMagic, sizeof(annMagic));
+	meta.version = version;
+	meta.dimensions = DESCRIPTORS_NUM;
+	meta.rows = m_rows;
+	meta.checksum = m_checksum;
+	meta.trees = m_trees;
+	meta.searchK = m_searchK;
+	std::ofstream file(m_dbPath / metaFileName, std::ios::binary | std::ios::trunc);
+	file.write(reinterpret_cast<const char*>(&meta), sizeof(meta));
+	if (!file) {
+		std::cout << "Unable to write " << m_dbPath / metaFileName << std::endl;
+		return false;
+	}
+	return true;
+}
+
+void AnnTree::queryRow(int row, int n, std::vector<int>& rows, std::vector<float>& distances) const {
+	rows.clear();
+	distances.clear();
+	m_index->get_nns_by_item(row, n, m_searchK, &rows, &distances);
+}
+
+void AnnTree::queryVector(const float* vector, int n, std::vector<int>& rows, std::vector<float>& distances) const {
+	rows.clear();
+	distances.clear();
+	m_index->get_nns_by_vector(vector, n, m_searchK, &rows, &distances);
+}
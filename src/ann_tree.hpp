@@ -0,0 +1,64 @@
+#ifndef __ANN_TREE_HPP__
+#define __ANN_TREE_HPP__
+
+#include "feature_store.hpp"
+#include "ann_options.hpp"
+#include <filesystem>
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+namespace Annoy {
+	struct Angular;
+	struct Kiss32Random;
+	class AnnoyIndexMultiThreadedBuildPolicy;
+	template<typename S, typename T, typename Distance, typename Random, class ThreadedBuildPolicy> class AnnoyIndex;
+}
+
+// Annoy forest over the standardized DB records, saved as ann_tree.ann in the DB root.
+// ann_tree.meta describes the forest: the checksum of the features it was built from, so it is only
+// rebuilt when the DB changes, its number of trees and the search_k its queries use.
+// Meshes outside the DB are looked up by their feature vector, the forest never changes after the build.
+class AnnTree {
+	public:
+		typedef Annoy::AnnoyIndex<int, float, Annoy::Angular, Annoy::Kiss32Random, Annoy::AnnoyIndexMultiThreadedBuildPolicy> Index;
+
+		static constexpr const char* fileName = "ann_tree.ann";
+		static constexpr const char* metaFileName = "ann_tree.meta";
+		static const uint32_t version = 2;
+		static constexpr int defaultTrees = DESCRIPTORS_NUM * 2;
+		static constexpr int defaultSearchK = -1;
+
+		AnnTree();
+		~AnnTree();
+
+		// Loads the forest of store, or builds it and saves it together with its meta file.
+		// A saved forest with another number of trees than options.trees is built again
+		bool open(const std::filesystem::path& dbPath, const FeatureStore& store, const AnnOptions& options = AnnOptions());
+		void close();
+		inline bool isOpen() const { return m_index != nullptr; }
+
+		inline int trees() const { return m_trees; }
+		inline int searchK() const { return m_searchK; }
+		// Changes the search_k of the next queries, saveOptions makes it the one ann_tree.meta holds
+		inline void setSearchK(int searchK) { m_searchK = searchK; }
+		bool saveOptions() const;
+
+		// The n rows nearest to a DB row, starting with the row itself
+		void queryRow(int row, int n, std::vector<int>& rows, std::vector<float>& distances) const;
+		// The n rows nearest to a feature vector of DESCRIPTORS_NUM floats
+		void queryVector(const float* vector, int n, std::vector<int>& rows, std::vector<float>& distances) const;
+
+	private:
+		bool load(const AnnOptions& options);
+		bool build(const FeatureStore& store, const AnnOptions& options);
+
+		std::unique_ptr<Index> m_index;
+		std::filesystem::path m_dbPath;
+		uint64_t m_rows = 0;
+		uint64_t m_checksum = 0;
+		int m_trees = 0;
+		int m_searchK = defaultSearchK;
+};
+
+#endif
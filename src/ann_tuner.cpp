@@ -0,0 +1,230 @@
+#include "utils.hpp"
+#include "descriptors.hpp"
+#include "shape_retriever.hpp"
+#include "ann_tree.hpp"
+#include "random.hpp"
+#include <chrono>
+#include <numeric>
+#include <algorithm>
+#include <tuple>
+#include <random>
+
+namespace {
+	struct TuningResult {
+		int trees;
+		int searchK;
+		float recall;
+		float p50;
+		float p99;
+		float buildSeconds;
+		bool pareto;
+	};
+
+	std::vector<int> parseList(const char* list) {
+		std::vector<int> values;
+		std::stringstream ss(list);
+		std::string value;
+		while (std::getline(ss, value, ',')) {
+			values.push_back(atoi(value.c_str()));
+		}
+		return values;
+	}
+
+	float percentile(std::vector<float> values, float p) {
+		std::sort(values.begin(), values.end());
+		return values[std::min(values.size() - 1, (size_t)(p * (values.size() - 1) + 0.5f))];
+	}
+
+	// A directory under the temp path no other run uses, create_directory only succeeds for a new name
+	std::filesystem::path makeScratchDirectory() {
+		std::random_device device;
+		Random::Engine rng(((uint64_t)device() << 32) ^ device());
+		for (;;) {
+			std::stringstream name;
+			name << "ann_tuner_" << std::hex << rng.next();
+			const auto path = std::filesystem::temp_directory_path() / name.str();
+			if (std::filesystem::create_directory(path)) {
+				return path;
+			}
+		}
+	}
+
+	// Copies a forest and its meta file into the DB. Each is renamed over the old one, so a forest
+	// another process has mapped is never overwritten, and the meta goes last so it always matches the forest
+	bool installForest(const std::filesystem::path& from, const std::filesystem::path& to) {
+		std::error_code error;
+		std::filesystem::remove(to / AnnTree::metaFileName, error);
+		for (const char* name : { AnnTree::fileName, AnnTree::metaFileName }) {
+			const auto tmpPath = std::filesystem::path((to / name).string() + ".tmp");
+			std::filesystem::copy_file(from / name, tmpPath, std::filesystem::copy_options::overwrite_existing, error);
+			if (!error) {
+				std::filesystem::rename(tmpPath, to / name, error);
+			}
+			if (error) {
+				std::cout << "Unable to copy " << (from / name) << " to " << to << ": " << error.message() << std::endl;
+				std::filesystem::remove(tmpPath, error);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// A configuration nobody beats on recall, p50 and p99 at once
+	void markPareto(std::vector<TuningResult>& results) {
+		for (auto& a : results) {
+			a.pareto = std::none_of(results.begin(), results.end(), [&a](const TuningResult& b) {
+				return b.recall >= a.recall && b.p50 <= a.p50 && b.p99 <= a.p99 &&
+					(b.recall > a.recall || b.p50 < a.p50 || b.p99 < a.p99);
+			});
+		}
+	}
+}
+
+int main(int argc, char* args[]) {
+	if (argc < 2) {
+		std::cout << "USAGE:" << std::endl << args[0] << " db-path [queries=N] [k=N] [recall=R] [trees=N,N,...] [search_k=N,N,...] [seed=N]" << std::endl;
+		std::cout << "  Measures recall@k of the ANN forest against the exact quadratic_Weights ranking, writes ann_tuning.csv" << std::endl;
+		std::cout << "  and saves the cheapest configuration reaching the target recall as the one of the DB" << std::endl;
+		return 1;
+	}
+	std::filesystem::path dbPath = args[1];
+	int queries = 200;
+	int k = 10;
+	float targetRecall = 0.9f;
+	std::vector<int> treeCounts = { 8, 16, 32, 64, AnnTree::defaultTrees };
+	std::vector<int> searchKs;
+	uint64_t seed = Random::defaultSeed;
+	for (int a = 2; a < argc; a++) {
+		if (strncmp(args[a], "queries=", strlen("queries=")) == 0)
+			queries = atoi(args[a] + strlen("queries="));
+		else if (strncmp(args[a], "k=", strlen("k=")) == 0)
+			k = atoi(args[a] + strlen("k="));
+		else if (strncmp(args[a], "recall=", strlen("recall=")) == 0)
+			targetRecall = std::strtof(args[a] + strlen("recall="), nullptr);
+		else if (strncmp(args[a], "trees=", strlen("trees=")) == 0)
+			treeCounts = parseList(args[a] + strlen("trees="));
+		else if (strncmp(args[a], "search_k=", strlen("search_k=")) == 0)
+			searchKs = parseList(args[a] + strlen("search_k="));
+		else if (strncmp(args[a], "seed=", strlen("seed=")) == 0)
+			seed = std::strtoull(args[a] + strlen("seed="), nullptr, 0);
+	}
+
+	const auto engine = Retriever::getEngine(dbPath);
+	if (!engine->isOpen()) {
+		return 1;
+	}
+	const FeatureStore& store = engine->getDatabase().getStore();
+	k = std::max(1, std::min(k, (int)store.rows() - 1));
+	queries = std::max(1, std::min(queries, (int)store.rows()));
+	if (searchKs.empty()) {
+		// Nodes inspected per query, from a few per result up to Annoy's default of trees * n
+		searchKs = { 10 * k, 50 * k, 200 * k, 1000 * k, AnnTree::defaultSearchK };
+	}
+
+	// Distinct query rows, a partial Fisher-Yates shuffle
+	std::vector<uint32_t> rows(store.rows());
+	std::iota(rows.begin(), rows.end(), 0);
+	Random::Engine rng(seed);
+	for (int q = 0; q < queries; q++) {
+		std::swap(rows[q], rows[q + rng.index((uint32_t)(rows.size() - q))]);
+	}
+	rows.resize(queries);
+
+	std::cout << "Exact top " << k << " of " << queries << " queries..." << std::endl;
+	std::vector<Retriever::SimilarShapes> truth(queries);
+	for (int q = 0; q < queries; q++) {
+		truth[q] = engine->query(rows[q], k, Retriever::DistanceMethod::quadratic_Weights, false);
+	}
+
+	// The candidate forests are built away from the DB, one directory per number of trees, and the
+	// measured forest of the chosen one is copied over the DB's: a new build would grow other trees
+	const auto scratchPath = makeScratchDirectory();
+	const auto candidatePath = [&scratchPath](int trees) { return scratchPath / ("trees_" + std::to_string(trees)); };
+	std::vector<TuningResult> results;
+	std::vector<int> result;
+	std::vector<float> distances;
+	std::vector<float> latencies(queries);
+	for (int trees : treeCounts) {
+		std::filesystem::create_directories(candidatePath(trees));
+		AnnOptions options;
+		options.trees = trees;
+		AnnTree tree;
+		auto t1 = std::chrono::high_resolution_clock::now();
+		if (!tree.open(candidatePath(trees), store, options)) {
+			std::filesystem::remove_all(scratchPath);
+			return 1;
+		}
+		auto t2 = std::chrono::high_resolution_clock::now();
+		const float buildSeconds = std::chrono::duration<float>(t2 - t1).count();
+
+		for (int searchK : searchKs) {
+			tree.setSearchK(searchK);
+			size_t found = 0;
+			for (int q = 0; q < queries; q++) {
+				t1 = std::chrono::high_resolution_clock::now();
+				tree.queryRow(rows[q], k + 1, result, distances);
+				t2 = std::chrono::high_resolution_clock::now();
+				latencies[q] = std::chrono::duration<float, std::milli>(t2 - t1).count();
+
+				// The query row itself is left out, like in the exact ranking
+				int kept = 0;
+				for (int r : result) {
+					if (r == (int)rows[q] || kept == k) {
+						continue;
+					}
+					kept++;
+					const auto path = store.path(r);
+					found += std::any_of(truth[q].begin(), truth[q].end(), [&path](const std::pair<std::string, float>& s) { return s.first == path; });
+				}
+			}
+			TuningResult r;
+			r.trees = trees;
+			r.searchK = searchK;
+			r.recall = (float)found / (float)(queries * k);
+			r.p50 = percentile(latencies, 0.5f);
+			r.p99 = percentile(latencies, 0.99f);
+			r.buildSeconds = buildSeconds;
+			r.pareto = false;
+			results.push_back(r);
+			std::cout << "trees " << trees << " search_k " << searchK << ": recall@" << k << " " << r.recall <<
+				", p50 " << r.p50 << " ms, p99 " << r.p99 << " ms" << std::endl;
+		}
+		tree.close();
+	}
+
+	markPareto(results);
+	std::ofstream tuningFile;
+	tuningFile.open("ann_tuning.csv");
+	tuningFile << "trees,search_k,recall,p50_ms,p99_ms,build_s,pareto\n";
+	for (const auto& r : results) {
+		tuningFile << r.trees << "," << r.searchK << "," << r.recall << "," << r.p50 << "," << r.p99 << "," << r.buildSeconds << "," << r.pareto << std::endl;
+	}
+	tuningFile.close();
+
+	// Cheapest is the lowest p50, then the lowest p99, then the smallest forest
+	const TuningResult* best = nullptr;
+	for (const auto& r : results) {
+		if (r.recall < targetRecall) {
+			continue;
+		}
+		if (!best || std::make_tuple(r.p50, r.p99, r.trees) < std::make_tuple(best->p50, best->p99, best->trees)) {
+			best = &r;
+		}
+	}
+	if (!best) {
+		std::cout << "No configuration reaches a recall of " << targetRecall << ", the DB forest is left as it is" << std::endl;
+		std::filesystem::remove_all(scratchPath);
+		return 1;
+	}
+
+	std::cout << "Saving trees " << best->trees << " search_k " << best->searchK << " (recall " << best->recall << ", p50 " << best->p50 << " ms)" << std::endl;
+	AnnOptions options;
+	options.trees = best->trees;
+	options.searchK = best->searchK;
+	AnnTree tree;
+	// The copied meta matches the store and the trees, so open loads the forest and only search_k is saved
+	const bool saved = installForest(candidatePath(best->trees), dbPath) && tree.open(dbPath, store, options) && tree.saveOptions();
+	tree.close();
+	std::filesystem::remove_all(scratchPath);
+	return saved ? 0 : 1;
+}
@@ -2,361 +2,434 @@
 
 #include "descriptors.hpp"
 #include "normalization.hpp"
-#include "igl/centroid.h"
+#include "surface_sampler.hpp"
 #include <math.h>
+#include <limits>
+#include <algorithm>
+#include <functional>
+#include <future>
+#include "QuickHull.hpp"
 
 #pragma warning( push )
 #pragma warning( disable : 4244)
 #pragma warning( disable : 4996)
 
-void Descriptors::computeDescriptors(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, unsigned int flags, DescriptorMap &feats) {
-	if (flags & descriptor_area) feats[FEAT_AREA_3D] = computeArea(V, F);
-	if (flags & descriptor_meshVolume) feats[FEAT_MVOLUME_3D] = computeMeshVolume(V, F);
-	if (flags & descriptor_boundingBoxVolume) feats[FEAT_BBVOLUME_3D] = computeBoundingBoxVolume(V, F);
-	if (flags & descriptor_compactness) feats[FEAT_COMPACTNESS_3D] = computeCompactness(std::get<float>(feats[FEAT_AREA_3D]), std::get<float>(feats[FEAT_MVOLUME_3D]));
-	if (flags & descriptor_eccentricity) feats[FEAT_ECCENTRICITY_3D] = computeEccentricity(V, F);
-	if (flags & descriptor_diameter) feats[FEAT_DIAMETER_3D] = computeDiameter(V, F);
-	if (flags & descriptor_a3) feats[FEAT_A3_3D] = computeA3Histogram(V, F, 10);
-	if (flags & descriptor_d1) feats[FEAT_D1_3D] = computeD1Histogram(V, F, 10);
-	if (flags & descriptor_d2) feats[FEAT_D2_3D] = computeD2Histogram(V, F, 10);
-	if (flags & descriptor_d3) feats[FEAT_D3_3D] = computeD3Histogram(V, F, 10);
-	if (flags & descriptor_d4) feats[FEAT_D4_3D] = computeD4Histogram(V, F, 10);
-}
-
-Histogram Descriptors::computeD1Histogram(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, int bins) {
-	const int nSamples = 500000;
-	Eigen::Vector3f centroid;
-	igl::centroid(V, F, centroid);
-	std::vector<float> values = distanceBetweenBarycenterAndRandomVertex(V, centroid, nSamples);
-
-	std::sort(values.begin(), values.end());
-	float min = values[0];
-	float max = values[values.size() - 1];
-	for(auto &a : values){
-		a = (float)(a - min)/(float)(max - min);
+namespace {
+	// A normalized copy of the counts so far, left empty when nothing was sampled
+	Histogram finishHistogram(const HistogramBuilder& builder, int nSamples) {
+		Histogram histogram = builder.build();
+		if (nSamples > 0) {
+			histogram.normalize();
+		}
+		histogram.setSamples(nSamples);
+		return histogram;
 	}
-	
-	Histogram histogram(bins);
-	histogram.populate(values);
-	histogram.normalize();
-	return histogram;
-}
 
-Histogram Descriptors::computeD2Histogram(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, int bins) {
-	const int nSamples = 500000;
-	std::vector<float> values = distanceBetween2RandomVeritces(V, nSamples);
+	// Two passes over the same sample stream: the first only tracks the range, the second replays the
+	// samples from a copy of the engine and bins them. Nothing is stored or sorted in between.
+	template<class Sampler>
+	Histogram streamHistogram(int bins, int nSamples, Random::Engine& rng, Descriptors::SampleSequence sequence, Sampler sample) {
+		// The Halton scrambling is drawn from the engine, so the replay copy rebuilds the same sequence
+		const auto run = [&](Random::Engine& r, auto&& sink) {
+			if (sequence == Descriptors::SampleSequence::Halton) {
+				Random::Halton halton(r);
+				sample(halton, nSamples, sink);
+			} else {
+				sample(r, nSamples, sink);
+			}
+		};
+
+		Random::Engine replay = rng;
+		float min = std::numeric_limits<float>::max();
+		float max = std::numeric_limits<float>::lowest();
+		run(rng, [&min, &max](const float* values, size_t n) {
+			for (size_t i = 0; i < n; i++) {
+				if (values[i] < min) min = values[i];
+				if (values[i] > max) max = values[i];
+			}
+		});
 
-	std::sort(values.begin(), values.end());
-	float min = values[0];
-	float max = values[values.size() - 1];
-	for(auto &a : values){
-		a = (float)(a - min)/(float)(max - min);
+		HistogramBuilder builder(bins, min, max);
+		run(replay, [&builder](const float* values, size_t n) { builder.add(values, n); });
+		return finishHistogram(builder, nSamples);
 	}
 
-	Histogram histogram(bins);
-	histogram.populate(values);
-	histogram.normalize();
-	return histogram;
-}
-
-Histogram Descriptors::computeD3Histogram(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, int bins) {
-	const int nSamples = 500000;
-	std::vector<float> values = sqrtAreaOfTriange3RandomVertices(V, nSamples);
-
-	std::sort(values.begin(), values.end());
-	float min = values[0];
-	float max = values[values.size() - 1];
-	for(auto &a : values){
-		a = (float)(a - min)/(float)(max - min);
+	// Doubling rounds until the histogram settles. A pilot of initialSamples fixes the bin range and is
+	// binned as the first round, later samples outside that range land in the edge bins. Every round only
+	// draws its new samples from the same source and adds them to the running counts, so all rounds
+	// together cost the final number of samples and consecutive histograms share their bins.
+	template<class Source, class Sampler>
+	Histogram adaptiveHistogram(int bins, const Descriptors::SamplingOptions& options, Source& source, Sampler sample) {
+		int nSamples = std::max(options.initialSamples, 1);
+		std::vector<float> pilot;
+		pilot.reserve(nSamples);
+		sample(source, nSamples, [&pilot](const float* values, size_t n) { pilot.insert(pilot.end(), values, values + n); });
+
+		float min = std::numeric_limits<float>::max();
+		float max = std::numeric_limits<float>::lowest();
+		for (float value : pilot) {
+			if (value < min) min = value;
+			if (value > max) max = value;
+		}
+		HistogramBuilder builder(bins, min, max);
+		builder.add(pilot.data(), pilot.size());
+
+		Histogram histogram = finishHistogram(builder, nSamples);
+		while (nSamples < options.samples) {
+			const int round = (int)std::min<int64_t>(nSamples, (int64_t)options.samples - nSamples);
+			sample(source, round, [&builder](const float* values, size_t n) { builder.add(values, n); });
+			nSamples += round;
+			Histogram next = finishHistogram(builder, nSamples);
+			const float change = (options.metric == Descriptors::ConvergenceMetric::EMD)
+				? Histogram::emdDistance(histogram, next)
+				: Histogram::l1Distance(histogram, next);
+			histogram = next;
+			if (change < options.tolerance) break;
+		}
+		return histogram;
 	}
-	
-	Histogram histogram(bins);
-	histogram.populate(values);
-	histogram.normalize();
-	return histogram;
-}
-
-Histogram Descriptors::computeD4Histogram(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, int bins) {
-	const int nSamples = 500000;
-	std::vector<float> values = cubeRootVolumeTetrahedron4RandomVertices(V, nSamples);
 
-	std::sort(values.begin(), values.end());
-	float min = values[0];
-	float max = values[values.size() - 1];
-	for(auto &a : values){
-		a = (float)(a - min)/(float)(max - min);
+	// Fixed budget, or adaptive rounds on the engine or on one Halton sequence drawn from it
+	template<class Sampler>
+	Histogram sampleHistogram(int bins, const Descriptors::SamplingOptions& options, Random::Engine& rng, Sampler sample) {
+		if (!options.adaptive || options.initialSamples >= options.samples) {
+			return streamHistogram(bins, options.samples, rng, options.sequence, sample);
+		}
+		if (options.sequence == Descriptors::SampleSequence::Halton) {
+			Random::Halton halton(rng);
+			return adaptiveHistogram(bins, options, halton, sample);
+		}
+		return adaptiveHistogram(bins, options, rng, sample);
 	}
 
-	Histogram histogram(bins);
-	histogram.populate(values);
-	histogram.normalize();
-	return histogram;
-}
-
-Histogram Descriptors::computeA3Histogram(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, int bins) {
-	const int nSamples = 500000;
-	std::vector<float> values = computeAngle3RandomVertices(V, nSamples);
-	std::sort(values.begin(), values.end());
-	float min = values[0];
-	float max = values[values.size() - 1];
-	for(auto &a : values){
-		a = (float)(a - min)/(float)(max - min);
+	// Stream of the point pool, next to the per-feature streams
+	const uint64_t poolStream = 0x53555246ULL;
+
+	// Index tuples are drawn a block at a time and evaluated by the batched kernels.
+	// Source is either a Random::Engine or a Random::Halton.
+	const size_t sampleBlock = 256;
+
+	template<class Source, class Sink>
+	void computeAngle3RandomVertices(const SampleKernels::SoAPoints& P, int numberOfSamples, Source& rng, Sink&& sink) {
+
+		// -->    -->   --->   --->
+		// AB dot BC = ||AB|| ||BC|| cos(theta)
+		//
+		//                 -->    -->
+	    //               ( AB dot BC )
+	    // theta = arccos( --------- )
+		//               (  --->   ---> )}
+		//               || AB|| ||BC || )
+
+		const uint32_t rows = P.size();
+		uint32_t a[sampleBlock], b[sampleBlock], c[sampleBlock], v[3];
+		float angleResults[sampleBlock];
+
+		for (int done = 0; done < numberOfSamples; done += sampleBlock) {
+			const size_t n = std::min<size_t>(sampleBlock, numberOfSamples - done);
+			for (size_t i = 0; i < n; i++) {
+				rng.distinctIndices(rows, v);
+				a[i] = v[0]; b[i] = v[1]; c[i] = v[2];
+			}
+			SampleKernels::angle(P, a, b, c, angleResults, n);
+			sink(angleResults, n);
+		}
 	}
 
-	Histogram histogram(bins);
-	histogram.populate(values);
-	histogram.normalize();
-	return histogram;
-}
-
-float Descriptors::computeArea(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F) {
-	auto meshArea = 0.0f;
-	for (int f = 0; f < F.rows(); f++) {
+	template<class Source, class Sink>
+	void distanceBetween2RandomVeritces(const SampleKernels::SoAPoints& P, int numberOfSamples, Source& rng, Sink&& sink) {
 
-		auto point1 = V.row(F(f, 0));
-		auto point2 = V.row(F(f, 1));
-		auto point3 = V.row(F(f, 2));
+		const uint32_t rows = P.size();
+		uint32_t a[sampleBlock], b[sampleBlock], v[2];
+		float distanceResults[sampleBlock];
 
-		Eigen::Vector3f vecA = point1 - point2;
-		Eigen::Vector3f vecB = point1 - point3;
-		float triangleArea = vecA.cross(vecB).norm() / 2;
-		meshArea += triangleArea;
+		for (int done = 0; done < numberOfSamples; done += sampleBlock) {
+			const size_t n = std::min<size_t>(sampleBlock, numberOfSamples - done);
+			for (size_t i = 0; i < n; i++) {
+				rng.distinctIndices(rows, v);
+				a[i] = v[0]; b[i] = v[1];
+			}
+			SampleKernels::distance(P, a, b, distanceResults, n);
+			sink(distanceResults, n);
+		}
 	}
 
-	return meshArea;
-}
-
-float Descriptors::computeMeshVolume(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F) {
+	template<class Source, class Sink>
+	void distanceBetweenBarycenterAndRandomVertex(const SampleKernels::SoAPoints& P, const Eigen::Vector3f& centroid, int numberOfSamples, Source& rng, Sink&& sink) {
 
-	auto meshVolume = 0.0f;
-	for (int f = 0; f < F.rows(); f++) {
+		const uint32_t rows = P.size();
+		const float c[3] = { centroid.x(), centroid.y(), centroid.z() };
+		uint32_t a[sampleBlock];
+		float distanceResults[sampleBlock];
 
-		Eigen::Vector3f point1 = V.row(F(f, 0));
-		Eigen::Vector3f point2 = V.row(F(f, 1));
-		Eigen::Vector3f point3 = V.row(F(f, 2));
-
-		meshVolume += (point1.cross(point2)).dot(point3);
+		for (int done = 0; done < numberOfSamples; done += sampleBlock) {
+			const size_t n = std::min<size_t>(sampleBlock, numberOfSamples - done);
+			for (size_t i = 0; i < n; i++) {
+				a[i] = rng.index(rows);
+			}
+			SampleKernels::distanceToPoint(P, c, a, distanceResults, n);
+			sink(distanceResults, n);
+		}
 	}
 
-	return std::abs(meshVolume) / 6;
-}
-
-float Descriptors::computeBoundingBoxVolume(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F) {
-	Eigen::Vector3f min = V.colwise().minCoeff();
-	Eigen::Vector3f max = V.colwise().maxCoeff();
-
-	Eigen::Vector3f diff = max - min;
-	diff = diff.array().abs();
-
-	return diff.x() * diff.y() * diff.z();
-}
-
-float Descriptors::computeCompactness(float area, float volume) {
-	return pow(area, 3) / (36 * M_PI * volume * volume);
-}
-
-float Descriptors::computeEccentricity(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F) {
-	Eigen::Vector3f centroid;
-	igl::centroid(V, F, centroid);
-	const auto covarianceMatrix = Normalization::calculateCovarianceMatrix(V, centroid);
-	const auto eigen = Normalization::calculateEigen(covarianceMatrix);
-	return std::abs(eigen[2].second) / std::abs(eigen[0].second);
-}
+	template<class Source, class Sink>
+	void sqrtAreaOfTriange3RandomVertices(const SampleKernels::SoAPoints& P, int numberOfSamples, Source& rng, Sink&& sink) {
 
-float Descriptors::computeDiameter(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F) {
+		const uint32_t rows = P.size();
+		uint32_t a[sampleBlock], b[sampleBlock], c[sampleBlock], v[3];
+		float areaResults[sampleBlock];
 
-	auto max_distance = 0.0f;
-	// Naive Solution N^2
-	// This should be computed on the convex hull of a mesh, not the mesh itself!
-	for (int i = 0; i < V.rows(); i++) {
-
-		const auto pointA = V.row(i);
-		for (int j = 0; j < V.rows(); j++) {
-			const auto pointB = V.row(j);
-			const auto diff = pointA - pointB;
-			const auto distance = diff.norm();
-			if (distance > max_distance) {
-				max_distance = distance;
+		for (int done = 0; done < numberOfSamples; done += sampleBlock) {
+			const size_t n = std::min<size_t>(sampleBlock, numberOfSamples - done);
+			for (size_t i = 0; i < n; i++) {
+				rng.distinctIndices(rows, v);
+				a[i] = v[0]; b[i] = v[1]; c[i] = v[2];
 			}
+			SampleKernels::sqrtTriangleArea(P, a, b, c, areaResults, n);
+			sink(areaResults, n);
 		}
 	}
 
-	return max_distance;
-}
-
-std::vector<float> Descriptors::computeAngle3RandomVertices(const Eigen::MatrixXf& Vertices, int numberOfSamples) {
-
-	// -->    -->   --->   --->
-	// AB dot BC = ||AB|| ||BC|| cos(theta)
-	//
-	//                 -->    -->
-    //               ( AB dot BC )
-    // theta = arccos( --------- )
-	//               (  --->   ---> )}
-	//               || AB|| ||BC || )
-
-	std::vector<float> angleResults;
-	const auto cubeRootOfSamples = std::cbrt(numberOfSamples);
-
-	for (int firstLoop = 0; firstLoop < cubeRootOfSamples; firstLoop++) {
-		const auto v1 = rand() % Vertices.rows();
-		const Eigen::Vector3f pointA = Vertices.row(v1);
+	template<class Source, class Sink>
+	void cubeRootVolumeTetrahedron4RandomVertices(const SampleKernels::SoAPoints& P, int numberOfSamples, Source& rng, Sink&& sink) {
 
-		for (int secondLoop = 0; secondLoop < cubeRootOfSamples; secondLoop++) {
-			auto v2 = rand() % Vertices.rows();
+		//  V=1/6|(a×b)⋅c|
+		const uint32_t rows = P.size();
+		uint32_t a[sampleBlock], b[sampleBlock], c[sampleBlock], d[sampleBlock], v[4];
+		float volumeResults[sampleBlock];
 
-			while (v2 == v1) {
-				v2 = rand() % Vertices.rows();
+		for (int done = 0; done < numberOfSamples; done += sampleBlock) {
+			const size_t n = std::min<size_t>(sampleBlock, numberOfSamples - done);
+			for (size_t i = 0; i < n; i++) {
+				rng.distinctIndices(rows, v);
+				a[i] = v[0]; b[i] = v[1]; c[i] = v[2]; d[i] = v[3];
 			}
+			SampleKernels::tetrahedronVolume(P, a, b, c, d, volumeResults, n);
+			sink(volumeResults, n);
+		}
+	}
+}
 
-			const Eigen::Vector3f pointB = Vertices.row(v2);
-
-			for (int thirdLoop = 0; thirdLoop < cubeRootOfSamples; thirdLoop++) {
-				auto v3 = rand() % Vertices.rows();
-
-				while (v3 == v1 || v3 == v2) {
-					v3 = rand() % Vertices.rows();
-				}
-
-				const Eigen::Vector3f pointC = Vertices.row(v3);
-
-				const Eigen::Vector3f AB = pointB - pointA;
-				const Eigen::Vector3f BC = pointC - pointB;
+namespace {
+	// Everything a descriptor can read: the mesh, the shared intermediates and the descriptors computed before it.
+	// Descriptors of the same round write to different slots of values, so they can run concurrently.
+	struct DescriptorInputs {
+		const Eigen::MatrixXf& V;
+		const Eigen::MatrixXi& F;
+		const Descriptors::SamplingOptions& options;
+		Moments::MeshMoments moments;
+		SampleKernels::SoAPoints hull;
+		SampleKernels::SoAPoints pool;
+		FeatureRecord values;
+	};
+
+	struct DescriptorInfo {
+		Descriptors::descriptors3D flag;
+		Features feature;
+		unsigned int descriptors;		// descriptors it is computed from
+		unsigned int intermediates;		// intermediates3D it reads
+		void (*compute)(DescriptorInputs& in);		// writes its slot of in.values
+	};
+
+	// Every shape distribution gets its own stream, so the result of one does not depend on which others were requested
+	template<Features feature>
+	Random::Engine featureEngine(const DescriptorInputs& in) {
+		return Random::Engine(Random::streamSeed(in.options.seed, feature));
+	}
 
-				const auto dotProduct = AB.dot(BC);
-				const auto theta = acos(dotProduct / (AB.norm() * BC.norm()));
-				angleResults.push_back(theta);
-			}
+	using namespace Descriptors;
+	const DescriptorInfo registry[] = {
+		{ descriptor_area, FEAT_AREA_3D, 0, intermediate_moments,
+			[](DescriptorInputs& in) { in.values.setScalar(FEAT_AREA_3D, in.moments.area); } },
+		{ descriptor_meshVolume, FEAT_MVOLUME_3D, 0, intermediate_moments,
+			[](DescriptorInputs& in) { in.values.setScalar(FEAT_MVOLUME_3D, std::abs(in.moments.signedVolume)); } },
+		{ descriptor_boundingBoxVolume, FEAT_BBVOLUME_3D, 0, intermediate_moments,
+			[](DescriptorInputs& in) { in.values.setScalar(FEAT_BBVOLUME_3D, computeBoundingBoxVolume(in.moments)); } },
+		{ descriptor_diameter, FEAT_DIAMETER_3D, 0, intermediate_hull,
+			[](DescriptorInputs& in) { in.values.setScalar(FEAT_DIAMETER_3D, computeDiameter(in.hull)); } },
+		{ descriptor_compactness, FEAT_COMPACTNESS_3D, descriptor_area | descriptor_meshVolume, 0,
+			[](DescriptorInputs& in) {
+				in.values.setScalar(FEAT_COMPACTNESS_3D, computeCompactness(in.values.scalar(FEAT_AREA_3D), in.values.scalar(FEAT_MVOLUME_3D)));
+			} },
+		{ descriptor_eccentricity, FEAT_ECCENTRICITY_3D, 0, intermediate_moments,
+			[](DescriptorInputs& in) { in.values.setScalar(FEAT_ECCENTRICITY_3D, computeEccentricity(in.moments)); } },
+		{ descriptor_a3, FEAT_A3_3D, 0, intermediate_pool,
+			[](DescriptorInputs& in) { auto rng = featureEngine<FEAT_A3_3D>(in); in.values.setHistogram(FEAT_A3_3D, computeA3Histogram(in.pool, FeatureRecord::histogramBins, in.options, rng)); } },
+		{ descriptor_d1, FEAT_D1_3D, 0, intermediate_pool | intermediate_moments,
+			[](DescriptorInputs& in) { auto rng = featureEngine<FEAT_D1_3D>(in); in.values.setHistogram(FEAT_D1_3D, computeD1Histogram(in.pool, in.moments.centroid, FeatureRecord::histogramBins, in.options, rng)); } },
+		{ descriptor_d2, FEAT_D2_3D, 0, intermediate_pool,
+			[](DescriptorInputs& in) { auto rng = featureEngine<FEAT_D2_3D>(in); in.values.setHistogram(FEAT_D2_3D, computeD2Histogram(in.pool, FeatureRecord::histogramBins, in.options, rng)); } },
+		{ descriptor_d3, FEAT_D3_3D, 0, intermediate_pool,
+			[](DescriptorInputs& in) { auto rng = featureEngine<FEAT_D3_3D>(in); in.values.setHistogram(FEAT_D3_3D, computeD3Histogram(in.pool, FeatureRecord::histogramBins, in.options, rng)); } },
+		{ descriptor_d4, FEAT_D4_3D, 0, intermediate_pool,
+			[](DescriptorInputs& in) { auto rng = featureEngine<FEAT_D4_3D>(in); in.values.setHistogram(FEAT_D4_3D, computeD4Histogram(in.pool, FeatureRecord::histogramBins, in.options, rng)); } },
+	};
+
+	// Runs the jobs on their own threads, or in order on this one
+	void runAll(std::vector<std::function<void()>>& jobs, bool parallel) {
+		if (!parallel || jobs.size() < 2) {
+			for (auto& job : jobs) job();
+			return;
+		}
+		std::vector<std::future<void>> futures;
+		for (size_t i = 1; i < jobs.size(); i++) {
+			futures.push_back(std::async(std::launch::async, jobs[i]));
 		}
+		jobs[0]();
+		for (auto& f : futures) f.get();
 	}
-
-	return angleResults;
 }
 
-float Descriptors::distanceBetweenTwoPoints(const Eigen::Vector3f& pointA, const Eigen::Vector3f& pointB) {
-	// d = ((x2 - x1)2 + (y2 - y1)2 + (z2 - z1)2) ^ 1/2 
-	return sqrt(pow(pointB.x() - pointA.x(), 2) + pow(pointB.y() - pointA.y(), 2) + pow(pointB.z() - pointA.z(), 2));
+unsigned int Descriptors::dependencyClosure(unsigned int flags) {
+	unsigned int closure = 0;
+	for (const auto& d : registry) {
+		if (flags & d.flag) closure |= d.flag;
+	}
+	// The registry is short, iterate until nothing new gets pulled in
+	unsigned int previous;
+	do {
+		previous = closure;
+		for (const auto& d : registry) {
+			if (closure & d.flag) closure |= d.descriptors;
+		}
+	} while (closure != previous);
+	return closure;
 }
 
-std::vector<float> Descriptors::distanceBetween2RandomVeritces(const Eigen::MatrixXf& Vertices, int numberOfSamples) {
-
-	std::vector<float> distanceResults;
-	const auto squareRootOfSamples = std::sqrt(numberOfSamples);
-
-	for (int firstLoop = 0; firstLoop < squareRootOfSamples; firstLoop++) {
-		const auto v1 = rand() % Vertices.rows();
-		const Eigen::Vector3f pointA = Vertices.row(v1);
-
-		for (int secondLoop = 0; secondLoop < squareRootOfSamples; secondLoop++) {
-			auto v2 = rand() % Vertices.rows();
+unsigned int Descriptors::requiredIntermediates(unsigned int flags) {
+	unsigned int intermediates = 0;
+	for (const auto& d : registry) {
+		if (flags & d.flag) intermediates |= d.intermediates;
+	}
+	return intermediates;
+}
 
-			while (v2 == v1) {
-				v2 = rand() % Vertices.rows();
+void Descriptors::computeDescriptors(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, unsigned int flags, FeatureRecord &feats, const SamplingOptions& options, bool parallel) {
+	const unsigned int closure = dependencyClosure(flags);
+	const unsigned int intermediates = requiredIntermediates(closure);
+	DescriptorInputs in{ V, F, options };
+
+	std::vector<std::function<void()>> jobs;
+	if (intermediates & intermediate_moments) jobs.push_back([&in]() { in.moments = Moments::computeMoments(in.V, in.F); });
+	if (intermediates & intermediate_hull) jobs.push_back([&in]() { in.hull = convexHullPoints(in.V); });
+	if (intermediates & intermediate_pool) jobs.push_back([&in]() { in.pool = samplePoints(in.V, in.F, in.options); });
+	runAll(jobs, parallel);
+
+	// Every round runs the descriptors whose inputs are all done, they write to separate slots
+	unsigned int done = 0;
+	while (done != closure) {
+		jobs.clear();
+		unsigned int ready = 0;
+		for (const auto& d : registry) {
+			if ((closure & d.flag) && !(done & d.flag) && (d.descriptors & ~done) == 0) {
+				ready |= d.flag;
+				jobs.push_back([&in, &d]() { d.compute(in); });
 			}
-
-			const Eigen::Vector3f pointB = Vertices.row(v2);
-			distanceResults.push_back(distanceBetweenTwoPoints(pointA, pointB));
 		}
+		runAll(jobs, parallel);
+		done |= ready;
 	}
 
-	return distanceResults;
+	for (const auto& d : registry) {
+		if (flags & d.flag) feats.copyFeature(in.values, d.feature);
+	}
 }
 
-std::vector<float> Descriptors::distanceBetweenBarycenterAndRandomVertex(const Eigen::MatrixXf& V, const Eigen::Vector3f& centroid, int numberOfSamples) {
-
-	std::vector<float> distanceResults;
-	for (int i = 0; i < numberOfSamples; i++) {
-		const auto v1 = rand() % V.rows();
-		const Eigen::Vector3f pointA = V.row(v1);
-
-		distanceResults.push_back(distanceBetweenTwoPoints(centroid, pointA));
+SampleKernels::SoAPoints Descriptors::samplePoints(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, const SamplingOptions& options) {
+	Random::Engine rng(Random::streamSeed(options.seed, poolStream));
+	if (options.domain == SampleDomain::Surface) {
+		return SurfaceSampler::samplePoints(V, F, options.poolPoints, rng);
 	}
+	return SurfaceSampler::sampleVertices(V, options.poolPoints, rng);
+}
 
-	return distanceResults;
+Histogram Descriptors::computeD1Histogram(const SampleKernels::SoAPoints& P, const Eigen::Vector3f& centroid, int bins, const SamplingOptions& options, Random::Engine& rng) {
+	return sampleHistogram(bins, options, rng, [&](auto& r, int nSamples, auto&& sink) {
+		distanceBetweenBarycenterAndRandomVertex(P, centroid, nSamples, r, sink);
+	});
 }
 
-std::vector<float> Descriptors::sqrtAreaOfTriange3RandomVertices(const Eigen::MatrixXf& Vertices, int numberOfSamples) {
+Histogram Descriptors::computeD2Histogram(const SampleKernels::SoAPoints& P, int bins, const SamplingOptions& options, Random::Engine& rng) {
+	return sampleHistogram(bins, options, rng, [&](auto& r, int nSamples, auto&& sink) {
+		distanceBetween2RandomVeritces(P, nSamples, r, sink);
+	});
+}
 
-	std::vector<float> areaResults;
-	const auto cubeRootOfSamples = std::cbrt(numberOfSamples);
+Histogram Descriptors::computeD3Histogram(const SampleKernels::SoAPoints& P, int bins, const SamplingOptions& options, Random::Engine& rng) {
+	return sampleHistogram(bins, options, rng, [&](auto& r, int nSamples, auto&& sink) {
+		sqrtAreaOfTriange3RandomVertices(P, nSamples, r, sink);
+	});
+}
 
-	for (int firstLoop = 0; firstLoop < cubeRootOfSamples; firstLoop++) {
-		const auto v1 = rand() % Vertices.rows();
-		const Eigen::Vector3f pointA = Vertices.row(v1);
+Histogram Descriptors::computeD4Histogram(const SampleKernels::SoAPoints& P, int bins, const SamplingOptions& options, Random::Engine& rng) {
+	return sampleHistogram(bins, options, rng, [&](auto& r, int nSamples, auto&& sink) {
+		cubeRootVolumeTetrahedron4RandomVertices(P, nSamples, r, sink);
+	});
+}
 
-		for (int secondLoop = 0; secondLoop < cubeRootOfSamples; secondLoop++) {
-			auto v2 = rand() % Vertices.rows();
+Histogram Descriptors::computeA3Histogram(const SampleKernels::SoAPoints& P, int bins, const SamplingOptions& options, Random::Engine& rng) {
+	return sampleHistogram(bins, options, rng, [&](auto& r, int nSamples, auto&& sink) {
+		computeAngle3RandomVertices(P, nSamples, r, sink);
+	});
+}
 
-			while (v2 == v1) {
-				v2 = rand() % Vertices.rows();
-			}
+float Descriptors::computeBoundingBoxVolume(const Moments::MeshMoments& moments) {
+	Eigen::Vector3f diff = moments.bbMax - moments.bbMin;
+	diff = diff.array().abs();
 
-			const Eigen::Vector3f pointB = Vertices.row(v2);
+	return diff.x() * diff.y() * diff.z();
+}
 
-			for (int thirdLoop = 0; thirdLoop < cubeRootOfSamples; thirdLoop++) {
-				auto v3 = rand() % Vertices.rows();
+float Descriptors::computeCompactness(float area, float volume) {
+	return pow(area, 3) / (36 * M_PI * volume * volume);
+}
 
-				while (v3 == v1 || v3 == v2) {
-					v3 = rand() % Vertices.rows();
-				}
+float Descriptors::computeEccentricity(const Moments::MeshMoments& moments) {
+	const auto eigen = Normalization::calculateEigen(moments.covariance);
+	return std::abs(eigen[2].second) / std::abs(eigen[0].second);
+}
 
-				const Eigen::Vector3f pointC = Vertices.row(v3);
+SampleKernels::SoAPoints Descriptors::convexHullPoints(const Eigen::MatrixXf& V) {
+	if (V.rows() < 4) return SampleKernels::toSoA(V);
 
-				Eigen::Vector3f BA = pointA - pointB;
-				Eigen::Vector3f CA = pointA - pointC;
-				float triangleArea = (BA.cross(CA)).norm() / 2;
-				areaResults.push_back(sqrt(triangleArea));
-			}
-		}
+	quickhull::QuickHull<float> qh;
+	std::vector<quickhull::Vector3<float>> pointCloud;
+	pointCloud.reserve(V.rows());
+	for (int i = 0; i < V.rows(); i++) {
+		pointCloud.push_back(quickhull::Vector3<float>(V(i, 0), V(i, 1), V(i, 2)));
 	}
-
-	return areaResults;
+	auto hull = qh.getConvexHull(pointCloud, true, false);
+	const auto& vertexBuffer = hull.getVertexBuffer();
+	if (vertexBuffer.size() == 0) return SampleKernels::toSoA(V);
+
+	SampleKernels::SoAPoints P;
+	for (const auto& v : vertexBuffer) {
+		P.x.push_back(v.x);
+		P.y.push_back(v.y);
+		P.z.push_back(v.z);
+	}
+	return P;
 }
 
-std::vector<float> Descriptors::cubeRootVolumeTetrahedron4RandomVertices(const Eigen::MatrixXf& Vertices, int numberOfSamples) {
-
-	//  V=1/6|(a×b)⋅c|
-	std::vector<float> volumeResults;
-	const auto fourthRootOfSamples = std::pow(numberOfSamples, 1.0 / 4);
-	for (int firstLoop = 0; firstLoop < fourthRootOfSamples; firstLoop++) {
-		const auto v1 = rand() % Vertices.rows();
-		const Eigen::Vector3f pointA = Vertices.row(v1);
-
-		for (int secondLoop = 0; secondLoop < fourthRootOfSamples; secondLoop++) {
-			auto v2 = rand() % Vertices.rows();
-
-			while (v2 == v1) {
-				v2 = rand() % Vertices.rows();
-			}
-
-			const Eigen::Vector3f pointB = Vertices.row(v2);
-
-			for (int thirdLoop = 0; thirdLoop < fourthRootOfSamples; thirdLoop++) {
-				auto v3 = rand() % Vertices.rows();
-
-				while (v3 == v1 || v3 == v2) {
-					v3 = rand() % Vertices.rows();
-				}
-
-				const Eigen::Vector3f pointC = Vertices.row(v3);
-
-				for (int fourthLoop = 0; fourthLoop < fourthRootOfSamples; fourthLoop++) {
-					auto v4 = rand() % Vertices.rows();
-
-					while (v4 == v1 || v4 == v2 || v4 == v3) {
-						v4 = rand() % Vertices.rows();
-					}
-
-					const Eigen::Vector3f pointD = Vertices.row(v4);
-
-					auto cubeRootVolume = abs((pointA - pointD).dot((pointB - pointD).cross(pointC - pointD))) / 6;
-					volumeResults.push_back(cubeRootVolume);
-				}
-			}
+float Descriptors::computeDiameter(const SampleKernels::SoAPoints& hull) {
+	// Pairs are compared by squared distance, the inner loop vectorizes
+	float maxSquared = 0.0f;
+	const size_t n = hull.size();
+	for (size_t i = 0; i < n; i++) {
+		const float x = hull.x[i], y = hull.y[i], z = hull.z[i];
+		for (size_t j = i + 1; j < n; j++) {
+			const float dx = hull.x[j] - x;
+			const float dy = hull.y[j] - y;
+			const float dz = hull.z[j] - z;
+			maxSquared = std::max(maxSquared, dx * dx + dy * dy + dz * dz);
 		}
 	}
+	return std::sqrt(maxSquared);
+}
 
-	return volumeResults;
+float Descriptors::distanceBetweenTwoPoints(const Eigen::Vector3f& pointA, const Eigen::Vector3f& pointB) {
+	// d = ((x2 - x1)2 + (y2 - y1)2 + (z2 - z1)2) ^ 1/2 
+	return sqrt(pow(pointB.x() - pointA.x(), 2) + pow(pointB.y() - pointA.y(), 2) + pow(pointB.z() - pointA.z(), 2));
 }
 
 #pragma warning( pop )
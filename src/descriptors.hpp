@@ -4,34 +4,41 @@
 #include "Eigen/Dense"
 #include "utils.hpp"
 #include "histogram.hpp"
-#include <variant>
+#include "feature_record.hpp"
+#include "random.hpp"
+#include "moments.hpp"
+#include "sample_kernels.hpp"
+#include "sampling_options.hpp"
 #include <vector>
 #include <map>
 
-typedef std::variant<int, float, Histogram> DescriptorType;
-typedef std::unordered_map<Features, DescriptorType> DescriptorMap;
-
 namespace Descriptors {
-		void computeDescriptors(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, unsigned int flags, DescriptorMap &feats);
-		float computeArea(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F);
-		float computeMeshVolume(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F);
-		float computeBoundingBoxVolume(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F);
-		float computeCompactness(float m_area, float m_meshVolume);
-		float computeEccentricity(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F);
-		float computeDiameter(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F);
+		// Computes the requested descriptors and only what they depend on (see dependencyClosure).
+		// Only the requested features of feats are written, the others keep their values.
+		// With parallel set, the shared intermediates and then the independent descriptors run concurrently.
+		void computeDescriptors(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, unsigned int flags, FeatureRecord &feats, const SamplingOptions& options = SamplingOptions(), bool parallel = false);
+		// The requested descriptors plus every descriptor they are computed from, transitively
+		unsigned int dependencyClosure(unsigned int flags);
+		// The intermediates3D the given descriptors need
+		unsigned int requiredIntermediates(unsigned int flags);
 
-		std::vector<float> computeAngle3RandomVertices(const Eigen::MatrixXf& Vertices, int numberOfSamples);
-		std::vector<float> distanceBetween2RandomVeritces(const Eigen::MatrixXf& Vertices, int numberOfSamples);
-		std::vector<float> distanceBetweenBarycenterAndRandomVertex(const Eigen::MatrixXf& V, const Eigen::Vector3f& centroid, int numberOfSamples);
-		std::vector<float> sqrtAreaOfTriange3RandomVertices(const Eigen::MatrixXf& Vertices, int numberOfSamples);
-		std::vector<float> cubeRootVolumeTetrahedron4RandomVertices(const Eigen::MatrixXf& Vertices, int numberOfSamples);
+		// Area, volume and centroid come straight from Moments::computeMoments
+		float computeBoundingBoxVolume(const Moments::MeshMoments& moments);
+		float computeCompactness(float m_area, float m_meshVolume);
+		float computeEccentricity(const Moments::MeshMoments& moments);
+		// The farthest pair of points is always on the convex hull, so only its vertices are compared
+		SampleKernels::SoAPoints convexHullPoints(const Eigen::MatrixXf& V);
+		float computeDiameter(const SampleKernels::SoAPoints& hull);
 
+		// The compact point pool the shape distributions sample from, built once and shared by all of them
+		SampleKernels::SoAPoints samplePoints(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, const SamplingOptions& options);
 
-		Histogram computeA3Histogram(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, int bins);
-		Histogram computeD1Histogram(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, int bins);
-		Histogram computeD2Histogram(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, int bins);
-		Histogram computeD3Histogram(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, int bins);
-		Histogram computeD4Histogram(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, int bins);
+		// The returned histograms report the samples they were built from through Histogram::getSamples
+		Histogram computeA3Histogram(const SampleKernels::SoAPoints& P, int bins, const SamplingOptions& options, Random::Engine& rng);
+		Histogram computeD1Histogram(const SampleKernels::SoAPoints& P, const Eigen::Vector3f& centroid, int bins, const SamplingOptions& options, Random::Engine& rng);
+		Histogram computeD2Histogram(const SampleKernels::SoAPoints& P, int bins, const SamplingOptions& options, Random::Engine& rng);
+		Histogram computeD3Histogram(const SampleKernels::SoAPoints& P, int bins, const SamplingOptions& options, Random::Engine& rng);
+		Histogram computeD4Histogram(const SampleKernels::SoAPoints& P, int bins, const SamplingOptions& options, Random::Engine& rng);
 
 		float distanceBetweenTwoPoints(const Eigen::Vector3f& pointA, const Eigen::Vector3f& pointB);
 
@@ -47,9 +54,17 @@ namespace Descriptors {
 			descriptor_d1					= 1 << 7,
 			descriptor_d2					= 1 << 8,
 			descriptor_d3					= 1 << 9,
-			descriptor_d4					= 1 << 9,
+			descriptor_d4					= 1 << 10,
 			descriptor_all					= ~0x0000 & 0xFFFF 
 		};
+
+		// Per-mesh data shared by several descriptors, computed at most once per computeDescriptors call
+		enum intermediates3D : uint16_t
+		{
+			intermediate_moments			= 1 << 0,	// area, volume, centroid, bounding box, covariance
+			intermediate_hull				= 1 << 1,	// convex hull vertices
+			intermediate_pool				= 1 << 2	// sample point pool of the shape distributions
+		};
 };
 
 #endif
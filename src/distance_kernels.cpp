@@ -0,0 +1,248 @@
+#include "distance_kernels.hpp"
+#include "feature_record.hpp"
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define DISTANCE_KERNELS_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DISTANCE_KERNELS_SSE
+#endif
+
+namespace DistanceKernels {
+
+	namespace {
+		const int histogramLast[FeatureRecord::histograms] = {
+			FeatureRecord::offset(FEAT_A3_3D) + FeatureRecord::histogramBins - 1,
+			FeatureRecord::offset(FEAT_D1_3D) + FeatureRecord::histogramBins - 1,
+			FeatureRecord::offset(FEAT_D2_3D) + FeatureRecord::histogramBins - 1,
+			FeatureRecord::offset(FEAT_D3_3D) + FeatureRecord::histogramBins - 1,
+			FeatureRecord::offset(FEAT_D4_3D) + FeatureRecord::histogramBins - 1
+		};
+
+		// vectorDistance without squareDistance only keeps the difference of the last values
+		inline float scalarFlat(float val, bool useSqrt) {
+			if (useSqrt) {
+				return val > 0.0f ? std::sqrt(val) : 0.0f;
+			}
+			return val > 0.0f ? val : 0.0f;
+		}
+
+		// Scalar version, used for the tails and on non-x86 targets
+		inline float scalarRow(const float* const* columns, const float* query, const ScanWeights& w, size_t r) {
+			float singleValueDistance;
+			if (w.squareDistance) {
+				float val = 0.0f;
+				for (int d = 0; d < FeatureRecord::scalars; d++) {
+					double dist = query[d] - columns[d][r];
+					val += dist * dist * w.scalarWeights[d];
+				}
+				singleValueDistance = scalarFlat(val, w.useSqrt);
+			} else {
+				const int last = FeatureRecord::scalars - 1;
+				singleValueDistance = scalarFlat(query[last] - columns[last][r], w.useSqrt);
+			}
+			float total = singleValueDistance * w.functionWeights[0];
+			if (w.flatHistograms) {
+				for (int h = 0; h < FeatureRecord::histograms; h++) {
+					total = total + scalarFlat(query[histogramLast[h]] - columns[histogramLast[h]][r], w.useSqrt) * w.functionWeights[h + 1];
+				}
+			}
+			return total;
+		}
+
+#if defined(DISTANCE_KERNELS_AVX2)
+		const size_t width = 8;
+		typedef __m256 vfloat;
+		typedef __m256d vdouble;
+
+		inline vfloat load(const float* p) { return _mm256_loadu_ps(p); }
+		inline vfloat gather(const float* p, const uint32_t* idx) { return _mm256_i32gather_ps(p, _mm256_loadu_si256((const __m256i*)idx), 4); }
+		inline vfloat set1(float a) { return _mm256_set1_ps(a); }
+		inline vfloat zero() { return _mm256_setzero_ps(); }
+		inline vfloat add(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+		inline vfloat sub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+		inline vfloat mul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+		inline vfloat vsqrt(vfloat a) { return _mm256_sqrt_ps(a); }
+		// max with zero second, so NaNs turn into 0 like the val > 0.0f test
+		inline vfloat positive(vfloat a) { return _mm256_max_ps(a, _mm256_setzero_ps()); }
+		inline void store(float* out, vfloat a) { _mm256_storeu_ps(out, a); }
+		inline vfloat vabs(vfloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+		// a if b is NaN
+		inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(b, a); }
+		inline int aboveMask(vfloat a, vfloat b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GT_OQ)); }
+
+		// val + dist * dist * weight, computed in double and rounded back to float like vectorDistance does
+		inline vfloat accumulate(vfloat val, vfloat dist, double weight) {
+			const vdouble w = _mm256_set1_pd(weight);
+			const vdouble dLo = _mm256_cvtps_pd(_mm256_castps256_ps128(dist));
+			const vdouble dHi = _mm256_cvtps_pd(_mm256_extractf128_ps(dist, 1));
+			const vdouble vLo = _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(val)), _mm256_mul_pd(_mm256_mul_pd(dLo, dLo), w));
+			const vdouble vHi = _mm256_add_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(val, 1)), _mm256_mul_pd(_mm256_mul_pd(dHi, dHi), w));
+			return _mm256_set_m128(_mm256_cvtpd_ps(vHi), _mm256_cvtpd_ps(vLo));
+		}
+#elif defined(DISTANCE_KERNELS_SSE)
+		const size_t width = 4;
+		typedef __m128 vfloat;
+		typedef __m128d vdouble;
+
+		inline vfloat load(const float* p) { return _mm_loadu_ps(p); }
+		// SSE has no gather, the four lanes are loaded one by one
+		inline vfloat gather(const float* p, const uint32_t* idx) { return _mm_set_ps(p[idx[3]], p[idx[2]], p[idx[1]], p[idx[0]]); }
+		inline vfloat set1(float a) { return _mm_set1_ps(a); }
+		inline vfloat zero() { return _mm_setzero_ps(); }
+		inline vfloat add(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+		inline vfloat sub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+		inline vfloat mul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+		inline vfloat vsqrt(vfloat a) { return _mm_sqrt_ps(a); }
+		inline vfloat positive(vfloat a) { return _mm_max_ps(a, _mm_setzero_ps()); }
+		inline void store(float* out, vfloat a) { _mm_storeu_ps(out, a); }
+		inline vfloat vabs(vfloat a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+		inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(b, a); }
+		inline int aboveMask(vfloat a, vfloat b) { return _mm_movemask_ps(_mm_cmpgt_ps(a, b)); }
+
+		inline vfloat accumulate(vfloat val, vfloat dist, double weight) {
+			const vdouble w = _mm_set1_pd(weight);
+			const vdouble dLo = _mm_cvtps_pd(dist);
+			const vdouble dHi = _mm_cvtps_pd(_mm_movehl_ps(dist, dist));
+			const vdouble vLo = _mm_add_pd(_mm_cvtps_pd(val), _mm_mul_pd(_mm_mul_pd(dLo, dLo), w));
+			const vdouble vHi = _mm_add_pd(_mm_cvtps_pd(_mm_movehl_ps(val, val)), _mm_mul_pd(_mm_mul_pd(dHi, dHi), w));
+			return _mm_movelh_ps(_mm_cvtpd_ps(vLo), _mm_cvtpd_ps(vHi));
+		}
+#endif
+
+#if defined(DISTANCE_KERNELS_AVX2) || defined(DISTANCE_KERNELS_SSE)
+		inline vfloat flat(vfloat val, bool useSqrt) {
+			val = positive(val);
+			return useSqrt ? vsqrt(val) : val;
+		}
+#endif
+	}
+
+	void weightedDistances(const float* const* columns, const float* query, const ScanWeights& w, size_t begin, size_t end, float* out) {
+		size_t r = begin;
+#if defined(DISTANCE_KERNELS_AVX2) || defined(DISTANCE_KERNELS_SSE)
+		const int last = FeatureRecord::scalars - 1;
+		for (; r + width <= end; r += width) {
+			vfloat singleValueDistance;
+			if (w.squareDistance) {
+				vfloat val = zero();
+				for (int d = 0; d < FeatureRecord::scalars; d++) {
+					val = accumulate(val, sub(set1(query[d]), load(columns[d] + r)), w.scalarWeights[d]);
+				}
+				singleValueDistance = flat(val, w.useSqrt);
+			} else {
+				singleValueDistance = flat(sub(set1(query[last]), load(columns[last] + r)), w.useSqrt);
+			}
+			vfloat total = mul(singleValueDistance, set1(w.functionWeights[0]));
+			if (w.flatHistograms) {
+				for (int h = 0; h < FeatureRecord::histograms; h++) {
+					const int c = histogramLast[h];
+					total = add(total, mul(flat(sub(set1(query[c]), load(columns[c] + r)), w.useSqrt), set1(w.functionWeights[h + 1])));
+				}
+			}
+			store(out + (r - begin), total);
+		}
+#endif
+		for (; r < end; r++) {
+			out[r - begin] = scalarRow(columns, query, w, r);
+		}
+	}
+
+	void addEarthMoversDistances(const float* const* cdfColumns, const float* queryCdf, const float* deltas, float weight, size_t begin, size_t end, float* out) {
+		const int steps = FeatureRecord::histogramBins - 1;
+		size_t r = begin;
+#if defined(DISTANCE_KERNELS_AVX2) || defined(DISTANCE_KERNELS_SSE)
+		for (; r + width <= end; r += width) {
+			vfloat dist = zero();
+			for (int k = 0; k < steps; k++) {
+				dist = add(dist, mul(vabs(sub(set1(queryCdf[k]), load(cdfColumns[k] + r))), set1(deltas[k])));
+			}
+			store(out + (r - begin), add(load(out + (r - begin)), mul(dist, set1(weight))));
+		}
+#endif
+		for (; r < end; r++) {
+			float dist = 0.0f;
+			for (int k = 0; k < steps; k++) {
+				dist += std::abs(queryCdf[k] - cdfColumns[k][r]) * deltas[k];
+			}
+			out[r - begin] = out[r - begin] + dist * weight;
+		}
+	}
+
+	void addEarthMoversDistances(const float* const* cdfColumns, const float* queryCdf, const float* deltas, float weight, const uint32_t* rows, size_t n, float* out) {
+		const int steps = FeatureRecord::histogramBins - 1;
+		size_t j = 0;
+#if defined(DISTANCE_KERNELS_AVX2) || defined(DISTANCE_KERNELS_SSE)
+		for (; j + width <= n; j += width) {
+			vfloat dist = zero();
+			for (int k = 0; k < steps; k++) {
+				dist = add(dist, mul(vabs(sub(set1(queryCdf[k]), gather(cdfColumns[k], rows + j))), set1(deltas[k])));
+			}
+			store(out + j, add(load(out + j), mul(dist, set1(weight))));
+		}
+#endif
+		for (; j < n; j++) {
+			float dist = 0.0f;
+			for (int k = 0; k < steps; k++) {
+				dist += std::abs(queryCdf[k] - cdfColumns[k][rows[j]]) * deltas[k];
+			}
+			out[j] = out[j] + dist * weight;
+		}
+	}
+
+	size_t keepBelow(uint32_t* rows, float* distances, size_t n, float threshold) {
+		size_t kept = 0;
+		for (size_t j = 0; j < n; j++) {
+			// Written unconditionally and only counted when kept, so there is no branch to mispredict
+			rows[kept] = rows[j];
+			distances[kept] = distances[j];
+			kept += !(distances[j] > threshold);
+		}
+		return kept;
+	}
+
+	size_t keepPivotBound(const float* const* pivotColumns, const float* queryPivots, int pivots, float weight, float slack, uint32_t* rows, float* distances, size_t n, float threshold) {
+		size_t kept = 0;
+		size_t j = 0;
+#if defined(DISTANCE_KERNELS_AVX2) || defined(DISTANCE_KERNELS_SSE)
+		uint32_t blockRows[width];
+		float blockDistances[width];
+		for (; j + width <= n; j += width) {
+			vfloat bound = zero();
+			for (int p = 0; p < pivots; p++) {
+				const vfloat q = set1(queryPivots[p]);
+				const vfloat x = gather(pivotColumns[p], rows + j);
+				bound = vmax(bound, sub(vabs(sub(q, x)), mul(set1(slack), add(q, x))));
+			}
+			const vfloat estimate = mul(add(load(distances + j), mul(bound, set1(weight))), set1(1.0f - slack));
+			const int above = aboveMask(estimate, set1(threshold));
+			// The block is copied first as kept can catch up with j inside it
+			std::copy(rows + j, rows + j + width, blockRows);
+			std::copy(distances + j, distances + j + width, blockDistances);
+			for (size_t l = 0; l < width; l++) {
+				rows[kept] = blockRows[l];
+				distances[kept] = blockDistances[l];
+				kept += !((above >> l) & 1);
+			}
+		}
+#endif
+		for (; j < n; j++) {
+			float bound = 0.0f;
+			for (int p = 0; p < pivots; p++) {
+				const float q = queryPivots[p];
+				const float x = pivotColumns[p][rows[j]];
+				const float b = std::abs(q - x) - slack * (q + x);
+				bound = b > bound ? b : bound;
+			}
+			const float estimate = (distances[j] + bound * weight) * (1.0f - slack);
+			const uint32_t row = rows[j];
+			const float distance = distances[j];
+			rows[kept] = row;
+			distances[kept] = distance;
+			kept += !(estimate > threshold);
+		}
+		return kept;
+	}
+}
@@ -0,0 +1,38 @@
+#ifndef __DISTANCE_KERNELS_HPP__
+#define __DISTANCE_KERNELS_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+// Brute-force scan of the DB feature columns (see FeatureStore::column) against one query record.
+// Gives the same floats as vectorDistance, rounding included, so the rankings do not change.
+// Uses AVX2 when compiled with AVX2, SSE otherwise, plain C++ on other architectures.
+namespace DistanceKernels {
+
+	// The parameters of Retriever::RetrievalEngine::queryCUST
+	struct ScanWeights {
+		float scalarWeights[6];
+		float functionWeights[6];
+		bool squareDistance;
+		bool useSqrt;
+		// Add the five histogram terms too. Only for !squareDistance, the EMD terms are added by the caller
+		bool flatHistograms;
+	};
+
+	// out[r - begin] = weighted distance between query and row r, for the rows in [begin, end)
+	void weightedDistances(const float* const* columns, const float* query, const ScanWeights& w, size_t begin, size_t end, float* out);
+
+	// out[r - begin] += weight * EMD between the query and row r, for one shape distribution.
+	// cdfColumns, queryCdf and deltas are the histogramBins - 1 CDF values and steps of EarthMovers::EqualSupport
+	void addEarthMoversDistances(const float* const* cdfColumns, const float* queryCdf, const float* deltas, float weight, size_t begin, size_t end, float* out);
+	// Same for the n rows listed in rows: out[j] += weight * EMD between the query and row rows[j]
+	void addEarthMoversDistances(const float* const* cdfColumns, const float* queryCdf, const float* deltas, float weight, const uint32_t* rows, size_t n, float* out);
+	// Keeps the rows whose distance is not above threshold, in order, and returns how many are left
+	size_t keepBelow(uint32_t* rows, float* distances, size_t n, float threshold);
+	// Same, but the distance is completed with weight * the pivot lower bound of PivotIndex:
+	// max over p of |queryPivots[p] - pivotColumns[p][row]| - slack * (queryPivots[p] + pivotColumns[p][row]),
+	// and the sum is lowered by slack before the comparison. distances are left as they are
+	size_t keepPivotBound(const float* const* pivotColumns, const float* queryPivots, int pivots, float weight, float slack, uint32_t* rows, float* distances, size_t n, float threshold);
+};
+
+#endif
@@ -25,9 +25,13 @@
 // 
 // Taken and modified from https://github.com/gnardari/wasserstein
 
+#ifndef __EARTH_MOVERS_DISTANCE_HPP__
+#define __EARTH_MOVERS_DISTANCE_HPP__
+
 #include <algorithm>
 #include <numeric> // std::iota
 #include <vector>
+#include <cmath>
 
 namespace std {
 	template <typename T> void argsort(const vector<T>& v, vector<size_t>& idx) {
@@ -129,3 +133,40 @@ namespace std {
 			return computeDist(cdfA, cdfB, deltas);
 		}
 } // namespace std
+
+namespace EarthMovers {
+	// Both histograms on the same sorted support of Bins values, like the shape distributions are.
+	// Then the EMD is the area between the two CDFs: sum of |cdfA[k] - cdfB[k]| * (values[k + 1] - values[k]),
+	// with the same float operations as std::earthMoversDistance (the zero-width steps between the
+	// repeated support values add nothing), but no allocation, sorting or searching.
+	template <int Bins>
+		struct EqualSupport {
+			static const int steps = Bins - 1;
+			float deltas[steps];
+
+			explicit EqualSupport(const float* values) {
+				for (int k = 0; k < steps; ++k) {
+					deltas[k] = values[k + 1] - values[k];
+				}
+			}
+
+			// The last CDF value is always 1 and is not stored
+			static void cdf(const float* weights, float* out) {
+				float acc[Bins];
+				std::partial_sum(weights, weights + Bins, acc);
+				for (int k = 0; k < steps; ++k) {
+					out[k] = acc[k] / acc[Bins - 1];
+				}
+			}
+
+			float distance(const float* cdfA, const float* cdfB) const {
+				float dist = 0.0f;
+				for (int k = 0; k < steps; ++k) {
+					dist += std::abs(cdfA[k] - cdfB[k]) * deltas[k];
+				}
+				return dist;
+			}
+		};
+}
+
+#endif
@@ -23,6 +23,12 @@ std::string generateFilename(int kMax, Retriever::DistanceMethod distanceMethod,
 	case Retriever::DistanceMethod::spotify_ANN:
 		filename += "Spotify_ANN";
 		break;
+	case Retriever::DistanceMethod::hnsw_ANN:
+		filename += "HNSW_ANN";
+		break;
+	case Retriever::DistanceMethod::pq_ADC:
+		filename += "PQ_ADC";
+		break;
 	}
 	filename += ".csv";
 	return filename;
@@ -30,7 +36,7 @@ std::string generateFilename(int kMax, Retriever::DistanceMethod distanceMethod,
 
 int main(int argc, char* args[]) {
 	if(argc < 2) {
-		printf("USAGE:\n %s db-path [method= 0 (eucliden_NoWeights) | 1 (quadratic_Weights) | 2 (flat_NoWeights) | 3 (spotify_ANN)]\n", args[0]);
+		printf("USAGE:\n %s db-path [method= 0 (eucliden_NoWeights) | 1 (quadratic_Weights) | 2 (flat_NoWeights) | 3 (emd_NoWeights) | 4 (spotify_ANN) | 5 (hnsw_ANN) | 6 (pq_ADC)]\n", args[0]);
 		return 1;
 	}
 
@@ -45,7 +51,6 @@ int main(int argc, char* args[]) {
 		distanceMethod = Retriever::DistanceMethod::quadratic_Weights;
 	else
 		distanceMethod = static_cast<Retriever::DistanceMethod>(atoi(args[2]));
-	Retriever::DistanceMethod distanceMethod = static_cast<Retriever::DistanceMethod>(atoi(args[2]));
 	const auto extractClass = [](std::filesystem::path filePath) {
 		size_t found;
 		found = filePath.string().find_last_of("/\\");
@@ -76,6 +81,12 @@ int main(int argc, char* args[]) {
 	std::vector<std::pair<float, float>> rocPair(kMax);
 
 
+	// The DB features are read once and shared by all the queries
+	const auto engine = Retriever::getEngine(dbPath);
+	if (!engine->isOpen()) {
+		return 1;
+	}
+
 	std::string evalFilename = generateFilename(kMax, distanceMethod, false);
 	std::ofstream evalFile;
 	evalFile.open(evalFilename);
@@ -101,8 +112,7 @@ int main(int argc, char* args[]) {
 					int lastRank = 0;
 					bool lastRankFound = false;
 					std::shared_ptr<Mesh> mesh = std::make_shared<Mesh>(p.path().string());
-					Retriever::retrieveSimiliarShapes(mesh, dbPath, kMax, distanceMethod, true);
-					const auto similarShapes = mesh->getSimilarShapes();
+					const auto similarShapes = engine->query(mesh, kMax, distanceMethod, true);
 
 					if (!similarShapes.empty()) {
 						std::string meshClass = extractClass(p);
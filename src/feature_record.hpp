@@ -0,0 +1,75 @@
+#ifndef __FEATURE_RECORD_HPP__
+#define __FEATURE_RECORD_HPP__
+
+#include "utils.hpp"
+#include "histogram.hpp"
+#include <array>
+#include <string>
+#include <sstream>
+#include <vector>
+
+// All the features of one shape in a fixed, contiguous layout: the six global descriptors in Features
+// order, then the five shape distribution histograms of histogramBins bins each. This is the column
+// order of feats.csv, so data() can be used as it is as an ANN item, a DB matrix row or a binary record.
+class FeatureRecord {
+	public:
+		static const int scalars = FEAT_A3_3D;
+		static const int histograms = FEAT_D4_3D - FEAT_A3_3D + 1;
+		static const int histogramBins = 10;
+		static const int size = scalars + histograms * histogramBins;
+		static_assert(size == DESCRIPTORS_NUM, "DESCRIPTORS_NUM does not match the FeatureRecord layout");
+
+		FeatureRecord() { m_values.fill(0.0f); m_samples.fill(0); }
+
+		// Position of a feature's first value in data()
+		static constexpr int offset(Features f) {
+			return (f < FEAT_A3_3D) ? (int)f : scalars + (f - FEAT_A3_3D) * histogramBins;
+		}
+		static constexpr int length(Features f) {
+			return (f < FEAT_A3_3D) ? 1 : histogramBins;
+		}
+
+		inline float scalar(Features f) const { return m_values[f]; }
+		inline void setScalar(Features f, float value) { m_values[f] = value; }
+
+		inline const float* histogram(Features f) const { return m_values.data() + offset(f); }
+		inline float* histogram(Features f) { return m_values.data() + offset(f); }
+		inline std::vector<float> histogramVector(Features f) const { return std::vector<float>(histogram(f), histogram(f) + histogramBins); }
+
+		inline void setHistogram(Features f, const Histogram& h) {
+			setHistogram(f, h.getFrequency());
+			m_samples[f - FEAT_A3_3D] = h.getSamples();
+		}
+		inline void setHistogram(Features f, const std::vector<float>& frequency) {
+			float* dst = histogram(f);
+			for (int i = 0; i < histogramBins && i < (int)frequency.size(); i++) dst[i] = frequency[i];
+		}
+
+		// Samples the histogram was built from, 0 when it was read back from disk
+		inline int samples(Features f) const { return m_samples[f - FEAT_A3_3D]; }
+
+		// Copies one feature (a scalar or a whole histogram) from another record
+		inline void copyFeature(const FeatureRecord& from, Features f) {
+			for (int i = offset(f); i < offset(f) + length(f); i++) m_values[i] = from.m_values[i];
+			if (f >= FEAT_A3_3D) m_samples[f - FEAT_A3_3D] = from.m_samples[f - FEAT_A3_3D];
+		}
+
+		// Same format as Histogram::toString, as stored in feats.csv
+		inline std::string histogramString(Features f) const {
+			std::ostringstream s;
+			const float* h = histogram(f);
+			for (int i = 0; i < histogramBins; i++) {
+				s << h[i] << ((i + 1 < histogramBins) ? ":" : "");
+			}
+			return s.str();
+		}
+
+		inline const float* data() const { return m_values.data(); }
+		inline float* data() { return m_values.data(); }
+
+	private:
+		std::array<float, size> m_values;
+		std::array<int, histograms> m_samples;
+};
+
+#endif
@@ -0,0 +1,285 @@
+#include "feature_store.hpp"
+#include "rapidcsv.h"
+#include "earth_movers_distance.hpp"
+#include <fstream>
+#include <cstring>
+#include <fcntl.h>
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+ #ifndef NOMINMAX
+  #define NOMINMAX
+ #endif
+ #include "mman.h"
+ #include <windows.h>
+ #include <io.h>
+ #define openReadOnly(p) _open(p, _O_RDONLY | _O_BINARY)
+ #define closeFile(fd) _close(fd)
+#else
+ #include <sys/mman.h>
+ #include <unistd.h>
+ #define openReadOnly(p) ::open(p, O_RDONLY)
+ #define closeFile(fd) ::close(fd)
+#endif
+
+namespace {
+	const char storeMagic[8] = { 'I', 'P', 'F', 'E', 'A', 'T', 'S', '\0' };
+	const uint64_t matrixAlignment = 64;
+
+	inline uint64_t alignUp(uint64_t v, uint64_t a) {
+		return (v + a - 1) / a * a;
+	}
+
+	// The path offsets start at 0, never decrease and stay inside the path data, so path(i) can not read past it
+	bool validPaths(const uint64_t* offsets, uint64_t rows, uint64_t pathDataSize) {
+		if (offsets[0] != 0 || offsets[rows] > pathDataSize) {
+			return false;
+		}
+		for (uint64_t i = 0; i < rows; i++) {
+			if (offsets[i + 1] < offsets[i]) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// FNV-1a over the 32 bit words of the columns
+	uint64_t featuresChecksum(const std::vector<FeatureRecord>& records) {
+		uint64_t h = 0xCBF29CE484222325ULL ^ records.size();
+		for (int d = 0; d < DESCRIPTORS_NUM; d++) {
+			for (const auto& record : records) {
+				uint32_t word;
+				std::memcpy(&word, record.data() + d, sizeof(word));
+				h ^= word;
+				h *= 0x100000001B3ULL;
+			}
+		}
+		return h;
+	}
+
+	const std::string scalarColumns[FeatureRecord::scalars] = { "3D_Area", "3D_MVolume", "3D_BBVolume", "3D_Diameter", "3D_Compactness", "3D_Eccentricity" };
+}
+
+FeatureStore::~FeatureStore() {
+	close();
+}
+
+void FeatureStore::close() {
+	if (m_data) {
+		munmap(m_data, m_size);
+	}
+	m_data = nullptr;
+	m_size = 0;
+	m_header = nullptr;
+	m_pathOffsets = nullptr;
+	m_pathData = nullptr;
+	m_contentHashes = nullptr;
+	m_matrix = nullptr;
+	m_columns.fill(nullptr);
+	m_cdfColumns.fill(nullptr);
+}
+
+bool FeatureStore::open(const std::filesystem::path& dbPath) {
+	close();
+	const auto filePath = dbPath / fileName;
+	if (!std::filesystem::exists(filePath) && !convertCsv(dbPath)) {
+		std::cout << "Could not find " << filePath << ".\nRun FeaturesExtractor on the mesh DB to generate the feature file first" << std::endl;
+		return false;
+	}
+	if (map(filePath)) {
+		return true;
+	}
+	// Written by an older version, rebuild it if the csv files are still there
+	if (convertCsv(dbPath) && map(filePath)) {
+		return true;
+	}
+	std::cout << "Feature store " << filePath << " has an unsupported layout, run FeaturesExtractor again" << std::endl;
+	return false;
+}
+
+bool FeatureStore::map(const std::filesystem::path& filePath) {
+	const size_t size = std::filesystem::file_size(filePath);
+	if (size < sizeof(FeatureStoreHeader)) {
+		return false;
+	}
+	int fd = openReadOnly(filePath.string().c_str());
+	if (fd == -1) {
+		std::cout << "Unable to open " << filePath << std::endl;
+		return false;
+	}
+	void* data = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+	closeFile(fd);
+	if (data == MAP_FAILED) {
+		std::cout << "Unable to map " << filePath << std::endl;
+		return false;
+	}
+	m_data = data;
+	m_size = size;
+
+	const auto* header = static_cast<const FeatureStoreHeader*>(data);
+	const bool valid = std::memcmp(header->magic, storeMagic, sizeof(storeMagic)) == 0 &&
+		header->version == version &&
+		header->headerSize == sizeof(FeatureStoreHeader) &&
+		header->descriptors == DESCRIPTORS_NUM &&
+		header->scalars == FeatureRecord::scalars &&
+		header->histograms == FeatureRecord::histograms &&
+		header->bins == FeatureRecord::histogramBins &&
+		header->fileSize == size &&
+		// Every offset and count is bounded by the file size first, so the sums below can not wrap around
+		header->matrixOffset <= size && header->stride <= size / sizeof(float) &&
+		header->stride >= header->rows && header->stride % rowAlignment == 0 &&
+		header->pathOffsetsOffset % sizeof(uint64_t) == 0 &&
+		header->pathOffsetsOffset + (header->rows + 1) * sizeof(uint64_t) <= header->pathDataOffset &&
+		header->pathDataOffset <= header->contentHashOffset && header->contentHashOffset <= header->matrixOffset &&
+		header->contentHashOffset % sizeof(uint64_t) == 0 &&
+		header->contentHashOffset + header->rows * sizeof(uint64_t) <= header->matrixOffset &&
+		header->matrixOffset % matrixAlignment == 0 &&
+		header->matrixOffset + header->stride * DESCRIPTORS_NUM * sizeof(float) <= header->cdfOffset &&
+		header->cdfOffset % matrixAlignment == 0 && header->cdfOffset <= size &&
+		header->cdfOffset + header->stride * m_cdfColumns.size() * sizeof(float) <= size &&
+		validPaths(reinterpret_cast<const uint64_t*>(static_cast<const char*>(data) + header->pathOffsetsOffset), header->rows,
+			header->contentHashOffset - header->pathDataOffset);
+	if (!valid) {
+		close();
+		return false;
+	}
+
+	const char* base = static_cast<const char*>(data);
+	m_header = header;
+	m_pathOffsets = reinterpret_cast<const uint64_t*>(base + header->pathOffsetsOffset);
+	m_pathData = base + header->pathDataOffset;
+	m_contentHashes = reinterpret_cast<const uint64_t*>(base + header->contentHashOffset);
+	m_matrix = reinterpret_cast<const float*>(base + header->matrixOffset);
+	for (int d = 0; d < DESCRIPTORS_NUM; d++) {
+		m_columns[d] = m_matrix + d * header->stride;
+	}
+	const float* cdfs = reinterpret_cast<const float*>(base + header->cdfOffset);
+	for (size_t c = 0; c < m_cdfColumns.size(); c++) {
+		m_cdfColumns[c] = cdfs + c * header->stride;
+	}
+	return true;
+}
+
+std::string_view FeatureStore::path(size_t i) const {
+	return std::string_view(m_pathData + m_pathOffsets[i], m_pathOffsets[i + 1] - m_pathOffsets[i]);
+}
+
+FeatureRecord FeatureStore::record(size_t i) const {
+	FeatureRecord r;
+	copyRow(i, r.data());
+	return r;
+}
+
+void FeatureStore::copyRow(size_t i, float* out) const {
+	for (int d = 0; d < DESCRIPTORS_NUM; d++) {
+		out[d] = column(d)[i];
+	}
+}
+
+bool FeatureStore::write(const std::filesystem::path& filePath, const std::vector<std::string>& paths, const std::vector<FeatureRecord>& records,
+	const std::array<float, FeatureRecord::scalars>& averages, const std::array<float, FeatureRecord::scalars>& deviations,
+	const std::vector<uint64_t>& contentHashes) {
+
+	FeatureStoreHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, storeMagic, sizeof(storeMagic));
+	header.version = version;
+	header.headerSize = sizeof(FeatureStoreHeader);
+	header.descriptors = DESCRIPTORS_NUM;
+	header.scalars = FeatureRecord::scalars;
+	header.histograms = FeatureRecord::histograms;
+	header.bins = FeatureRecord::histogramBins;
+	header.rows = records.size();
+	header.stride = alignUp(records.size(), rowAlignment);
+	for (int f = 0; f < FeatureRecord::scalars; f++) {
+		header.average[f] = averages[f];
+		header.deviation[f] = deviations[f];
+	}
+
+	std::vector<uint64_t> pathOffsets(records.size() + 1, 0);
+	for (size_t i = 0; i < records.size(); i++) {
+		pathOffsets[i + 1] = pathOffsets[i] + paths[i].size();
+	}
+	header.pathOffsetsOffset = sizeof(FeatureStoreHeader);
+	header.pathDataOffset = header.pathOffsetsOffset + pathOffsets.size() * sizeof(uint64_t);
+	header.contentHashOffset = alignUp(header.pathDataOffset + pathOffsets.back(), sizeof(uint64_t));
+	header.matrixOffset = alignUp(header.contentHashOffset + records.size() * sizeof(uint64_t), matrixAlignment);
+	header.cdfOffset = header.matrixOffset + header.stride * DESCRIPTORS_NUM * sizeof(float);
+	header.fileSize = header.cdfOffset + header.stride * FeatureRecord::histograms * cdfSteps * sizeof(float);
+	header.checksum = featuresChecksum(records);
+
+	// Written next to the target and renamed over it, so a store that is still mapped keeps its old contents.
+	// Windows does not replace a mapped file, there the store has to be closed by every process first
+	std::filesystem::path tmpPath = filePath;
+	tmpPath += ".tmp";
+	std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+	if (!file) {
+		std::cout << "Unable to write " << filePath << std::endl;
+		return false;
+	}
+	file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	file.write(reinterpret_cast<const char*>(pathOffsets.data()), pathOffsets.size() * sizeof(uint64_t));
+	for (const auto& p : paths) {
+		file.write(p.data(), p.size());
+	}
+	const std::vector<char> padding(matrixAlignment, 0);
+	file.write(padding.data(), header.contentHashOffset - (header.pathDataOffset + pathOffsets.back()));
+	std::vector<uint64_t> hashes = contentHashes;
+	hashes.resize(records.size(), 0);
+	file.write(reinterpret_cast<const char*>(hashes.data()), hashes.size() * sizeof(uint64_t));
+	file.write(padding.data(), header.matrixOffset - (header.contentHashOffset + hashes.size() * sizeof(uint64_t)));
+	std::vector<float> column(header.stride, 0.0f);
+	for (int d = 0; d < DESCRIPTORS_NUM; d++) {
+		for (size_t i = 0; i < records.size(); i++) {
+			column[i] = records[i].data()[d];
+		}
+		file.write(reinterpret_cast<const char*>(column.data()), column.size() * sizeof(float));
+	}
+	// Computed here once rather than from the mapped rows on every open
+	std::vector<float> cdfs(header.stride * FeatureRecord::histograms * cdfSteps, 0.0f);
+	float cdf[cdfSteps];
+	for (size_t i = 0; i < records.size(); i++) {
+		for (int h = 0; h < FeatureRecord::histograms; h++) {
+			EarthMovers::EqualSupport<FeatureRecord::histogramBins>::cdf(records[i].histogram((Features)(FEAT_A3_3D + h)), cdf);
+			for (int k = 0; k < cdfSteps; k++) {
+				cdfs[(h * cdfSteps + k) * header.stride + i] = cdf[k];
+			}
+		}
+	}
+	file.write(reinterpret_cast<const char*>(cdfs.data()), cdfs.size() * sizeof(float));
+	file.close();
+	if (!file) {
+		std::cout << "Unable to write " << filePath << std::endl;
+		std::filesystem::remove(tmpPath);
+		return false;
+	}
+	std::error_code ec;
+	std::filesystem::rename(tmpPath, filePath, ec);
+	if (ec) {
+		std::cout << "Unable to replace " << filePath << ": " << ec.message() << " (is it still open?)" << std::endl;
+		std::filesystem::remove(tmpPath, ec);
+		return false;
+	}
+	return true;
+}
+
+bool FeatureStore::convertCsv(const std::filesystem::path& dbPath) {
+	if (!std::filesystem::exists(dbPath / "feats.csv") || !std::filesystem::exists(dbPath / "feats_avg.csv")) {
+		return false;
+	}
+	rapidcsv::Document feats((dbPath / "feats.csv").string(), rapidcsv::LabelParams(0, -1));
+	rapidcsv::Document featsAvg((dbPath / "feats_avg.csv").string(), rapidcsv::LabelParams(0, -1));
+
+	std::vector<std::string> paths;
+	std::vector<FeatureRecord> records;
+	for (size_t i = 0; i < feats.GetRowCount(); i++) {
+		paths.push_back(feats.GetCell<std::string>("Path", i));
+		records.push_back(FeatureVector::readFeatureRecord(feats, i));
+	}
+	std::array<float, FeatureRecord::scalars> averages, deviations;
+	for (int f = 0; f < FeatureRecord::scalars; f++) {
+		averages[f] = featsAvg.GetColumn<float>(scalarColumns[f] + "_AVG")[0];
+		deviations[f] = featsAvg.GetColumn<float>(scalarColumns[f] + "_STD")[0];
+	}
+	std::cout << "Converting " << (dbPath / "feats.csv") << " to " << (dbPath / fileName) << std::endl;
+	return write(dbPath / fileName, paths, records, averages, deviations);
+}
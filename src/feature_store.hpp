@@ -0,0 +1,103 @@
+#ifndef __FEATURE_STORE_HPP__
+#define __FEATURE_STORE_HPP__
+
+#include "feature_record.hpp"
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <cstdint>
+
+// Binary counterpart of feats.csv + feats_avg.csv, written by FeaturesExtractor and memory mapped read-only
+// at query time. Layout (little endian):
+//   FeatureStoreHeader
+//   path offsets    (rows + 1) x uint64, relative to the start of the path data
+//   path data       the DB paths back to back, no terminators
+//   content hashes  rows x uint64, MeshBase::getContentHash of each mesh when it was extracted, 0 if unknown
+//   feature matrix  DESCRIPTORS_NUM columns of stride float32 each, same values as feats.csv.
+//                   stride is rows rounded up to a multiple of 16 and the padding is zero, so every
+//                   column starts 64 byte aligned and can be scanned in full SIMD registers.
+//   CDF matrix      histogramBins - 1 columns per shape distribution, laid out like the feature matrix: the
+//                   normalized cumulative histograms the closed-form EMD scans, see EarthMovers::EqualSupport
+struct FeatureStoreHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t headerSize;
+	uint32_t descriptors;		// floats per row
+	uint32_t scalars;
+	uint32_t histograms;
+	uint32_t bins;
+	uint64_t rows;
+	uint64_t stride;			// floats per column
+	float average[FeatureRecord::scalars];
+	float deviation[FeatureRecord::scalars];
+	uint64_t pathOffsetsOffset;
+	uint64_t pathDataOffset;
+	uint64_t contentHashOffset;
+	uint64_t matrixOffset;
+	uint64_t cdfOffset;
+	uint64_t checksum;			// FeatureStore::checksum, computed when the store is written
+	uint64_t fileSize;
+};
+
+class FeatureStore {
+	public:
+		static constexpr const char* fileName = "feats.bin";
+		static const uint32_t version = 4;
+		static const size_t rowAlignment = 16;
+		static constexpr int cdfSteps = FeatureRecord::histogramBins - 1;
+
+		FeatureStore() = default;
+		~FeatureStore();
+		FeatureStore(const FeatureStore&) = delete;
+		FeatureStore& operator=(const FeatureStore&) = delete;
+
+		// Maps dbPath/feats.bin. If it is missing, or in a layout this version can not read, and feats.csv and feats_avg.csv
+		// are there it is built from them first. A feats.bin older than the csv files is not detected, run FeaturesExtractor.
+		bool open(const std::filesystem::path& dbPath);
+		void close();
+		inline bool isOpen() const { return m_header != nullptr; }
+
+		inline size_t rows() const { return m_header->rows; }
+		inline size_t stride() const { return m_header->stride; }
+		// Values of one float of the records for all the rows, see FeatureRecord::offset
+		inline const float* column(int d) const { return m_columns[d]; }
+		inline const float* const* columns() const { return m_columns.data(); }
+		std::string_view path(size_t i) const;
+		inline uint64_t contentHash(size_t i) const { return m_contentHashes[i]; }
+		// The cdfSteps CDF columns of one shape distribution, and all of them one distribution after the other
+		inline const float* const* cdfColumns(Features f) const { return m_cdfColumns.data() + (f - FEAT_A3_3D) * cdfSteps; }
+		inline const float* const* cdfColumns() const { return m_cdfColumns.data(); }
+		// Row i gathered back from the columns
+		FeatureRecord record(size_t i) const;
+		void copyRow(size_t i, float* out) const;
+		// Hash of the feature values, to tell whether an index saved next to the store still belongs to it
+		inline uint64_t checksum() const { return m_header->checksum; }
+
+		inline float average(Features f) const { return m_header->average[f]; }
+		inline float deviation(Features f) const { return m_header->deviation[f]; }
+
+		// records hold the standardized global descriptors, as written to feats.csv. contentHashes may be empty
+		static bool write(const std::filesystem::path& filePath, const std::vector<std::string>& paths, const std::vector<FeatureRecord>& records,
+			const std::array<float, FeatureRecord::scalars>& averages, const std::array<float, FeatureRecord::scalars>& deviations,
+			const std::vector<uint64_t>& contentHashes = std::vector<uint64_t>());
+
+		// Builds feats.bin from the csv files of an already extracted DB
+		static bool convertCsv(const std::filesystem::path& dbPath);
+
+	private:
+		bool map(const std::filesystem::path& filePath);
+
+		void* m_data = nullptr;
+		size_t m_size = 0;
+		const FeatureStoreHeader* m_header = nullptr;
+		const uint64_t* m_pathOffsets = nullptr;
+		const char* m_pathData = nullptr;
+		const uint64_t* m_contentHashes = nullptr;
+		const float* m_matrix = nullptr;
+		std::array<const float*, DESCRIPTORS_NUM> m_columns = {};
+		std::array<const float*, FeatureRecord::histograms * cdfSteps> m_cdfColumns = {};
+};
+
+#endif
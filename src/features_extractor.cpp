@@ -4,9 +4,26 @@
 
 int main(int argc, char* args[]) {
 	if(argc < 2){
-		std::cout << "USAGE:" << std::endl << args[0] << " path-to-db" << std::endl;
+		std::cout << "USAGE:" << std::endl << args[0] << " path-to-db [seed] [tolerance] [sequence=random|halton] [domain=vertices|surface] [trees=N] [search_k=N]" << std::endl;
+		std::cout << "  tolerance > 0 samples the histograms adaptively until they change less than it between rounds" << std::endl;
+		std::cout << "  trees and search_k set up the ANN forest, see AnnOptions" << std::endl;
 		return 1;
 	}
 	std::string dbPath = args[1];
-	Stats::getDatabaseFeatures(dbPath);
+	Descriptors::SamplingOptions sampling;
+	AnnOptions ann;
+	sampling.seed = (argc > 2) ? std::strtoull(args[2], nullptr, 0) : Random::defaultSeed;
+	sampling.tolerance = (argc > 3) ? std::strtof(args[3], nullptr) : 0.0f;
+	sampling.adaptive = sampling.tolerance > 0.0f;
+	for (int i = 4; i < argc; i++) {
+		if (strcmp(args[i], "sequence=halton") == 0)
+			sampling.sequence = Descriptors::SampleSequence::Halton;
+		else if (strcmp(args[i], "domain=surface") == 0)
+			sampling.domain = Descriptors::SampleDomain::Surface;
+		else if (strncmp(args[i], "trees=", strlen("trees=")) == 0)
+			ann.trees = atoi(args[i] + strlen("trees="));
+		else if (strncmp(args[i], "search_k=", strlen("search_k=")) == 0)
+			ann.searchK = atoi(args[i] + strlen("search_k="));
+	}
+	Stats::getDatabaseFeatures(dbPath, sampling, ann);
 }
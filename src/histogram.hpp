@@ -3,13 +3,13 @@
 
 #include <string>
 #include <iostream>
-#include <map>
 #include <vector>
 #include <sstream>
+#include <cmath>
 
 class Histogram{
 	public:
-		Histogram(int b) :  m_bins{b}{};
+		Histogram(int b) : m_bins{b}, m_samples{0}, m_frequency(b, 0.0f) {};
 
 		inline static std::vector<float> parseHistogram(std::string histogramString) {
 			std::vector<float> frequency;
@@ -25,56 +25,97 @@ class Histogram{
 			return frequency;
 		}
 
-		inline std::string toString(){
+		inline std::string toString() const {
 			std::ostringstream s;
-			for(const auto &a : histogram){
-				s << a.second << ":";
+			for(const auto &a : m_frequency){
+				s << a << ":";
 			}
 			std::string ret = s.str();
 			ret.erase(ret.length()-1);
 			return ret;
 		}
 
-		inline std::vector<float> getFrequency() {
-			std::vector<float> frequency;
-			for (const auto& a : histogram) {
-				frequency.push_back(a.second);
-			}
-			return frequency;
+		// Bins are stored contiguously, no copy is made
+		inline const std::vector<float>& getFrequency() const {
+			return m_frequency;
+		}
+
+		inline int getBins() const { return m_bins; }
+
+		// Number of samples the histogram was built from (0 if unknown, e.g. parsed from csv)
+		inline int getSamples() const { return m_samples; }
+		inline void setSamples(int samples) { m_samples = samples; }
+
+		inline void increment(int bin){
+			++m_frequency[bin];
 		}
 
 		inline void normalize(){
 			float sum = 0;
-			for(auto &a : histogram){
-				sum+=a.second;
+			for(auto a : m_frequency){
+				sum += a;
 			}
-			for(auto &a : histogram){
-				a.second /= sum;
+			if(sum <= 0) return;
+			for(auto &a : m_frequency){
+				a /= sum;
 			}
 		}
 
-	inline void populate(std::vector<float> &values){
-		float range = values[values.size() - 1];
-		m_width = range/(float) m_bins;
-		float bin = 0.0f;
-		for(int i = 0; i < m_bins; ++i){
-			histogram[bin] = 0;
-			bin += m_width;
+		// Distances between two normalized histograms with the same number of bins
+		inline static float l1Distance(const Histogram &a, const Histogram &b) {
+			float d = 0.0f;
+			for(int i = 0; i < a.m_bins; ++i){
+				d += std::abs(a.m_frequency[i] - b.m_frequency[i]);
+			}
+			return d;
 		}
-		bin = 0.0f;
-		for(auto a : values){
-			if(a > bin + m_width) {
-				if(histogram.find(bin+m_width) != histogram.end())
-					bin += m_width;
+
+		// 1D earth mover's distance over [0, 1]: the area between the two cumulative histograms
+		inline static float emdDistance(const Histogram &a, const Histogram &b) {
+			float d = 0.0f, cdf = 0.0f;
+			for(int i = 0; i < a.m_bins; ++i){
+				cdf += a.m_frequency[i] - b.m_frequency[i];
+				d += std::abs(cdf);
 			}
-			++histogram[bin];
+			return d / a.m_bins;
+		}
+
+	private:
+		int m_bins;
+		int m_samples;
+		std::vector<float> m_frequency;
+};
+
+// Bins samples in O(1) each as they are produced, for a value range known up front.
+// Samples outside [min, max] are clamped to the first/last bin, NaNs are dropped.
+class HistogramBuilder{
+	public:
+		HistogramBuilder(int bins, float min, float max) : m_bins{bins}, m_min{min}, m_histogram(bins) {
+			m_scale = (max > min) ? bins / (max - min) : 0.0f;
+		}
+
+		inline void add(float value){
+			if(value != value) return;
+			int bin = (int)((value - m_min) * m_scale);
+			bin = (bin < 0) ? 0 : (bin >= m_bins ? m_bins - 1 : bin);
+			m_histogram.increment(bin);
+		}
+
+		inline void add(const float *values, size_t n){
+			for(size_t i = 0; i < n; ++i){
+				add(values[i]);
+			}
+		}
+
+		inline const Histogram& build() const {
+			return m_histogram;
 		}
-	}
 
 	private:
-		float m_width;
 		int m_bins;
-		std::map<float, float> histogram;
+		float m_min;
+		float m_scale;
+		Histogram m_histogram;
 };
 
 #endif
@@ -0,0 +1,550 @@
+#include "hnsw_index.hpp"
+#include "random.hpp"
+#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <queue>
+#include <atomic>
+#include <future>
+#include <thread>
+#include <algorithm>
+#include <fcntl.h>
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+ #ifndef NOMINMAX
+  #define NOMINMAX
+ #endif
+ #include "mman.h"
+ #include <windows.h>
+ #include <io.h>
+ #define openReadOnly(p) _open(p, _O_RDONLY | _O_BINARY)
+ #define closeFile(fd) _close(fd)
+#else
+ #include <sys/mman.h>
+ #include <unistd.h>
+ #define openReadOnly(p) ::open(p, O_RDONLY)
+ #define closeFile(fd) ::close(fd)
+#endif
+
+namespace {
+	const char hnswMagic[8] = { 'I', 'P', 'H', 'N', 'S', 'W', '\0', '\0' };
+	const uint64_t vectorAlignment = 64;
+	// Layers above this one are never drawn, with M >= 2 the odds of reaching it are below 2^-16
+	const int maxLevels = 16;
+
+	struct HnswHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t dimensions;
+		uint32_t M;
+		uint32_t efConstruction;
+		uint32_t efSearch;
+		uint32_t maxLevel;
+		uint64_t rows;
+		uint64_t entryPoint;
+		uint64_t checksum;
+		uint64_t upperBlocks;
+		float scales[DESCRIPTORS_NUM];
+		uint64_t vectorsOffset;
+		uint64_t levelsOffset;
+		uint64_t upperOffsetsOffset;
+		uint64_t level0Offset;
+		uint64_t upperOffset;
+		uint64_t fileSize;
+	};
+
+	inline uint64_t alignUp(uint64_t v, uint64_t a) {
+		return (v + a - 1) / a * a;
+	}
+
+	static_assert(DESCRIPTORS_NUM % 4 == 0, "the distance is unrolled by 4");
+	inline float squaredDistance(const float* a, const float* b) {
+		float s0 = 0.0f, s1 = 0.0f, s2 = 0.0f, s3 = 0.0f;
+		for (int d = 0; d < DESCRIPTORS_NUM; d += 4) {
+			const float d0 = a[d] - b[d];
+			const float d1 = a[d + 1] - b[d + 1];
+			const float d2 = a[d + 2] - b[d + 2];
+			const float d3 = a[d + 3] - b[d + 3];
+			s0 += d0 * d0;
+			s1 += d1 * d1;
+			s2 += d2 * d2;
+			s3 += d3 * d3;
+		}
+		return (s0 + s1) + (s2 + s3);
+	}
+
+	// Nodes seen by a layer search, cleared by moving to the next epoch instead of touching every mark
+	struct VisitedList {
+		std::vector<uint32_t> marks;
+		uint32_t epoch = 0;
+
+		void reset(size_t rows) {
+			if (marks.size() < rows) {
+				marks.assign(rows, 0);
+				epoch = 0;
+			}
+			if (++epoch == 0) {
+				std::fill(marks.begin(), marks.end(), 0);
+				epoch = 1;
+			}
+		}
+
+		inline bool visit(uint32_t node) {
+			if (marks[node] == epoch) {
+				return false;
+			}
+			marks[node] = epoch;
+			return true;
+		}
+	};
+
+	VisitedList& visitedList(size_t rows) {
+		thread_local VisitedList list;
+		list.reset(rows);
+		return list;
+	}
+}
+
+HnswIndex::~HnswIndex() {
+	close();
+}
+
+void HnswIndex::close() {
+	if (m_data) {
+		munmap(m_data, m_size);
+	}
+	m_data = nullptr;
+	m_size = 0;
+	m_rows = 0;
+	m_vectors = nullptr;
+	m_levels = nullptr;
+	m_upperOffsets = nullptr;
+	m_level0 = nullptr;
+	m_upper = nullptr;
+	m_builtVectors = std::vector<float>();
+	m_builtLevels = std::vector<uint32_t>();
+	m_builtUpperOffsets = std::vector<uint64_t>();
+	m_builtLevel0 = std::vector<uint32_t>();
+	m_builtUpper = std::vector<uint32_t>();
+}
+
+bool HnswIndex::open(const std::filesystem::path& dbPath, const FeatureStore& store, const float* scales, const HnswOptions& options) {
+	close();
+	if (!store.isOpen() || !store.rows() || store.rows() > UINT32_MAX) {
+		return false;
+	}
+	const auto filePath = dbPath / fileName;
+	const uint64_t checksum = store.checksum();
+	if (std::filesystem::exists(filePath) && map(filePath, checksum, scales, options)) {
+		if (m_rows == store.rows()) {
+			return true;
+		}
+		close();
+	}
+	build(store, scales, options);
+	// The graph that was just built answers the queries, the file is mapped from the next run on
+	save(filePath, checksum);
+	return true;
+}
+
+bool HnswIndex::map(const std::filesystem::path& filePath, uint64_t checksum, const float* scales, const HnswOptions& options) {
+	const size_t size = std::filesystem::file_size(filePath);
+	if (size < sizeof(HnswHeader)) {
+		return false;
+	}
+	int fd = openReadOnly(filePath.string().c_str());
+	if (fd == -1) {
+		std::cout << "Unable to open " << filePath << std::endl;
+		return false;
+	}
+	void* data = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+	closeFile(fd);
+	if (data == MAP_FAILED) {
+		std::cout << "Unable to map " << filePath << std::endl;
+		return false;
+	}
+
+	const auto* header = static_cast<const HnswHeader*>(data);
+	const uint64_t level0Links = 1 + 2 * (uint64_t)header->M;
+	const uint64_t upperLinks = 1 + (uint64_t)header->M;
+	bool valid = std::memcmp(header->magic, hnswMagic, sizeof(hnswMagic)) == 0 &&
+		header->version == version &&
+		header->dimensions == DESCRIPTORS_NUM &&
+		header->checksum == checksum &&
+		std::memcmp(header->scales, scales, sizeof(header->scales)) == 0 &&
+		header->M > 0 && header->efConstruction > 0 && header->efSearch > 0 &&
+		(options.M <= 0 || header->M == (uint32_t)options.M) &&
+		(options.efConstruction <= 0 || header->efConstruction == (uint32_t)options.efConstruction) &&
+		header->rows > 0 && header->rows <= UINT32_MAX && header->entryPoint < header->rows &&
+		header->maxLevel < maxLevels &&
+		header->fileSize == size &&
+		// Every offset and count is bounded by the file size first, so the products and sums below can not wrap around
+		header->vectorsOffset <= size && header->levelsOffset <= size && header->upperOffsetsOffset <= size &&
+		header->level0Offset <= size && header->upperOffset <= size &&
+		header->rows <= size / (DESCRIPTORS_NUM * sizeof(float)) &&
+		level0Links <= size / (header->rows * sizeof(uint32_t)) &&
+		header->upperBlocks <= size / (upperLinks * sizeof(uint32_t)) &&
+		header->vectorsOffset % vectorAlignment == 0 &&
+		header->levelsOffset % sizeof(uint32_t) == 0 &&
+		header->level0Offset % sizeof(uint32_t) == 0 &&
+		header->upperOffset % sizeof(uint32_t) == 0 &&
+		header->vectorsOffset + header->rows * DESCRIPTORS_NUM * sizeof(float) <= header->levelsOffset &&
+		header->levelsOffset + header->rows * sizeof(uint32_t) <= header->upperOffsetsOffset &&
+		header->upperOffsetsOffset % sizeof(uint64_t) == 0 &&
+		header->upperOffsetsOffset + header->rows * sizeof(uint64_t) <= header->level0Offset &&
+		header->level0Offset + header->rows * level0Links * sizeof(uint32_t) <= header->upperOffset &&
+		header->upperOffset + header->upperBlocks * upperLinks * sizeof(uint32_t) <= size;
+
+	const char* base = static_cast<const char*>(data);
+	if (valid) {
+		// Every link is checked once here, so that the searches can follow them blindly
+		const auto* levels = reinterpret_cast<const uint32_t*>(base + header->levelsOffset);
+		const auto* upperOffsets = reinterpret_cast<const uint64_t*>(base + header->upperOffsetsOffset);
+		const auto* level0 = reinterpret_cast<const uint32_t*>(base + header->level0Offset);
+		const auto* upper = reinterpret_cast<const uint32_t*>(base + header->upperOffset);
+		const auto validList = [header](const uint32_t* list, uint64_t capacity) {
+			if (list[0] >= capacity) {
+				return false;
+			}
+			for (uint32_t j = 1; j <= list[0]; j++) {
+				if (list[j] >= header->rows) {
+					return false;
+				}
+			}
+			return true;
+		};
+		valid = levels[header->entryPoint] == header->maxLevel;
+		for (uint64_t i = 0; i < header->rows && valid; i++) {
+			valid = levels[i] <= header->maxLevel &&
+				levels[i] <= header->upperBlocks && upperOffsets[i] <= header->upperBlocks - levels[i] &&
+				validList(level0 + i * level0Links, level0Links);
+			for (uint32_t l = 0; l < levels[i] && valid; l++) {
+				valid = validList(upper + (upperOffsets[i] + l) * upperLinks, upperLinks);
+			}
+		}
+	}
+	if (!valid) {
+		munmap(data, size);
+		return false;
+	}
+
+	m_data = data;
+	m_size = size;
+	m_M = header->M;
+	m_efConstruction = header->efConstruction;
+	m_efSearch = options.efSearch > 0 ? options.efSearch : header->efSearch;
+	m_rows = header->rows;
+	m_entryPoint = (uint32_t)header->entryPoint;
+	m_maxLevel = header->maxLevel;
+	m_upperBlocks = header->upperBlocks;
+	std::memcpy(m_scales, header->scales, sizeof(m_scales));
+	m_vectors = reinterpret_cast<const float*>(base + header->vectorsOffset);
+	m_levels = reinterpret_cast<const uint32_t*>(base + header->levelsOffset);
+	m_upperOffsets = reinterpret_cast<const uint64_t*>(base + header->upperOffsetsOffset);
+	m_level0 = reinterpret_cast<const uint32_t*>(base + header->level0Offset);
+	m_upper = reinterpret_cast<const uint32_t*>(base + header->upperOffset);
+	return true;
+}
+
+void HnswIndex::build(const FeatureStore& store, const float* scales, const HnswOptions& options) {
+	m_M = std::max(2, options.M > 0 ? options.M : defaultM);
+	m_efConstruction = options.efConstruction > 0 ? options.efConstruction : defaultEfConstruction;
+	m_efSearch = options.efSearch > 0 ? options.efSearch : defaultEfSearch;
+	m_rows = store.rows();
+	std::memcpy(m_scales, scales, sizeof(m_scales));
+	std::cout << "Building " << fileName << " (M " << m_M << ", efConstruction " << m_efConstruction << ") for " << m_rows << " shapes..." << std::endl;
+
+	m_builtVectors.resize(m_rows * DESCRIPTORS_NUM);
+	for (size_t i = 0; i < m_rows; i++) {
+		float* v = m_builtVectors.data() + i * DESCRIPTORS_NUM;
+		store.copyRow(i, v);
+		for (int d = 0; d < DESCRIPTORS_NUM; d++) {
+			v[d] *= m_scales[d];
+		}
+	}
+
+	// Every node draws its top layer from its own stream, so the layers do not depend on the insertion order.
+	// Knowing them up front lets all the link lists be laid out before the insertions start
+	const double levelScale = 1.0 / std::log((double)m_M);
+	m_builtLevels.resize(m_rows);
+	m_builtUpperOffsets.resize(m_rows);
+	m_upperBlocks = 0;
+	for (size_t i = 0; i < m_rows; i++) {
+		Random::Engine rng(Random::streamSeed(Random::defaultSeed, i));
+		const int level = (int)(-std::log(1.0 - rng.uniform()) * levelScale);
+		m_builtLevels[i] = std::min(level, maxLevels - 1);
+		m_builtUpperOffsets[i] = m_upperBlocks;
+		m_upperBlocks += m_builtLevels[i];
+	}
+	m_builtLevel0.assign(m_rows * (1 + 2 * m_M), 0);
+	m_builtUpper.assign(m_upperBlocks * (1 + m_M), 0);
+
+	m_vectors = m_builtVectors.data();
+	m_levels = m_builtLevels.data();
+	m_upperOffsets = m_builtUpperOffsets.data();
+	m_level0 = m_builtLevel0.data();
+	m_upper = m_builtUpper.data();
+	m_entryPoint = 0;
+	m_maxLevel = m_levels[0];
+
+	// Nodes are inserted concurrently, each link list is only touched under the lock of its node
+	m_locks.reset(new std::mutex[m_rows]);
+	const unsigned int threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+	std::atomic<size_t> next(1);
+	const auto work = [this, &next]() {
+		for (size_t i = next++; i < m_rows; i = next++) {
+			insert((uint32_t)i);
+		}
+	};
+	std::vector<std::future<void>> futures;
+	for (unsigned int t = 1; t < threads; t++) {
+		futures.push_back(std::async(std::launch::async, work));
+	}
+	work();
+	for (auto& f : futures) {
+		f.get();
+	}
+	m_locks.reset();
+}
+
+void HnswIndex::insert(uint32_t node) {
+	const int level = m_levels[node];
+	// A node that opens a new top layer holds the entry point until it is linked in
+	std::unique_lock<std::mutex> global(m_globalLock);
+	const int maxLevel = m_maxLevel;
+	uint32_t current = m_entryPoint;
+	if (level <= maxLevel) {
+		global.unlock();
+	}
+
+	const float* query = vector(node);
+	float currentDistance = squaredDistance(query, vector(current));
+	for (int l = maxLevel; l > level; l--) {
+		greedyStep<true>(query, current, currentDistance, l);
+	}
+	for (int l = std::min(level, maxLevel); l >= 0; l--) {
+		std::vector<Candidate> candidates = searchLayer<true>(query, current, m_efConstruction, l);
+		candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [node](const Candidate& c) { return c.second == node; }), candidates.end());
+		if (candidates.empty()) {
+			continue;
+		}
+		current = candidates.front().second;
+		selectNeighbours(candidates, m_M);
+		{
+			const std::lock_guard<std::mutex> lock(m_locks[node]);
+			uint32_t* list = mutableLinks(node, l);
+			list[0] = (uint32_t)candidates.size();
+			for (size_t j = 0; j < candidates.size(); j++) {
+				list[1 + j] = candidates[j].second;
+			}
+		}
+		for (const auto& c : candidates) {
+			connect(c.second, node, l);
+		}
+	}
+	if (level > maxLevel) {
+		m_entryPoint = node;
+		m_maxLevel = level;
+	}
+}
+
+void HnswIndex::connect(uint32_t node, uint32_t neighbour, int level) {
+	const std::lock_guard<std::mutex> lock(m_locks[node]);
+	uint32_t* list = mutableLinks(node, level);
+	const int capacity = maxLinks(level);
+	if ((int)list[0] < capacity) {
+		list[1 + list[0]] = neighbour;
+		list[0]++;
+		return;
+	}
+	// A full list is pruned again with the new neighbour among the candidates
+	const float* base = vector(node);
+	std::vector<Candidate> candidates;
+	candidates.reserve(capacity + 1);
+	candidates.emplace_back(squaredDistance(base, vector(neighbour)), neighbour);
+	for (uint32_t j = 1; j <= list[0]; j++) {
+		candidates.emplace_back(squaredDistance(base, vector(list[j])), list[j]);
+	}
+	std::sort(candidates.begin(), candidates.end());
+	selectNeighbours(candidates, capacity);
+	list[0] = (uint32_t)candidates.size();
+	for (size_t j = 0; j < candidates.size(); j++) {
+		list[1 + j] = candidates[j].second;
+	}
+}
+
+void HnswIndex::selectNeighbours(std::vector<Candidate>& candidates, int maxLinks) const {
+	if ((int)candidates.size() <= maxLinks) {
+		return;
+	}
+	std::vector<Candidate> kept;
+	kept.reserve(maxLinks);
+	for (const auto& c : candidates) {
+		if ((int)kept.size() == maxLinks) {
+			break;
+		}
+		const float* v = vector(c.second);
+		const bool diverse = std::none_of(kept.begin(), kept.end(), [this, v, &c](const Candidate& k) {
+			return squaredDistance(v, vector(k.second)) < c.first;
+		});
+		if (diverse) {
+			kept.push_back(c);
+		}
+	}
+	candidates.swap(kept);
+}
+
+template<bool Locked>
+const uint32_t* HnswIndex::readLinks(uint32_t node, int level, std::vector<uint32_t>& buffer) const {
+	if constexpr (Locked) {
+		const std::lock_guard<std::mutex> lock(m_locks[node]);
+		const uint32_t* list = links(node, level);
+		buffer.assign(list, list + 1 + list[0]);
+		return buffer.data();
+	} else {
+		return links(node, level);
+	}
+}
+
+template<bool Locked>
+void HnswIndex::greedyStep(const float* query, uint32_t& current, float& currentDistance, int level) const {
+	std::vector<uint32_t> buffer;
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		const uint32_t* list = readLinks<Locked>(current, level, buffer);
+		for (uint32_t j = 1; j <= list[0]; j++) {
+			const float d = squaredDistance(query, vector(list[j]));
+			if (d < currentDistance) {
+				currentDistance = d;
+				current = list[j];
+				changed = true;
+			}
+		}
+	}
+}
+
+template<bool Locked>
+std::vector<HnswIndex::Candidate> HnswIndex::searchLayer(const float* query, uint32_t entry, int ef, int level) const {
+	VisitedList& visited = visitedList(m_rows);
+	// Nearest unexpanded node on top of candidates, farthest kept node on top of nearest
+	std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate>> candidates;
+	std::priority_queue<Candidate> nearest;
+	const float entryDistance = squaredDistance(query, vector(entry));
+	visited.visit(entry);
+	candidates.emplace(entryDistance, entry);
+	nearest.emplace(entryDistance, entry);
+
+	std::vector<uint32_t> buffer;
+	while (!candidates.empty()) {
+		const Candidate c = candidates.top();
+		if (c.first > nearest.top().first && (int)nearest.size() >= ef) {
+			break;
+		}
+		candidates.pop();
+		const uint32_t* list = readLinks<Locked>(c.second, level, buffer);
+		for (uint32_t j = 1; j <= list[0]; j++) {
+			const uint32_t n = list[j];
+			if (!visited.visit(n)) {
+				continue;
+			}
+			const float d = squaredDistance(query, vector(n));
+			if ((int)nearest.size() < ef || d < nearest.top().first) {
+				candidates.emplace(d, n);
+				nearest.emplace(d, n);
+				if ((int)nearest.size() > ef) {
+					nearest.pop();
+				}
+			}
+		}
+	}
+
+	std::vector<Candidate> result(nearest.size());
+	for (size_t i = result.size(); i-- > 0;) {
+		result[i] = nearest.top();
+		nearest.pop();
+	}
+	return result;
+}
+
+void HnswIndex::search(const float* record, int k, std::vector<int>& rows, std::vector<float>& distances) const {
+	rows.clear();
+	distances.clear();
+	if (!isOpen() || k <= 0) {
+		return;
+	}
+	float query[DESCRIPTORS_NUM];
+	for (int d = 0; d < DESCRIPTORS_NUM; d++) {
+		query[d] = record[d] * m_scales[d];
+	}
+	uint32_t current = m_entryPoint;
+	float currentDistance = squaredDistance(query, vector(current));
+	for (int l = m_maxLevel; l > 0; l--) {
+		greedyStep<false>(query, current, currentDistance, l);
+	}
+	const auto found = searchLayer<false>(query, current, std::max(m_efSearch, k), 0);
+	for (size_t i = 0; i < found.size() && (int)i < k; i++) {
+		rows.push_back((int)found[i].second);
+		distances.push_back(std::sqrt(found[i].first));
+	}
+}
+
+bool HnswIndex::save(const std::filesystem::path& filePath, uint64_t checksum) const {
+	HnswHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, hnswMagic, sizeof(hnswMagic));
+	header.version = version;
+	header.dimensions = DESCRIPTORS_NUM;
+	header.M = m_M;
+	header.efConstruction = m_efConstruction;
+	header.efSearch = m_efSearch;
+	header.maxLevel = m_maxLevel;
+	header.rows = m_rows;
+	header.entryPoint = m_entryPoint;
+	header.checksum = checksum;
+	header.upperBlocks = m_upperBlocks;
+	std::memcpy(header.scales, m_scales, sizeof(header.scales));
+
+	const uint64_t vectorsSize = m_rows * DESCRIPTORS_NUM * sizeof(float);
+	const uint64_t levelsSize = m_rows * sizeof(uint32_t);
+	const uint64_t upperOffsetsSize = m_rows * sizeof(uint64_t);
+	const uint64_t level0Size = m_rows * (1 + 2 * m_M) * sizeof(uint32_t);
+	const uint64_t upperSize = m_upperBlocks * (1 + m_M) * sizeof(uint32_t);
+	header.vectorsOffset = alignUp(sizeof(HnswHeader), vectorAlignment);
+	header.levelsOffset = alignUp(header.vectorsOffset + vectorsSize, sizeof(uint64_t));
+	header.upperOffsetsOffset = alignUp(header.levelsOffset + levelsSize, sizeof(uint64_t));
+	header.level0Offset = alignUp(header.upperOffsetsOffset + upperOffsetsSize, sizeof(uint64_t));
+	header.upperOffset = alignUp(header.level0Offset + level0Size, sizeof(uint64_t));
+	header.fileSize = header.upperOffset + upperSize;
+
+	// Written next to the target and renamed over it, so that a mapped index is never overwritten in place
+	const auto tmpPath = std::filesystem::path(filePath.string() + ".tmp");
+	{
+		std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+		uint64_t position = 0;
+		const std::vector<char> padding(vectorAlignment, 0);
+		const auto writeAt = [&file, &position, &padding](uint64_t offset, const void* data, uint64_t size) {
+			file.write(padding.data(), offset - position);
+			file.write(static_cast<const char*>(data), size);
+			position = offset + size;
+		};
+		writeAt(0, &header, sizeof(header));
+		writeAt(header.vectorsOffset, m_vectors, vectorsSize);
+		writeAt(header.levelsOffset, m_levels, levelsSize);
+		writeAt(header.upperOffsetsOffset, m_upperOffsets, upperOffsetsSize);
+		writeAt(header.level0Offset, m_level0, level0Size);
+		writeAt(header.upperOffset, m_upper, upperSize);
+		if (!file) {
+			std::cout << "Unable to write " << tmpPath << std::endl;
+			return false;
+		}
+	}
+	std::error_code error;
+	std::filesystem::rename(tmpPath, filePath, error);
+	if (error) {
+		std::cout << "Unable to replace " << filePath << ": " << error.message() << std::endl;
+		std::filesystem::remove(tmpPath, error);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,104 @@
+#ifndef __HNSW_INDEX_HPP__
+#define __HNSW_INDEX_HPP__
+
+#include "feature_store.hpp"
+#include <filesystem>
+#include <vector>
+#include <mutex>
+#include <memory>
+#include <cstdint>
+
+// Graph parameters of the HNSW index. M is the number of links per node on the upper layers (twice that on
+// layer 0), efConstruction the candidate list of an insertion and efSearch the one of a query.
+// 0 keeps the value of the saved index, or the default when there is none. A saved index with another M or
+// efConstruction is built again, efSearch only changes the queries.
+// threads is the number of insertion threads, 0 for one per hardware thread.
+struct HnswOptions {
+	int M = 0;
+	int efConstruction = 0;
+	int efSearch = 0;
+	unsigned int threads = 0;
+};
+
+// Hierarchical navigable small world graph (Malkov & Yashunin) over the DB records, with the Euclidean
+// distance between records whose dimensions are multiplied by scales. The DB passes the square roots of the
+// quadratic_Weights weights, w0 * sw_f for the scalars and w_h for the bins of histogram h, so the squared
+// distance is its scalar term plus the L2 distance of the histograms in place of the EMD.
+// Saved as feats_hnsw.bin next to feats.bin, mapped on load and rebuilt when the features or the scales change.
+class HnswIndex {
+	public:
+		static constexpr const char* fileName = "feats_hnsw.bin";
+		static const uint32_t version = 1;
+		static constexpr int defaultM = 16;
+		static constexpr int defaultEfConstruction = 200;
+		static constexpr int defaultEfSearch = 64;
+
+		~HnswIndex();
+
+		// Maps the index of store, or builds it and saves it. scales holds DESCRIPTORS_NUM floats
+		bool open(const std::filesystem::path& dbPath, const FeatureStore& store, const float* scales, const HnswOptions& options = HnswOptions());
+		void close();
+		inline bool isOpen() const { return m_rows != 0; }
+
+		inline int M() const { return m_M; }
+		inline int efConstruction() const { return m_efConstruction; }
+		inline int efSearch() const { return m_efSearch; }
+		inline void setEfSearch(int efSearch) { m_efSearch = efSearch; }
+
+		// The k rows nearest to a record laid out like the DB rows, nearest first, with their distances
+		void search(const float* record, int k, std::vector<int>& rows, std::vector<float>& distances) const;
+
+	private:
+		typedef std::pair<float, uint32_t> Candidate;
+
+		bool map(const std::filesystem::path& filePath, uint64_t checksum, const float* scales, const HnswOptions& options);
+		void build(const FeatureStore& store, const float* scales, const HnswOptions& options);
+		bool save(const std::filesystem::path& filePath, uint64_t checksum) const;
+
+		void insert(uint32_t node);
+		void connect(uint32_t node, uint32_t neighbour, int level);
+		// Keeps up to maxLinks of the candidates (nearest first), skipping those closer to a kept one than to the base
+		void selectNeighbours(std::vector<Candidate>& candidates, int maxLinks) const;
+		// The link count and links of node on level, copied under its lock while the graph is built
+		template<bool Locked> const uint32_t* readLinks(uint32_t node, int level, std::vector<uint32_t>& buffer) const;
+		template<bool Locked> void greedyStep(const float* query, uint32_t& current, float& currentDistance, int level) const;
+		template<bool Locked> std::vector<Candidate> searchLayer(const float* query, uint32_t entry, int ef, int level) const;
+
+		inline const float* vector(uint32_t node) const { return m_vectors + (size_t)node * DESCRIPTORS_NUM; }
+		inline int maxLinks(int level) const { return level == 0 ? 2 * m_M : m_M; }
+		// Link count followed by the links of node on level
+		inline const uint32_t* links(uint32_t node, int level) const {
+			return level == 0 ? m_level0 + (size_t)node * (1 + 2 * m_M) : m_upper + (m_upperOffsets[node] + level - 1) * (1 + m_M);
+		}
+		inline uint32_t* mutableLinks(uint32_t node, int level) { return const_cast<uint32_t*>(links(node, level)); }
+
+		int m_M = 0;
+		int m_efConstruction = 0;
+		int m_efSearch = 0;
+		uint64_t m_rows = 0;
+		uint32_t m_entryPoint = 0;
+		int m_maxLevel = 0;
+		float m_scales[DESCRIPTORS_NUM];
+
+		// Either into the mapped file or into the vectors below while the index is built
+		const float* m_vectors = nullptr;
+		const uint32_t* m_levels = nullptr;
+		const uint64_t* m_upperOffsets = nullptr;
+		const uint32_t* m_level0 = nullptr;
+		const uint32_t* m_upper = nullptr;
+
+		void* m_data = nullptr;
+		size_t m_size = 0;
+		std::vector<float> m_builtVectors;
+		std::vector<uint32_t> m_builtLevels;
+		std::vector<uint64_t> m_builtUpperOffsets;
+		std::vector<uint32_t> m_builtLevel0;
+		std::vector<uint32_t> m_builtUpper;
+		uint64_t m_upperBlocks = 0;
+
+		// Only used by build, one lock per node guards its links and the global one the entry point
+		std::unique_ptr<std::mutex[]> m_locks;
+		std::mutex m_globalLock;
+};
+
+#endif
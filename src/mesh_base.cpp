@@ -1,6 +1,7 @@
 #include "mesh_base.hpp"
 #include "shader_map.hpp"
 #include "normalization.hpp"
+#include "moments.hpp"
 #include "mesh_repair.hpp"
 #include "glad/glad.h"
 #include "glm/gtx/transform.hpp"
@@ -55,7 +56,8 @@ void MeshBase::repair() {
 
 void MeshBase::normalize(int target){
 	const int thresh = 200;
-	while(m_vertices.rows() < target - thresh || m_vertices.rows() > target + thresh){
+	// target <= 0 keeps the tessellation, e.g. for features sampled over the surface
+	while(target > 0 && (m_vertices.rows() < target - thresh || m_vertices.rows() > target + thresh)){
 		while(m_vertices.rows() < target - thresh) {
 			// Upsample
 			upsample();
@@ -213,12 +215,9 @@ void MeshBase::scale() {
 void MeshBase::alignEigenVectorsToAxes() {
 	saveState();
 
-	Eigen::Vector3f centroid;
-	igl::centroid(m_vertices, m_faces, centroid);
-
-	const auto covarianceMatrix = Normalization::calculateCovarianceMatrix(m_vertices, centroid);
-	const auto eigen = Normalization::calculateEigen(covarianceMatrix);
-	Normalization::alignPrincipalAxes(m_vertices, centroid, eigen[2].first, eigen[1].first);
+	const auto moments = Moments::computeMoments(m_vertices, m_faces);
+	const auto eigen = Normalization::calculateEigen(moments.covariance);
+	Normalization::alignPrincipalAxes(m_vertices, moments.centroid, eigen[2].first, eigen[1].first);
 	recomputeAndRender();
 }
 
@@ -252,19 +251,29 @@ void MeshBase::recomputeAndRender() {
 		dataToOpenGL();
 	}
 }
-void MeshBase::computeFeatures(unsigned int descs){
-	Descriptors::computeDescriptors(m_vertices, m_faces, descs, features);
-}
-
-DescriptorType MeshBase::getDescriptor(Features f) {
-	auto t = features.find(f);
-	if(t == features.end()) return 0.0f;
-	else return t->second;
+void MeshBase::computeFeatures(unsigned int descs, const Descriptors::SamplingOptions& sampling, bool parallel){
+	Descriptors::computeDescriptors(m_vertices, m_faces, descs, features, sampling, parallel);
 }
 
 void MeshBase::getCentroid(Eigen::Vector3f &c){
 	igl::centroid(m_vertices, m_faces, c);
 }
+
+uint64_t MeshBase::getContentHash() const {
+	uint64_t h = 0xCBF29CE484222325ULL;
+	const auto hashBytes = [&h](const void* data, size_t size) {
+		const unsigned char* bytes = static_cast<const unsigned char*>(data);
+		for (size_t i = 0; i < size; i++) {
+			h ^= bytes[i];
+			h *= 0x100000001B3ULL;
+		}
+	};
+	const int64_t dims[4] = { m_vertices.rows(), m_vertices.cols(), m_faces.rows(), m_faces.cols() };
+	hashBytes(dims, sizeof(dims));
+	hashBytes(m_vertices.data(), m_vertices.size() * sizeof(float));
+	hashBytes(m_faces.data(), m_faces.size() * sizeof(int));
+	return h;
+}
 void MeshBase::centerToView() {
 	saveState();
 	Eigen::Vector3f c;
@@ -38,10 +38,12 @@ class MeshBase {
 		void flipMirrorTest();
 		void undoLastOperation();
 
-		DescriptorType getDescriptor(Features f);
-		void computeFeatures(unsigned int desc = Descriptors::descriptor_all);
+		inline float getDescriptor(Features f) const { return features.scalar(f); }
+		void computeFeatures(unsigned int desc = Descriptors::descriptor_all, const Descriptors::SamplingOptions& sampling = Descriptors::SamplingOptions(), bool parallel = false);
 		void getCentroid(Eigen::Vector3f &c);
-		inline DescriptorMap getDescriptorMap() { return features; }
+		// FNV-1a of the vertex and face data, the same for any copy of the mesh wherever it is stored
+		uint64_t getContentHash() const;
+		inline const FeatureRecord& getFeatures() const { return features; }
 
 		virtual void recomputeAndRender();
 		virtual void draw(const glm::mat4& projView, const glm::vec3& matterialDiffuse, const glm::vec3& cameraPos);
@@ -68,7 +70,7 @@ class MeshBase {
 		glm::mat4 m_modelMatrix;
 		bool m_prepared = false;
 
-		DescriptorMap features;
+		FeatureRecord features;
 
 		void init();
 		void dataToOpenGL();
@@ -0,0 +1,50 @@
+#include "moments.hpp"
+#include <limits>
+
+namespace Moments {
+	MeshMoments computeMoments(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F) {
+		MeshMoments moments;
+
+		// Faces: area, volume and centroid via the divergence theorem
+		// ("Calculating the volume and centroid of a polyhedron in 3d", Nuernberg 2013, as in igl::centroid)
+		double area = 0.0;
+		double volume = 0.0;
+		Eigen::Vector3d centroid = Eigen::Vector3d::Zero();
+		for (int f = 0; f < F.rows(); f++) {
+			const Eigen::Vector3d a = V.row(F(f, 0)).cast<double>();
+			const Eigen::Vector3d b = V.row(F(f, 1)).cast<double>();
+			const Eigen::Vector3d c = V.row(F(f, 2)).cast<double>();
+
+			const Eigen::Vector3d n = (b - a).cross(c - a);
+			area += n.norm() / 2;
+			volume += n.dot(a) / 6;
+			centroid.array() += n.array() * ((a + b).array().square() + (b + c).array().square() + (c + a).array().square()) / 24;
+		}
+		centroid /= 2 * volume;
+
+		// Vertices: bounding box and raw first/second moments, the covariance around the centroid follows from them
+		Eigen::Vector3f bbMin = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+		Eigen::Vector3f bbMax = Eigen::Vector3f::Constant(std::numeric_limits<float>::lowest());
+		Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+		Eigen::Matrix3d sumSquares = Eigen::Matrix3d::Zero();
+		for (int i = 0; i < V.rows(); i++) {
+			const Eigen::Vector3f p = V.row(i);
+			bbMin = bbMin.cwiseMin(p);
+			bbMax = bbMax.cwiseMax(p);
+			const Eigen::Vector3d pd = p.cast<double>();
+			sum += pd;
+			sumSquares += pd * pd.transpose();
+		}
+		const double n = V.rows();
+		Eigen::Matrix3d covariance = sumSquares - centroid * sum.transpose() - sum * centroid.transpose() + n * centroid * centroid.transpose();
+		covariance /= (n - 1);
+
+		moments.area = area;
+		moments.signedVolume = volume;
+		moments.centroid = centroid.cast<float>();
+		moments.bbMin = bbMin;
+		moments.bbMax = bbMax;
+		moments.covariance = covariance.cast<float>();
+		return moments;
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef __MOMENTS_HPP__
+#define __MOMENTS_HPP__
+
+#include "Eigen/Dense"
+
+namespace Moments {
+
+	// Everything the global descriptors and the normalization steps need from a mesh,
+	// gathered in a single sweep over the faces and a single sweep over the vertices
+	struct MeshMoments {
+		float area;
+		float signedVolume;
+		Eigen::Vector3f centroid;		// same solid centroid as igl::centroid
+		Eigen::Vector3f bbMin;
+		Eigen::Vector3f bbMax;
+		Eigen::Matrix3f covariance;		// vertex covariance around centroid, same as Normalization::calculateCovarianceMatrix
+	};
+
+	MeshMoments computeMoments(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F);
+};
+
+#endif
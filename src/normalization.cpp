@@ -13,22 +13,16 @@ namespace Normalization {
 	}
 
 	Eigen::Matrix3f calculateCovarianceMatrix(const Eigen::MatrixXf& V, const Eigen::Vector3f& centroid) {
-		Eigen::Matrix3f covarianceMatrix = Eigen::Matrix3f::Identity();
-
-		// Could be optimized by not looping and explicitly setting 0,1 and 1,0 at the same time for example (symmetric)
-		// Probably completely pointless though
-		for (int i = 0; i < 3; i++) {
-			for (int j = 0; j < 3; j++) {
-				float sum = 0;
-				for (int index = 0; index < V.rows(); index++) {
-					sum += (V.row(index)[i] - centroid[i]) * (V.row(index)[j] - centroid[j]);
-				}
-				sum /= (V.rows() - 1);
-				covarianceMatrix.row(i)[j] = sum;
-			}
+		// Single sweep over the vertices accumulating the whole (symmetric) outer product
+		Eigen::Matrix3d covarianceMatrix = Eigen::Matrix3d::Zero();
+		const Eigen::Vector3d c = centroid.cast<double>();
+		for (int index = 0; index < V.rows(); index++) {
+			const Eigen::Vector3d diff = V.row(index).transpose().cast<double>() - c;
+			covarianceMatrix += diff * diff.transpose();
 		}
+		covarianceMatrix /= (V.rows() - 1);
 
-		return covarianceMatrix;
+		return covarianceMatrix.cast<float>();
 	}
 
 	std::vector<std::pair<Eigen::Vector3f, float>> calculateEigen(const Eigen::Matrix3f& covarianceMatrix) {
@@ -6,6 +6,7 @@
 int main(int argc, char* args[]) {
 	if(argc < 3){
 		std::cout << "USAGE:" << std::endl << args[0] << " path-to-mesh target-vertices" << std::endl;
+		std::cout << "  target-vertices <= 0 skips the resampling and only normalizes the pose" << std::endl;
 		return 1;
 	}
 
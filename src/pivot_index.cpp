@@ -0,0 +1,378 @@
+#include "pivot_index.hpp"
+#include "distance_kernels.hpp"
+#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <algorithm>
+
+namespace {
+	const char pivotMagic[8] = { 'I', 'P', 'P', 'I', 'V', 'O', 'T', '\0' };
+	const int steps = FeatureRecord::histogramBins - 1;
+	// The dimensions of the bucket boxes, the scalars then the CDF values of the five histograms
+	const int boxDimensions = FeatureRecord::scalars + FeatureRecord::histograms * steps;
+	// Buckets bounded together, their nearest box points fit in L2
+	const size_t boundBlock = 256;
+
+	struct PivotIndexHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t pivots;
+		uint64_t rows;
+		uint64_t stride;
+		uint64_t checksum;
+		uint64_t buckets;
+	};
+
+	// NaNs last, so sorting and selecting stay well defined
+	inline float orderKey(float v) {
+		return v != v ? std::numeric_limits<float>::infinity() : v;
+	}
+}
+
+bool PivotIndex::open(const std::filesystem::path& dbPath, const FeatureStore& store, const float* deltas) {
+	close();
+	if (!store.isOpen() || !store.rows()) {
+		return false;
+	}
+	m_cdfColumns = store.cdfColumns();
+	m_deltas = deltas;
+	const auto filePath = dbPath / fileName;
+	if (!std::filesystem::exists(filePath) || !load(filePath, store, store.checksum())) {
+		close();
+		return false;
+	}
+	setBuckets(store);
+	return true;
+}
+
+bool PivotIndex::build(const std::filesystem::path& dbPath, const FeatureStore& store, const float* deltas, int pivots) {
+	close();
+	if (!store.isOpen() || !store.rows()) {
+		return false;
+	}
+	m_cdfColumns = store.cdfColumns();
+	m_deltas = deltas;
+	choosePivots(store, pivots);
+	partition(store);
+	setBuckets(store);
+	return save(dbPath / fileName, store, store.checksum());
+}
+
+void PivotIndex::close() {
+	m_cdfColumns = nullptr;
+	m_deltas = nullptr;
+	m_pivotRows.clear();
+	m_distances.clear();
+	m_columns.clear();
+	m_order.clear();
+	m_bucketStarts.clear();
+	m_bucketData.clear();
+	m_bucketColumns.clear();
+	m_low.clear();
+	m_high.clear();
+	m_pivotLow.clear();
+	m_pivotHigh.clear();
+}
+
+void PivotIndex::setColumns(size_t stride) {
+	m_columns.resize(m_pivotRows.size());
+	for (size_t p = 0; p < m_pivotRows.size(); p++) {
+		m_columns[p] = m_distances.data() + p * stride;
+	}
+}
+
+void PivotIndex::choosePivots(const FeatureStore& store, int pivots) {
+	const size_t rows = store.rows();
+	const size_t stride = store.stride();
+	pivots = (int)std::min<size_t>(std::max(pivots, 1), rows);
+	m_distances.assign(pivots * stride, 0.0f);
+
+	// Farthest-first: every pivot is the row farthest from the ones already picked, starting from row 0
+	std::vector<float> closest(rows, std::numeric_limits<float>::infinity());
+	std::vector<float> pivotCdfs(FeatureRecord::histograms * steps);
+	size_t next = 0;
+	for (int p = 0; p < pivots; p++) {
+		m_pivotRows.push_back(next);
+		for (int c = 0; c < FeatureRecord::histograms * steps; c++) {
+			pivotCdfs[c] = m_cdfColumns[c][next];
+		}
+		float* column = m_distances.data() + p * stride;
+		for (int h = 0; h < FeatureRecord::histograms; h++) {
+			DistanceKernels::addEarthMoversDistances(m_cdfColumns + h * steps, pivotCdfs.data() + h * steps, m_deltas, 1.0f, (size_t)0, rows, column);
+		}
+
+		float farthest = 0.0f;
+		for (size_t i = 0; i < rows; i++) {
+			closest[i] = std::min(closest[i], column[i]);
+			if (closest[i] > farthest) {
+				farthest = closest[i];
+				next = i;
+			}
+		}
+		// Every row is on a pivot already, more pivots would not tighten anything
+		if (farthest <= 0.0f) {
+			break;
+		}
+	}
+	m_distances.resize(m_pivotRows.size() * stride);
+	setColumns(stride);
+}
+
+void PivotIndex::partition(const FeatureStore& store) {
+	const uint32_t rows = (uint32_t)store.rows();
+	const auto value = [&store, this](int d, uint32_t row) {
+		return d < FeatureRecord::scalars ? store.column(d)[row] : m_cdfColumns[d - FeatureRecord::scalars][row];
+	};
+	const auto range = [&](int d, uint32_t begin, uint32_t end) {
+		float low = std::numeric_limits<float>::infinity(), high = -std::numeric_limits<float>::infinity();
+		for (uint32_t i = begin; i < end; i++) {
+			const float v = value(d, m_order[i]);
+			low = v < low ? v : low;
+			high = v > high ? v : high;
+		}
+		return high > low ? high - low : 0.0f;
+	};
+
+	m_order.resize(rows);
+	std::iota(m_order.begin(), m_order.end(), 0);
+	// A node is split at the median of the dimension it covers the largest part of, relative to the whole DB
+	float spread[boxDimensions];
+	for (int d = 0; d < boxDimensions; d++) {
+		spread[d] = range(d, 0, rows);
+	}
+	m_bucketStarts.assign(1, 0);
+	// Left node first, so the buckets come out in the order of m_order
+	std::vector<std::pair<uint32_t, uint32_t>> nodes = { { 0, rows } };
+	while (!nodes.empty()) {
+		const auto [begin, end] = nodes.back();
+		nodes.pop_back();
+		if (end - begin <= (uint32_t)bucketRows) {
+			m_bucketStarts.push_back(end);
+			continue;
+		}
+		int split = 0;
+		float widest = -1.0f;
+		for (int d = 0; d < boxDimensions; d++) {
+			const float width = spread[d] > 0.0f ? range(d, begin, end) / spread[d] : 0.0f;
+			if (width > widest) {
+				widest = width;
+				split = d;
+			}
+		}
+		const uint32_t middle = begin + (end - begin) / 2;
+		std::nth_element(m_order.begin() + begin, m_order.begin() + middle, m_order.begin() + end, [&](uint32_t a, uint32_t b) {
+			return orderKey(value(split, a)) < orderKey(value(split, b));
+		});
+		nodes.push_back({ middle, end });
+		nodes.push_back({ begin, middle });
+	}
+}
+
+void PivotIndex::setBuckets(const FeatureStore& store) {
+	const size_t rows = m_order.size();
+	const size_t buckets = this->buckets();
+	const int pivots = this->pivots();
+
+	// The scalars, the CDFs and the pivot distances of every row, copied in bucket order
+	m_bucketData.resize((boxDimensions + pivots) * rows);
+	m_bucketColumns.assign(DESCRIPTORS_NUM + FeatureRecord::histograms * steps + pivots, nullptr);
+	for (int d = 0; d < boxDimensions + pivots; d++) {
+		const float* from = d < FeatureRecord::scalars ? store.column(d) :
+			d < boxDimensions ? m_cdfColumns[d - FeatureRecord::scalars] : m_columns[d - boxDimensions];
+		float* to = m_bucketData.data() + d * rows;
+		for (size_t i = 0; i < rows; i++) {
+			to[i] = from[m_order[i]];
+		}
+		m_bucketColumns[d < FeatureRecord::scalars ? d : DESCRIPTORS_NUM + d - FeatureRecord::scalars] = to;
+	}
+
+	// The boxes and the pivot distance ranges. NaNs fail both comparisons and are left out
+	const float inf = std::numeric_limits<float>::infinity();
+	m_low.assign(boxDimensions * buckets, inf);
+	m_high.assign(boxDimensions * buckets, -inf);
+	m_pivotLow.assign(pivots * buckets, inf);
+	m_pivotHigh.assign(pivots * buckets, -inf);
+	for (int d = 0; d < boxDimensions + pivots; d++) {
+		const float* column = m_bucketData.data() + d * rows;
+		float* low = d < boxDimensions ? m_low.data() + d * buckets : m_pivotLow.data() + (d - boxDimensions) * buckets;
+		float* high = d < boxDimensions ? m_high.data() + d * buckets : m_pivotHigh.data() + (d - boxDimensions) * buckets;
+		for (size_t b = 0; b < buckets; b++) {
+			for (size_t i = m_bucketStarts[b]; i < m_bucketStarts[b + 1]; i++) {
+				low[b] = column[i] < low[b] ? column[i] : low[b];
+				high[b] = column[i] > high[b] ? column[i] : high[b];
+			}
+		}
+	}
+	// The scan turns a NaN scalar term into 0, a bucket with a NaN scalar can not be bounded on its scalars.
+	// A NaN in the CDFs gives a NaN distance, which never makes it into a full TopK
+	for (size_t b = 0; b < buckets; b++) {
+		bool nanScalars = false;
+		for (int d = 0; d < FeatureRecord::scalars; d++) {
+			const float* column = m_bucketData.data() + d * rows;
+			for (size_t i = m_bucketStarts[b]; i < m_bucketStarts[b + 1]; i++) {
+				nanScalars |= column[i] != column[i];
+			}
+		}
+		if (nanScalars) {
+			for (int d = 0; d < FeatureRecord::scalars; d++) {
+				m_low[d * buckets + b] = -inf;
+				m_high[d * buckets + b] = inf;
+			}
+		}
+	}
+}
+
+void PivotIndex::queryDistances(const float* queryCdfs, float* out) const {
+	for (int p = 0; p < pivots(); p++) {
+		const size_t row = m_pivotRows[p];
+		float d = 0.0f;
+		for (int h = 0; h < FeatureRecord::histograms; h++) {
+			float dist = 0.0f;
+			for (int k = 0; k < steps; k++) {
+				dist += std::abs(queryCdfs[h * steps + k] - m_cdfColumns[h * steps + k][row]) * m_deltas[k];
+			}
+			d = d + dist * 1.0f;
+		}
+		out[p] = d;
+	}
+}
+
+void PivotIndex::bucketBounds(const float* query, const float* queryCdfs, const float* queryPivots, const DistanceKernels::ScanWeights& w, float pivotWeight, float* out) const {
+	const size_t buckets = this->buckets();
+	// The point of a box nearest to the query gets the distance the scan would give it. Every term only
+	// grows with the differences per dimension, so no row of the box is closer
+	std::vector<float> nearest(boxDimensions * boundBlock);
+	std::vector<float> emds(boundBlock);
+	std::vector<float> pivotBounds(boundBlock);
+	const float* scalarColumns[DESCRIPTORS_NUM] = {};
+	const float* cdfColumns[FeatureRecord::histograms * steps];
+	for (int d = 0; d < boxDimensions; d++) {
+		const float* column = nearest.data() + d * boundBlock;
+		if (d < FeatureRecord::scalars) {
+			scalarColumns[d] = column;
+		} else {
+			cdfColumns[d - FeatureRecord::scalars] = column;
+		}
+	}
+	const int pivots = this->pivots();
+
+	for (size_t first = 0; first < buckets; first += boundBlock) {
+		const size_t n = std::min(boundBlock, buckets - first);
+		for (int d = 0; d < boxDimensions; d++) {
+			const float q = d < FeatureRecord::scalars ? query[d] : queryCdfs[d - FeatureRecord::scalars];
+			const float* low = m_low.data() + d * buckets + first;
+			const float* high = m_high.data() + d * buckets + first;
+			float* column = nearest.data() + d * boundBlock;
+			for (size_t j = 0; j < n; j++) {
+				column[j] = std::min(std::max(q, low[j]), high[j]);
+			}
+		}
+		DistanceKernels::weightedDistances(scalarColumns, query, w, (size_t)0, n, out + first);
+		std::fill(emds.begin(), emds.begin() + n, 0.0f);
+		for (int h = 0; h < FeatureRecord::histograms; h++) {
+			DistanceKernels::addEarthMoversDistances(cdfColumns + h * steps, queryCdfs + h * steps, m_deltas, w.functionWeights[h + 1], (size_t)0, n, emds.data());
+		}
+
+		// The EMDs are bounded by the box or by the pivots, whichever is higher
+		std::fill(pivotBounds.begin(), pivotBounds.begin() + n, 0.0f);
+		for (int p = 0; p < pivots; p++) {
+			const float q = queryPivots[p];
+			const float* low = m_pivotLow.data() + p * buckets + first;
+			const float* high = m_pivotHigh.data() + p * buckets + first;
+			for (size_t j = 0; j < n; j++) {
+				const float x = std::min(std::max(q, low[j]), high[j]);
+				const float b = std::abs(q - x) - slack * (q + high[j]);
+				pivotBounds[j] = b > pivotBounds[j] ? b : pivotBounds[j];
+			}
+		}
+		for (size_t j = 0; j < n; j++) {
+			const float histograms = std::max(emds[j], pivotBounds[j] * pivotWeight);
+			out[first + j] = (out[first + j] + histograms) * (1.0f - slack);
+		}
+	}
+}
+
+bool PivotIndex::load(const std::filesystem::path& filePath, const FeatureStore& store, uint64_t checksum) {
+	std::ifstream file(filePath, std::ios::binary);
+	PivotIndexHeader header;
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		std::memcmp(header.magic, pivotMagic, sizeof(pivotMagic)) != 0 ||
+		header.version != version ||
+		header.rows != store.rows() ||
+		header.stride != store.stride() ||
+		header.checksum != checksum ||
+		header.pivots == 0 || header.pivots > header.rows ||
+		header.buckets == 0 || header.buckets > header.rows) {
+		return false;
+	}
+	m_pivotRows.resize(header.pivots);
+	m_distances.resize(header.pivots * header.stride);
+	m_bucketStarts.resize(header.buckets + 1);
+	m_order.resize(header.rows);
+	if (!file.read(reinterpret_cast<char*>(m_pivotRows.data()), m_pivotRows.size() * sizeof(uint64_t)) ||
+		!file.read(reinterpret_cast<char*>(m_distances.data()), m_distances.size() * sizeof(float)) ||
+		!file.read(reinterpret_cast<char*>(m_bucketStarts.data()), m_bucketStarts.size() * sizeof(uint32_t)) ||
+		!file.read(reinterpret_cast<char*>(m_order.data()), m_order.size() * sizeof(uint32_t))) {
+		return false;
+	}
+	for (auto row : m_pivotRows) {
+		if (row >= header.rows) {
+			return false;
+		}
+	}
+	// The buckets have to cover every row exactly once, with at most bucketRows each
+	if (m_bucketStarts.front() != 0 || m_bucketStarts.back() != header.rows) {
+		return false;
+	}
+	for (size_t b = 0; b < header.buckets; b++) {
+		if (m_bucketStarts[b] >= m_bucketStarts[b + 1] || m_bucketStarts[b + 1] - m_bucketStarts[b] > (uint32_t)bucketRows) {
+			return false;
+		}
+	}
+	std::vector<bool> seen(header.rows, false);
+	for (auto row : m_order) {
+		if (row >= header.rows || seen[row]) {
+			return false;
+		}
+		seen[row] = true;
+	}
+	setColumns(header.stride);
+	return true;
+}
+
+bool PivotIndex::save(const std::filesystem::path& filePath, const FeatureStore& store, uint64_t checksum) const {
+	PivotIndexHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, pivotMagic, sizeof(pivotMagic));
+	header.version = version;
+	header.pivots = (uint32_t)m_pivotRows.size();
+	header.rows = store.rows();
+	header.stride = store.stride();
+	header.checksum = checksum;
+	header.buckets = buckets();
+
+	// Written next to the target and renamed over it, so an interrupted write never leaves a table that loads
+	const auto tmpPath = std::filesystem::path(filePath.string() + ".tmp");
+	{
+		std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(m_pivotRows.data()), m_pivotRows.size() * sizeof(uint64_t));
+		file.write(reinterpret_cast<const char*>(m_distances.data()), m_distances.size() * sizeof(float));
+		file.write(reinterpret_cast<const char*>(m_bucketStarts.data()), m_bucketStarts.size() * sizeof(uint32_t));
+		file.write(reinterpret_cast<const char*>(m_order.data()), m_order.size() * sizeof(uint32_t));
+		if (!file) {
+			std::cout << "Unable to write " << tmpPath << std::endl;
+			return false;
+		}
+	}
+	std::error_code error;
+	std::filesystem::rename(tmpPath, filePath, error);
+	if (error) {
+		std::cout << "Unable to replace " << filePath << ": " << error.message() << std::endl;
+		std::filesystem::remove(tmpPath, error);
+		return false;
+	}
+	return true;
+}
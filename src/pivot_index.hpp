@@ -0,0 +1,85 @@
+#ifndef __PIVOT_INDEX_HPP__
+#define __PIVOT_INDEX_HPP__
+
+#include "feature_store.hpp"
+#include "distance_kernels.hpp"
+#include <filesystem>
+#include <vector>
+#include <cstdint>
+
+// LAESA-style pivot table for the EMD part of the exact retrieval. For P pivot shapes it keeps the
+// distance of every DB shape to each pivot, where the distance is the sum of the five shape
+// distribution EMDs. That sum is a metric, so for a query q and a row x
+//   sum_h w_h * EMD_h(q, x) >= min_h w_h * max_p |D(q, p) - D(x, p)|
+// and rows whose bound is already above the k-th best distance never get their EMDs computed.
+// The rows are also split into buckets of nearby shapes (a k-d partition over the scalars and the
+// histogram CDFs). A bucket is bounded as a whole by its box of scalar and CDF values and by its range
+// of pivot distances, so the scan visits the buckets best bound first and skips every bucket whose
+// bound is above the k-th best distance without touching its rows.
+// Built by FeaturesExtractor as feats_pivots.bin next to feats.bin, retrieval only loads it.
+class PivotIndex {
+	public:
+		static constexpr const char* fileName = "feats_pivots.bin";
+		static const uint32_t version = 2;
+		static const int defaultPivots = 8;
+		// Rows of a bucket at most, the partition stops splitting below that
+		static const int bucketRows = 128;
+		// Relative slack on the bounds, far above the float rounding of the distances, so it can never drop a row the full evaluation would keep
+		static constexpr float slack = 1e-4f;
+
+		// Loads the table saved for store, false if there is none or it belongs to other features.
+		// deltas are the support steps of EarthMovers::EqualSupport. store and deltas must outlive the index
+		bool open(const std::filesystem::path& dbPath, const FeatureStore& store, const float* deltas);
+		// Builds the table for store with the given number of pivots and saves it
+		bool build(const std::filesystem::path& dbPath, const FeatureStore& store, const float* deltas, int pivots = defaultPivots);
+		void close();
+
+		inline int pivots() const { return (int)m_pivotRows.size(); }
+		inline size_t pivotRow(int p) const { return m_pivotRows[p]; }
+		inline const float* const* columns() const { return m_columns.data(); }
+
+		// D(q, p) for every pivot, from the CDFs of the query histograms one after the other
+		void queryDistances(const float* queryCdfs, float* out) const;
+
+		inline size_t buckets() const { return m_bucketStarts.empty() ? 0 : m_bucketStarts.size() - 1; }
+		// Bucket b holds the positions [bucketBegin(b), bucketEnd(b)) of the bucket order
+		inline size_t bucketBegin(size_t b) const { return m_bucketStarts[b]; }
+		inline size_t bucketEnd(size_t b) const { return m_bucketStarts[b + 1]; }
+		// DB row at a position of the bucket order
+		inline uint32_t bucketRow(size_t i) const { return m_order[i]; }
+		// Copies of the scan columns in bucket order, so a bucket is read in one piece: the FeatureStore columns
+		// (only the scalars, the histogram bins are null), the CDF columns and the pivot distance columns
+		inline const float* const* bucketColumns() const { return m_bucketColumns.data(); }
+		inline const float* const* bucketCdfColumns() const { return m_bucketColumns.data() + DESCRIPTORS_NUM; }
+		inline const float* const* bucketPivotColumns() const { return m_bucketColumns.data() + DESCRIPTORS_NUM + FeatureRecord::histograms * (FeatureRecord::histogramBins - 1); }
+		// Lower bound of the distance between the query and every row of each bucket, for the weights of a
+		// RetrievalEngine scan with the EMD (so w.flatHistograms is false) and with no negative weight.
+		// query is the standardized record, queryCdfs and queryPivots come from queryDistances, pivotWeight
+		// is the smallest histogram weight. out holds buckets() floats
+		void bucketBounds(const float* query, const float* queryCdfs, const float* queryPivots, const DistanceKernels::ScanWeights& w, float pivotWeight, float* out) const;
+
+	private:
+		void choosePivots(const FeatureStore& store, int pivots);
+		void partition(const FeatureStore& store);
+		bool load(const std::filesystem::path& filePath, const FeatureStore& store, uint64_t checksum);
+		bool save(const std::filesystem::path& filePath, const FeatureStore& store, uint64_t checksum) const;
+		void setColumns(size_t stride);
+		void setBuckets(const FeatureStore& store);
+
+		const float* const* m_cdfColumns = nullptr;
+		const float* m_deltas = nullptr;
+		std::vector<uint64_t> m_pivotRows;
+		std::vector<float> m_distances;			// pivots columns of stride floats
+		std::vector<const float*> m_columns;
+		std::vector<uint32_t> m_order;			// the rows, bucket after bucket
+		std::vector<uint32_t> m_bucketStarts;	// buckets + 1 offsets into m_order
+		std::vector<float> m_bucketData;
+		std::vector<const float*> m_bucketColumns;
+		// Per bucket, dimension after dimension: the boxes over the scalars then the CDFs, the pivot distance ranges
+		std::vector<float> m_low;
+		std::vector<float> m_high;
+		std::vector<float> m_pivotLow;
+		std::vector<float> m_pivotHigh;
+};
+
+#endif
@@ -0,0 +1,384 @@
+#include "pq_index.hpp"
+#include "random.hpp"
+#include "top_k.hpp"
+#include "Eigen/Dense"
+#include <fstream>
+#include <cstring>
+#include <cmath>
+#include <atomic>
+#include <future>
+#include <thread>
+#include <numeric>
+#include <algorithm>
+
+namespace {
+	const char pqMagic[8] = { 'I', 'P', 'P', 'Q', '\0', '\0', '\0', '\0' };
+	// Rows per encoding and scan task
+	const size_t chunkRows = 65536;
+	// OPQ alternates between the codebooks and the rotation, with short k-means runs in between
+	const int opqIterations = 4;
+	const int opqKMeansIterations = 4;
+
+	struct PqIndexHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t dimensions;
+		uint32_t subspaces;
+		uint32_t centroids;
+		uint32_t rotated;
+		uint32_t reserved;
+		uint64_t rows;
+		uint64_t checksum;
+		float scales[DESCRIPTORS_NUM];
+	};
+
+	typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+
+	inline float squaredDistance(const float* a, const float* b, int n) {
+		float s = 0.0f;
+		for (int d = 0; d < n; d++) {
+			const float diff = a[d] - b[d];
+			s += diff * diff;
+		}
+		return s;
+	}
+
+	inline int nearestCentroid(const float* v, const float* codebook, int count, int dims) {
+		int best = 0;
+		float bestDistance = squaredDistance(v, codebook, dims);
+		for (int c = 1; c < count; c++) {
+			const float d = squaredDistance(v, codebook + c * dims, dims);
+			if (d < bestDistance) {
+				bestDistance = d;
+				best = c;
+			}
+		}
+		return best;
+	}
+
+	inline unsigned int threadCount(unsigned int threads) {
+		return threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	// task(i) for every i in [0, n), on up to threads threads taking the next i until none is left
+	template<typename Task>
+	void parallelFor(size_t n, unsigned int threads, const Task& task) {
+		std::atomic<size_t> next(0);
+		const auto work = [&next, n, &task]() {
+			for (size_t i = next++; i < n; i = next++) {
+				task(i);
+			}
+		};
+		std::vector<std::future<void>> futures;
+		for (size_t t = 1; t < std::min<size_t>(threads, n); t++) {
+			futures.push_back(std::async(std::launch::async, work));
+		}
+		work();
+		for (auto& f : futures) {
+			f.get();
+		}
+	}
+}
+
+void PqIndex::close() {
+	m_store = nullptr;
+	m_subspaces = 0;
+	m_subDimensions = 0;
+	m_rows = 0;
+	m_rotation.clear();
+	m_codebooks.clear();
+	m_codes.clear();
+}
+
+bool PqIndex::open(const std::filesystem::path& dbPath, const FeatureStore& store, const float* scales, const PqOptions& options) {
+	close();
+	if (!store.isOpen() || !store.rows() || store.rows() > INT32_MAX) {
+		return false;
+	}
+	m_store = &store;
+	const auto filePath = dbPath / fileName;
+	const uint64_t checksum = store.checksum();
+	if (std::filesystem::exists(filePath) && load(filePath, checksum, scales, options)) {
+		return true;
+	}
+
+	m_subspaces = options.subspaces > 0 ? options.subspaces : defaultSubspaces;
+	if (DESCRIPTORS_NUM % m_subspaces != 0) {
+		std::cout << "The PQ subspaces have to divide " << DESCRIPTORS_NUM << ", using " << defaultSubspaces << std::endl;
+		m_subspaces = defaultSubspaces;
+	}
+	m_subDimensions = DESCRIPTORS_NUM / m_subspaces;
+	m_rows = store.rows();
+	std::memcpy(m_scales, scales, sizeof(m_scales));
+	const unsigned int threads = threadCount(options.threads);
+	std::cout << "Training " << fileName << " (" << m_subspaces << " bytes per shape" << (options.rotate ? ", OPQ" : "") << ") for " << m_rows << " shapes..." << std::endl;
+	train(options, threads);
+
+	m_codes.resize(m_rows * m_subspaces);
+	const size_t chunks = (m_rows + chunkRows - 1) / chunkRows;
+	parallelFor(chunks, threads, [this](size_t c) {
+		const size_t begin = c * chunkRows;
+		const size_t end = std::min<size_t>(begin + chunkRows, m_rows);
+		std::vector<float> vectors((end - begin) * DESCRIPTORS_NUM);
+		float row[DESCRIPTORS_NUM];
+		for (size_t i = begin; i < end; i++) {
+			m_store->copyRow(i, row);
+			transform(row, vectors.data() + (i - begin) * DESCRIPTORS_NUM);
+		}
+		encode(vectors.data(), end - begin, m_codes.data() + begin * m_subspaces);
+	});
+	save(filePath, checksum);
+	return true;
+}
+
+void PqIndex::transform(const float* record, float* out) const {
+	float scaled[DESCRIPTORS_NUM];
+	for (int d = 0; d < DESCRIPTORS_NUM; d++) {
+		scaled[d] = record[d] * m_scales[d];
+	}
+	if (m_rotation.empty()) {
+		std::copy(scaled, scaled + DESCRIPTORS_NUM, out);
+		return;
+	}
+	// Row vector times the rotation, as the training points were rotated
+	for (int j = 0; j < DESCRIPTORS_NUM; j++) {
+		float s = 0.0f;
+		for (int i = 0; i < DESCRIPTORS_NUM; i++) {
+			s += scaled[i] * m_rotation[i * DESCRIPTORS_NUM + j];
+		}
+		out[j] = s;
+	}
+}
+
+void PqIndex::train(const PqOptions& options, unsigned int threads) {
+	// A fixed sample of the rows, drawn with a partial Fisher-Yates shuffle
+	const size_t n = std::min<size_t>(m_rows, std::max(options.trainRows, centroids));
+	std::vector<uint32_t> order(m_rows);
+	std::iota(order.begin(), order.end(), 0);
+	Random::Engine rng(Random::defaultSeed);
+	for (size_t i = 0; i < n; i++) {
+		std::swap(order[i], order[i + rng.index((uint32_t)(m_rows - i))]);
+	}
+	std::vector<float> points(n * DESCRIPTORS_NUM);
+	float row[DESCRIPTORS_NUM];
+	for (size_t i = 0; i < n; i++) {
+		m_store->copyRow(order[i], row);
+		for (int d = 0; d < DESCRIPTORS_NUM; d++) {
+			points[i * DESCRIPTORS_NUM + d] = row[d] * m_scales[d];
+		}
+	}
+
+	m_rotation.clear();
+	if (!options.rotate) {
+		trainCodebooks(points, n, options.iterations, threads);
+		return;
+	}
+
+	// With the codebooks fixed, the rotation R that best maps the points X onto their reconstructions Y
+	// is the orthogonal Procrustes solution U V^T, from the SVD U S V^T of X^T Y
+	const Eigen::Map<const RowMatrix> X(points.data(), n, DESCRIPTORS_NUM);
+	RowMatrix R = RowMatrix::Identity(DESCRIPTORS_NUM, DESCRIPTORS_NUM);
+	std::vector<float> rotated(n * DESCRIPTORS_NUM);
+	std::vector<uint8_t> codes(n * m_subspaces);
+	for (int it = 0; it < opqIterations; it++) {
+		Eigen::Map<RowMatrix>(rotated.data(), n, DESCRIPTORS_NUM) = X * R;
+		trainCodebooks(rotated, n, opqKMeansIterations, threads);
+		encode(rotated.data(), n, codes.data());
+		for (size_t i = 0; i < n; i++) {
+			for (int s = 0; s < m_subspaces; s++) {
+				const float* centroid = m_codebooks.data() + ((size_t)s * centroids + codes[i * m_subspaces + s]) * m_subDimensions;
+				std::copy(centroid, centroid + m_subDimensions, rotated.data() + i * DESCRIPTORS_NUM + s * m_subDimensions);
+			}
+		}
+		const Eigen::MatrixXf M = X.transpose() * Eigen::Map<const RowMatrix>(rotated.data(), n, DESCRIPTORS_NUM);
+		const Eigen::JacobiSVD<Eigen::MatrixXf> svd(M, Eigen::ComputeFullU | Eigen::ComputeFullV);
+		R = svd.matrixU() * svd.matrixV().transpose();
+	}
+	m_rotation.assign(R.data(), R.data() + DESCRIPTORS_NUM * DESCRIPTORS_NUM);
+	Eigen::Map<RowMatrix>(rotated.data(), n, DESCRIPTORS_NUM) = X * R;
+	trainCodebooks(rotated, n, options.iterations, threads);
+}
+
+void PqIndex::trainCodebooks(const std::vector<float>& points, size_t n, int iterations, unsigned int threads) {
+	const int k = (int)std::min<size_t>(centroids, n);
+	m_codebooks.assign((size_t)m_subspaces * centroids * m_subDimensions, 0.0f);
+	// Every subspace is its own k-means problem
+	parallelFor(m_subspaces, threads, [this, &points, n, iterations, k](size_t s) {
+		const int dims = m_subDimensions;
+		std::vector<float> part(n * dims);
+		for (size_t i = 0; i < n; i++) {
+			std::copy(points.data() + i * DESCRIPTORS_NUM + s * dims, points.data() + i * DESCRIPTORS_NUM + (s + 1) * dims, part.data() + i * dims);
+		}
+		float* codebook = m_codebooks.data() + s * centroids * dims;
+
+		// Seeded with distinct points
+		Random::Engine rng(Random::streamSeed(Random::defaultSeed, s));
+		std::vector<uint32_t> order(n);
+		std::iota(order.begin(), order.end(), 0);
+		for (int c = 0; c < k; c++) {
+			std::swap(order[c], order[c + rng.index((uint32_t)(n - c))]);
+			std::copy(part.data() + order[c] * dims, part.data() + (order[c] + 1) * dims, codebook + c * dims);
+		}
+
+		std::vector<double> sums(k * dims);
+		std::vector<uint32_t> counts(k);
+		for (int it = 0; it < iterations; it++) {
+			std::fill(sums.begin(), sums.end(), 0.0);
+			std::fill(counts.begin(), counts.end(), 0);
+			for (size_t i = 0; i < n; i++) {
+				const int c = nearestCentroid(part.data() + i * dims, codebook, k, dims);
+				counts[c]++;
+				for (int d = 0; d < dims; d++) {
+					sums[c * dims + d] += part[i * dims + d];
+				}
+			}
+			for (int c = 0; c < k; c++) {
+				if (counts[c]) {
+					for (int d = 0; d < dims; d++) {
+						codebook[c * dims + d] = (float)(sums[c * dims + d] / counts[c]);
+					}
+				} else {
+					// An empty cluster starts again from a random point
+					const size_t i = rng.index((uint32_t)n);
+					std::copy(part.data() + i * dims, part.data() + (i + 1) * dims, codebook + c * dims);
+				}
+			}
+		}
+		// With fewer points than centroids the rest repeat the first one, the strict comparison never picks them
+		for (int c = k; c < centroids; c++) {
+			std::copy(codebook, codebook + dims, codebook + c * dims);
+		}
+	});
+}
+
+void PqIndex::encode(const float* vectors, size_t n, uint8_t* codes) const {
+	for (size_t i = 0; i < n; i++) {
+		for (int s = 0; s < m_subspaces; s++) {
+			const float* codebook = m_codebooks.data() + (size_t)s * centroids * m_subDimensions;
+			codes[i * m_subspaces + s] = (uint8_t)nearestCentroid(vectors + i * DESCRIPTORS_NUM + s * m_subDimensions, codebook, centroids, m_subDimensions);
+		}
+	}
+}
+
+void PqIndex::search(const float* record, int k, unsigned int threads, std::vector<int>& rows, std::vector<float>& distances) const {
+	rows.clear();
+	distances.clear();
+	if (!isOpen() || k <= 0) {
+		return;
+	}
+	float query[DESCRIPTORS_NUM];
+	transform(record, query);
+	// Distance from each part of the query to every centroid of its subspace, a code costs one lookup per byte
+	std::vector<float> table((size_t)m_subspaces * centroids);
+	for (int s = 0; s < m_subspaces; s++) {
+		for (int c = 0; c < centroids; c++) {
+			table[s * centroids + c] = squaredDistance(query + s * m_subDimensions, m_codebooks.data() + ((size_t)s * centroids + c) * m_subDimensions, m_subDimensions);
+		}
+	}
+
+	const size_t kept = std::min<size_t>(m_rows, (size_t)k);
+	const size_t chunks = (m_rows + chunkRows - 1) / chunkRows;
+	const size_t workers = std::max<size_t>(1, std::min<size_t>(threadCount(threads), chunks));
+	std::vector<TopK> heaps(workers, TopK(kept));
+	std::atomic<size_t> nextChunk(0);
+	const auto work = [&](size_t w) {
+		for (size_t c = nextChunk++; c < chunks; c = nextChunk++) {
+			const size_t end = std::min<size_t>((c + 1) * chunkRows, m_rows);
+			for (size_t i = c * chunkRows; i < end; i++) {
+				const uint8_t* code = m_codes.data() + i * m_subspaces;
+				float d = 0.0f;
+				for (int s = 0; s < m_subspaces; s++) {
+					d += table[s * centroids + code[s]];
+				}
+				heaps[w].push(d, i);
+			}
+		}
+	};
+	std::vector<std::future<void>> futures;
+	for (size_t w = 1; w < workers; w++) {
+		futures.push_back(std::async(std::launch::async, work, w));
+	}
+	work(0);
+	for (auto& f : futures) {
+		f.get();
+	}
+	TopK best(kept);
+	for (const auto& heap : heaps) {
+		best.merge(heap);
+	}
+	for (const auto& e : best.sorted()) {
+		rows.push_back((int)e.row);
+		distances.push_back(std::sqrt(e.distance));
+	}
+}
+
+bool PqIndex::load(const std::filesystem::path& filePath, uint64_t checksum, const float* scales, const PqOptions& options) {
+	std::ifstream file(filePath, std::ios::binary);
+	PqIndexHeader header;
+	if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+		std::memcmp(header.magic, pqMagic, sizeof(pqMagic)) != 0 ||
+		header.version != version ||
+		header.dimensions != DESCRIPTORS_NUM ||
+		header.centroids != centroids ||
+		header.subspaces == 0 || DESCRIPTORS_NUM % header.subspaces != 0 ||
+		(options.subspaces > 0 && header.subspaces != (uint32_t)options.subspaces) ||
+		(header.rotated != 0) != options.rotate ||
+		header.rows != m_store->rows() ||
+		header.checksum != checksum ||
+		std::memcmp(header.scales, scales, sizeof(header.scales)) != 0) {
+		return false;
+	}
+	m_subspaces = header.subspaces;
+	m_subDimensions = DESCRIPTORS_NUM / m_subspaces;
+	m_rows = header.rows;
+	std::memcpy(m_scales, header.scales, sizeof(m_scales));
+	m_rotation.resize(header.rotated ? DESCRIPTORS_NUM * DESCRIPTORS_NUM : 0);
+	m_codebooks.resize((size_t)m_subspaces * centroids * m_subDimensions);
+	m_codes.resize(m_rows * m_subspaces);
+	if (!file.read(reinterpret_cast<char*>(m_rotation.data()), m_rotation.size() * sizeof(float)) ||
+		!file.read(reinterpret_cast<char*>(m_codebooks.data()), m_codebooks.size() * sizeof(float)) ||
+		!file.read(reinterpret_cast<char*>(m_codes.data()), m_codes.size())) {
+		m_rows = 0;
+		m_rotation.clear();
+		m_codebooks.clear();
+		m_codes.clear();
+		return false;
+	}
+	return true;
+}
+
+bool PqIndex::save(const std::filesystem::path& filePath, uint64_t checksum) const {
+	PqIndexHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, pqMagic, sizeof(pqMagic));
+	header.version = version;
+	header.dimensions = DESCRIPTORS_NUM;
+	header.subspaces = m_subspaces;
+	header.centroids = centroids;
+	header.rotated = rotated() ? 1 : 0;
+	header.rows = m_rows;
+	header.checksum = checksum;
+	std::memcpy(header.scales, m_scales, sizeof(header.scales));
+
+	// Written next to the target and renamed over it, so an interrupted write never leaves codes whose header validates
+	const auto tmpPath = std::filesystem::path(filePath.string() + ".tmp");
+	{
+		std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(m_rotation.data()), m_rotation.size() * sizeof(float));
+		file.write(reinterpret_cast<const char*>(m_codebooks.data()), m_codebooks.size() * sizeof(float));
+		file.write(reinterpret_cast<const char*>(m_codes.data()), m_codes.size());
+		if (!file) {
+			std::cout << "Unable to write " << tmpPath << std::endl;
+			return false;
+		}
+	}
+	std::error_code error;
+	std::filesystem::rename(tmpPath, filePath, error);
+	if (error) {
+		std::cout << "Unable to replace " << filePath << ": " << error.message() << std::endl;
+		std::filesystem::remove(tmpPath, error);
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,68 @@
+#ifndef __PQ_INDEX_HPP__
+#define __PQ_INDEX_HPP__
+
+#include "feature_store.hpp"
+#include <filesystem>
+#include <vector>
+#include <cstdint>
+
+// Training and search parameters of the product quantizer.
+// subspaces is the number of bytes of a code (0 keeps the saved index, or the default), it has to divide
+// DESCRIPTORS_NUM. rotate learns an OPQ rotation before the split, so the subspaces share the variance better.
+// A saved index with other subspaces or rotation is trained again, trainRows and iterations only apply then.
+// rerank > 0 has RetrievalEngine rank the rerank * k best codes again by the quadratic_Weights distance,
+// 0 returns the ADC ranking.
+// threads is the number of training and scan threads, 0 for one per hardware thread.
+struct PqOptions {
+	int subspaces = 0;
+	bool rotate = false;
+	int trainRows = 32768;
+	int iterations = 10;
+	int rerank = 0;
+	unsigned int threads = 0;
+};
+
+// Product quantization of the DB records (Jegou et al.), optionally rotated first (OPQ, Ge et al.). The
+// records are scaled like in HnswIndex, split into subspaces and every part is replaced by the index of
+// its nearest centroid among 256, so a shape costs subspaces bytes. Queries are compared against the codes
+// through a table of the distances from each query part to every centroid (asymmetric distance).
+// Saved as feats_pq.bin next to feats.bin and trained again when the features or the scales change.
+class PqIndex {
+	public:
+		static constexpr const char* fileName = "feats_pq.bin";
+		static const uint32_t version = 1;
+		static constexpr int defaultSubspaces = 8;
+		static constexpr int centroids = 256;
+
+		// Loads the codes of store, or trains the quantizer, encodes store and saves them.
+		// scales holds DESCRIPTORS_NUM floats. store is only read while opening
+		bool open(const std::filesystem::path& dbPath, const FeatureStore& store, const float* scales, const PqOptions& options = PqOptions());
+		void close();
+		inline bool isOpen() const { return m_rows != 0; }
+
+		inline int subspaces() const { return m_subspaces; }
+		inline bool rotated() const { return !m_rotation.empty(); }
+
+		// The k rows nearest to a record laid out like the DB rows by their codes, nearest first, with their distances
+		void search(const float* record, int k, unsigned int threads, std::vector<int>& rows, std::vector<float>& distances) const;
+
+	private:
+		void train(const PqOptions& options, unsigned int threads);
+		void trainCodebooks(const std::vector<float>& points, size_t n, int iterations, unsigned int threads);
+		void encode(const float* vectors, size_t n, uint8_t* codes) const;
+		// Scaled and rotated record, the space the codebooks live in
+		void transform(const float* record, float* out) const;
+		bool load(const std::filesystem::path& filePath, uint64_t checksum, const float* scales, const PqOptions& options);
+		bool save(const std::filesystem::path& filePath, uint64_t checksum) const;
+
+		const FeatureStore* m_store = nullptr;
+		int m_subspaces = 0;
+		int m_subDimensions = 0;
+		uint64_t m_rows = 0;
+		float m_scales[DESCRIPTORS_NUM];
+		std::vector<float> m_rotation;		// DESCRIPTORS_NUM x DESCRIPTORS_NUM, row major, empty without OPQ
+		std::vector<float> m_codebooks;		// subspaces x centroids x subDimensions
+		std::vector<uint8_t> m_codes;		// rows x subspaces
+};
+
+#endif
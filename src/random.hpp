@@ -0,0 +1,198 @@
+#ifndef __RANDOM_HPP__
+#define __RANDOM_HPP__
+
+#include <cstdint>
+#include <string>
+#include <algorithm>
+
+namespace Random {
+
+	const uint64_t defaultSeed = 0x1DA1F1A9ULL;
+
+	inline uint64_t splitMix64(uint64_t &state) {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+
+	// Derive an independent seed for a sub-stream (e.g. one per descriptor) from a base seed
+	inline uint64_t streamSeed(uint64_t seed, uint64_t stream) {
+		uint64_t state = seed ^ (stream * 0xD1B54A32D192ED03ULL);
+		return splitMix64(state);
+	}
+
+	// FNV-1a, stable across platforms/compilers unlike std::hash
+	inline uint64_t hashString(const std::string &s) {
+		uint64_t h = 0xCBF29CE484222325ULL;
+		for (unsigned char c : s) {
+			h ^= c;
+			h *= 0x100000001B3ULL;
+		}
+		return h;
+	}
+
+	// Turns ranks r[j] in [0, n - j) into pairwise distinct indices: each rank is shifted past the values
+	// already taken (in ascending order), so no retry is ever needed. Written out per K so it stays branch free.
+	template<int K>
+	inline void distinctFromRanks(uint32_t (&v)[K]) {
+		static_assert(K >= 1 && K <= 4, "distinct indices are supported for tuples of up to 4 indices");
+		if constexpr (K > 1) {
+			v[1] += (v[1] >= v[0]);
+		}
+		if constexpr (K > 2) {
+			const uint32_t lo = std::min(v[0], v[1]);
+			const uint32_t hi = std::max(v[0], v[1]);
+			v[2] += (v[2] >= lo);
+			v[2] += (v[2] >= hi);
+		}
+		if constexpr (K > 3) {
+			const uint32_t s0 = std::min(std::min(v[0], v[1]), v[2]);
+			const uint32_t s2 = std::max(std::max(v[0], v[1]), v[2]);
+			const uint32_t s1 = v[0] + v[1] + v[2] - s0 - s2;
+			v[3] += (v[3] >= s0);
+			v[3] += (v[3] >= s1);
+			v[3] += (v[3] >= s2);
+		}
+	}
+
+	// xoshiro256** (Blackman & Vigna). Small, fast and with no shared state:
+	// every sampler owns its engine, so concurrent descriptor extraction never contends on it.
+	class Engine {
+		public:
+			Engine(uint64_t seed = defaultSeed) { reseed(seed); }
+
+			inline void reseed(uint64_t seed) {
+				for (int i = 0; i < 4; i++) {
+					s[i] = splitMix64(seed);
+				}
+			}
+
+			inline uint64_t next() {
+				const uint64_t result = rotl(s[1] * 5, 7) * 9;
+				const uint64_t t = s[1] << 17;
+				s[2] ^= s[0];
+				s[3] ^= s[1];
+				s[1] ^= s[2];
+				s[0] ^= s[3];
+				s[2] ^= t;
+				s[3] = rotl(s[3], 45);
+				return result;
+			}
+
+			// Uniform float in [0, 1)
+			inline float uniform() {
+				return (next() >> 40) * (1.0f / 16777216.0f);
+			}
+
+			// Uniform integer in [0, n) using Lemire's multiply-shift, no modulo and no rejection loop.
+			// The bias is at most n / 2^32, negligible for mesh sized ranges.
+			inline uint32_t index(uint32_t n) {
+				return (uint32_t)(((next() >> 32) * (uint64_t)n) >> 32);
+			}
+
+			// K (up to 4) pairwise distinct indices in [0, n), uniformly distributed over ordered K-tuples.
+			// The j-th draw picks among the n - j remaining values, see distinctFromRanks.
+			template<int K>
+			inline void distinctIndices(uint32_t n, uint32_t (&out)[K]) {
+				if (n < (uint32_t)K) {
+					for (int j = 0; j < K; j++) out[j] = index(n);
+					return;
+				}
+				for (int j = 0; j < K; j++) out[j] = index(n - j);
+				distinctFromRanks(out);
+			}
+
+		private:
+			uint64_t s[4];
+
+			static inline uint64_t rotl(const uint64_t x, int k) {
+				return (x << k) | (x >> (64 - k));
+			}
+	};
+
+	// Halton sequence in bases 2, 3, 5, 7 with random digit scrambling: every digit position of every base
+	// gets its own random permutation of the digits, drawn from an Engine. Every seed gives a different
+	// sequence that keeps the low discrepancy, and the permutations break the correlation between the
+	// dimensions that plain Halton has. Exposes the same index/distinctIndices interface as Engine so
+	// samplers can take either.
+	class Halton {
+		public:
+			static const int maxDimensions = 4;
+
+			Halton(Engine &rng) : m_index{1} {
+				for (int d = 0; d < maxDimensions; d++) {
+					const uint32_t base = bases[d];
+					for (int k = 0; k < digits[d]; k++) {
+						// Fisher-Yates shuffle of the digits 0 .. base - 1
+						uint8_t* perm = m_permutations[d][k];
+						for (uint32_t v = 0; v < base; v++) {
+							perm[v] = (uint8_t)v;
+						}
+						for (uint32_t v = base - 1; v > 0; v--) {
+							std::swap(perm[v], perm[rng.index(v + 1)]);
+						}
+					}
+					// The digits past the last one of an index are zeros, their permuted values are summed once here
+					double scale = 1.0;
+					for (int k = 0; k < digits[d]; k++) {
+						scale /= base;
+					}
+					m_tails[d][digits[d]] = 0.0;
+					for (int k = digits[d] - 1; k >= 0; k--) {
+						m_tails[d][k] = m_tails[d][k + 1] + m_permutations[d][k][0] * scale;
+						scale *= base;
+					}
+				}
+			}
+
+			inline uint32_t index(uint32_t n) {
+				const uint32_t i = (uint32_t)(component(0) * n);
+				m_index++;
+				return i;
+			}
+
+			// One K-dimensional point per tuple, the j-th coordinate picks among the n - j remaining values
+			template<int K>
+			inline void distinctIndices(uint32_t n, uint32_t (&out)[K]) {
+				static_assert(K <= maxDimensions, "Halton sampling supports tuples of up to 4 indices");
+				if (n < (uint32_t)K) {
+					for (int j = 0; j < K; j++) out[j] = (uint32_t)(component(j) * n);
+				} else {
+					for (int j = 0; j < K; j++) out[j] = (uint32_t)(component(j) * (n - j));
+					distinctFromRanks(out);
+				}
+				m_index++;
+			}
+
+		private:
+			static constexpr uint32_t bases[maxDimensions] = { 2, 3, 5, 7 };
+			// Digits that still change a double: base^-digits is below 2^-53
+			static constexpr int digits[maxDimensions] = { 53, 34, 23, 19 };
+			static const int maxDigits = 53;
+			static const int maxBase = 7;
+
+			uint64_t m_index;
+			uint8_t m_permutations[maxDimensions][maxDigits][maxBase];
+			double m_tails[maxDimensions][maxDigits + 1];
+
+			// Scrambled radical inverse of the current index, in [0, 1)
+			inline double component(int d) const {
+				const uint32_t base = bases[d];
+				const double invBase = 1.0 / base;
+				double scale = invBase, r = 0.0;
+				uint64_t i = m_index;
+				int k = 0;
+				for (; i > 0 && k < digits[d]; k++) {
+					r += m_permutations[d][k][i % base] * scale;
+					i /= base;
+					scale *= invBase;
+				}
+				r += m_tails[d][k];
+				// All digits at base - 1 would round to 1
+				return std::min(r, 0x1.fffffffffffffp-1);
+			}
+	};
+};
+
+#endif
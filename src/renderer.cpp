@@ -405,25 +405,25 @@ void Renderer::renderGUI(){
 		}
 
 		if (ImGui::CollapsingHeader("3D Descriptors")) {
-			ImGui::Text("Surface Area: %f", (m_mesh) ? std::get<float>(m_mesh->getDescriptor(FEAT_AREA_3D)) : 0);
-			ImGui::Text("Mesh Volume: %f", (m_mesh) ? std::get<float>(m_mesh->getDescriptor(FEAT_MVOLUME_3D)) : 0);
-			ImGui::Text("Bounding Box Volume: %f", (m_mesh) ? std::get<float>(m_mesh->getDescriptor(FEAT_BBVOLUME_3D)) : 0);
-			ImGui::Text("Eccentricity: %f", (m_mesh) ? std::get<float>(m_mesh->getDescriptor(FEAT_ECCENTRICITY_3D)) : 0);
-			ImGui::Text("Compactness: %f", (m_mesh) ? std::get<float>(m_mesh->getDescriptor(FEAT_COMPACTNESS_3D)) : 0);
+			ImGui::Text("Surface Area: %f", (m_mesh) ? m_mesh->getDescriptor(FEAT_AREA_3D) : 0);
+			ImGui::Text("Mesh Volume: %f", (m_mesh) ? m_mesh->getDescriptor(FEAT_MVOLUME_3D) : 0);
+			ImGui::Text("Bounding Box Volume: %f", (m_mesh) ? m_mesh->getDescriptor(FEAT_BBVOLUME_3D) : 0);
+			ImGui::Text("Eccentricity: %f", (m_mesh) ? m_mesh->getDescriptor(FEAT_ECCENTRICITY_3D) : 0);
+			ImGui::Text("Compactness: %f", (m_mesh) ? m_mesh->getDescriptor(FEAT_COMPACTNESS_3D) : 0);
 			if (ImGui::Button("Compute##Mesh")) {
 				if(m_mesh){
-					m_mesh->computeFeatures(Descriptors::descriptor_all & ~Descriptors::descriptor_diameter);
+					m_mesh->computeFeatures(Descriptors::descriptor_all & ~Descriptors::descriptor_diameter, Descriptors::SamplingOptions(), true);
 				}
 			}
 		}
 
 		if (ImGui::CollapsingHeader("Convex Hull 3D Descriptors")) {
-			ImGui::Text("Surface Area: %f", (m_mesh) ? std::get<float>(m_mesh->getConvexHull()->getDescriptor(FEAT_AREA_3D)) : 0);
-			ImGui::Text("Mesh Volume: %f", (m_mesh) ? std::get<float>(m_mesh->getConvexHull()->getDescriptor(FEAT_MVOLUME_3D)) : 0);
-			ImGui::Text("Bounding Box Volume: %f", (m_mesh) ? std::get<float>(m_mesh->getConvexHull()->getDescriptor(FEAT_BBVOLUME_3D)) : 0);
-			ImGui::Text("Diameter: %f", (m_mesh) ? std::get<float>(m_mesh->getConvexHull()->getDescriptor(FEAT_DIAMETER_3D)) : 0);
-			ImGui::Text("Eccentricity: %f", (m_mesh) ? std::get<float>(m_mesh->getConvexHull()->getDescriptor(FEAT_ECCENTRICITY_3D)) : 0);
-			ImGui::Text("Compactness: %f", (m_mesh) ? std::get<float>(m_mesh->getConvexHull()->getDescriptor(FEAT_COMPACTNESS_3D)) : 0);
+			ImGui::Text("Surface Area: %f", (m_mesh) ? m_mesh->getConvexHull()->getDescriptor(FEAT_AREA_3D) : 0);
+			ImGui::Text("Mesh Volume: %f", (m_mesh) ? m_mesh->getConvexHull()->getDescriptor(FEAT_MVOLUME_3D) : 0);
+			ImGui::Text("Bounding Box Volume: %f", (m_mesh) ? m_mesh->getConvexHull()->getDescriptor(FEAT_BBVOLUME_3D) : 0);
+			ImGui::Text("Diameter: %f", (m_mesh) ? m_mesh->getConvexHull()->getDescriptor(FEAT_DIAMETER_3D) : 0);
+			ImGui::Text("Eccentricity: %f", (m_mesh) ? m_mesh->getConvexHull()->getDescriptor(FEAT_ECCENTRICITY_3D) : 0);
+			ImGui::Text("Compactness: %f", (m_mesh) ? m_mesh->getConvexHull()->getDescriptor(FEAT_COMPACTNESS_3D) : 0);
 			if (ImGui::Button("Compute##ConvexHull")) {
 				if(m_mesh){
 					m_mesh->getConvexHull()->computeFeatures();
@@ -454,6 +454,8 @@ void Renderer::renderGUI(){
 		}
 		if(!m_featuresPresent && !m_dbPath.empty()){
 			if(ImGui::Button("Compute DB Features")){
+				// The engine maps the files about to be rewritten
+				Retriever::releaseEngine();
 				Stats::getDatabaseFeatures(m_dbPath.string());
 				m_featuresPresent = true;
 			}
@@ -513,6 +515,28 @@ void Renderer::renderGUI(){
 				ImGui::SameLine();
 				HelpMarker("Start searching for shapes using ANN.\nfeats.csv and feats_avg.csv must be present in the DB root");
 
+				if (ImGui::Button("Find Similiar HNSW")) {
+					if (m_mesh) {
+						m_retrieval_future = std::async(std::launch::async, [&] {
+							m_retrieval_text = "Searching for the most similar shapes...";
+							Retriever::retrieveSimiliarShapes(m_mesh, m_dbPath, m_numShapes, Retriever::DistanceMethod::hnsw_ANN);
+						});
+					}
+				}
+				ImGui::SameLine();
+				HelpMarker("Start searching for shapes in the HNSW graph, built in the DB root the first time.\nfeats.csv and feats_avg.csv must be present in the DB root");
+
+				if (ImGui::Button("Find Similiar PQ")) {
+					if (m_mesh) {
+						m_retrieval_future = std::async(std::launch::async, [&] {
+							m_retrieval_text = "Searching for the most similar shapes...";
+							Retriever::retrieveSimiliarShapes(m_mesh, m_dbPath, m_numShapes, Retriever::DistanceMethod::pq_ADC);
+						});
+					}
+				}
+				ImGui::SameLine();
+				HelpMarker("Start searching for shapes by their product quantization codes, trained in the DB root the first time.\nfeats.csv and feats_avg.csv must be present in the DB root");
+
 				if (ImGui::Button("Find Similiar Shapes")) {
 					if (m_mesh) {
 						m_retrieval_future = std::async(std::launch::async, [&] {
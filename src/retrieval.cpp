@@ -6,7 +6,7 @@
 
 int main(int argc, char* args[]) {
 	if (argc < 4) {
-		std::cout << "USAGE:" << std::endl << args[0] << " query-mesh db-path n-shapes [ANN=true|false]" << std::endl;
+		std::cout << "USAGE:" << std::endl << args[0] << " query-mesh db-path n-shapes [ANN=true|false|HNSW|PQ]" << std::endl;
 		return 1;
 	}
 	std::string meshPath = args[1];
@@ -20,7 +20,11 @@ int main(int argc, char* args[]) {
 
 	Mesh mesh(meshPath);
 	const auto mesh_ptr = std::make_shared<Mesh>(mesh);
-	if(argc == 5 && strncmp(args[4], "ANN=true", strlen("ANN=true")) == 0)
+	if(argc == 5 && strcmp(args[4], "PQ") == 0)
+		Retriever::retrieveSimiliarShapes(mesh_ptr, dbPath, nShapes, Retriever::DistanceMethod::pq_ADC);
+	else if(argc == 5 && strcmp(args[4], "HNSW") == 0)
+		Retriever::retrieveSimiliarShapes(mesh_ptr, dbPath, nShapes, Retriever::DistanceMethod::hnsw_ANN);
+	else if(argc == 5 && strncmp(args[4], "ANN=true", strlen("ANN=true")) == 0)
 		Retriever::retrieveSimiliarShapes(mesh_ptr, dbPath, nShapes, Retriever::DistanceMethod::spotify_ANN);
 	else
 		Retriever::retrieveSimiliarShapes(mesh_ptr, dbPath, nShapes, Retriever::DistanceMethod::quadratic_Weights);
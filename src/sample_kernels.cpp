@@ -0,0 +1,226 @@
+#define _USE_MATH_DEFINES
+
+#include "sample_kernels.hpp"
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SAMPLE_KERNELS_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SAMPLE_KERNELS_SSE
+#endif
+
+namespace SampleKernels {
+
+	SoAPoints toSoA(const Eigen::MatrixXf& V) {
+		SoAPoints P;
+		P.x.resize(V.rows());
+		P.y.resize(V.rows());
+		P.z.resize(V.rows());
+		// MatrixXf is column major, so every column is already contiguous
+		Eigen::Map<Eigen::VectorXf>(P.x.data(), V.rows()) = V.col(0);
+		Eigen::Map<Eigen::VectorXf>(P.y.data(), V.rows()) = V.col(1);
+		Eigen::Map<Eigen::VectorXf>(P.z.data(), V.rows()) = V.col(2);
+		return P;
+	}
+
+	namespace {
+		// acos(x) = sqrt(1 - x) * p(x) for x in [0, 1], |error| <= 2e-8 (Abramowitz & Stegun 4.4.46)
+		const float acosCoeffs[8] = { 1.5707963050f, -0.2145988016f, 0.0889789874f, -0.0501743046f, 0.0308918810f, -0.0170881256f, 0.0066700901f, -0.0012624911f };
+
+		// Scalar versions, used for the tails of the batches and on non-x86 targets
+
+		inline float scalarDistance(const SoAPoints& P, uint32_t a, uint32_t b) {
+			const float dx = P.x[b] - P.x[a];
+			const float dy = P.y[b] - P.y[a];
+			const float dz = P.z[b] - P.z[a];
+			return std::sqrt(dx * dx + dy * dy + dz * dz);
+		}
+
+		inline float scalarDistanceToPoint(const SoAPoints& P, const float c[3], uint32_t a) {
+			const float dx = P.x[a] - c[0];
+			const float dy = P.y[a] - c[1];
+			const float dz = P.z[a] - c[2];
+			return std::sqrt(dx * dx + dy * dy + dz * dz);
+		}
+
+		inline float scalarSqrtTriangleArea(const SoAPoints& P, uint32_t a, uint32_t b, uint32_t c) {
+			const float bax = P.x[a] - P.x[b], bay = P.y[a] - P.y[b], baz = P.z[a] - P.z[b];
+			const float cax = P.x[a] - P.x[c], cay = P.y[a] - P.y[c], caz = P.z[a] - P.z[c];
+			const float nx = bay * caz - baz * cay;
+			const float ny = baz * cax - bax * caz;
+			const float nz = bax * cay - bay * cax;
+			return std::sqrt(std::sqrt(nx * nx + ny * ny + nz * nz) * 0.5f);
+		}
+
+		inline float scalarTetrahedronVolume(const SoAPoints& P, uint32_t a, uint32_t b, uint32_t c, uint32_t d) {
+			const float adx = P.x[a] - P.x[d], ady = P.y[a] - P.y[d], adz = P.z[a] - P.z[d];
+			const float bdx = P.x[b] - P.x[d], bdy = P.y[b] - P.y[d], bdz = P.z[b] - P.z[d];
+			const float cdx = P.x[c] - P.x[d], cdy = P.y[c] - P.y[d], cdz = P.z[c] - P.z[d];
+			const float nx = bdy * cdz - bdz * cdy;
+			const float ny = bdz * cdx - bdx * cdz;
+			const float nz = bdx * cdy - bdy * cdx;
+			return std::abs(adx * nx + ady * ny + adz * nz) / 6.0f;
+		}
+
+		inline float scalarAngle(const SoAPoints& P, uint32_t a, uint32_t b, uint32_t c) {
+			const float abx = P.x[b] - P.x[a], aby = P.y[b] - P.y[a], abz = P.z[b] - P.z[a];
+			const float bcx = P.x[c] - P.x[b], bcy = P.y[c] - P.y[b], bcz = P.z[c] - P.z[b];
+			const float dot = abx * bcx + aby * bcy + abz * bcz;
+			const float norms = std::sqrt((abx * abx + aby * aby + abz * abz) * (bcx * bcx + bcy * bcy + bcz * bcz));
+			float cosine = dot / norms;
+			if (cosine != cosine) return cosine;
+			cosine = cosine > 1.0f ? 1.0f : (cosine < -1.0f ? -1.0f : cosine);
+			return std::acos(cosine);
+		}
+
+#if defined(SAMPLE_KERNELS_AVX2)
+		const size_t width = 8;
+		typedef __m256 vfloat;
+
+		inline vfloat gather(const std::vector<float>& v, const uint32_t* idx) {
+			return _mm256_i32gather_ps(v.data(), _mm256_loadu_si256((const __m256i*)idx), 4);
+		}
+		inline vfloat set1(float a) { return _mm256_set1_ps(a); }
+		inline vfloat add(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+		inline vfloat sub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+		inline vfloat mul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+		inline vfloat div(vfloat a, vfloat b) { return _mm256_div_ps(a, b); }
+		inline vfloat vmin(vfloat a, vfloat b) { return _mm256_min_ps(a, b); }
+		inline vfloat vmax(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+		inline vfloat vsqrt(vfloat a) { return _mm256_sqrt_ps(a); }
+		inline vfloat vabs(vfloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+		inline vfloat negativeMask(vfloat a) { return _mm256_cmp_ps(a, _mm256_setzero_ps(), _CMP_LT_OQ); }
+		inline vfloat select(vfloat mask, vfloat ifTrue, vfloat ifFalse) { return _mm256_blendv_ps(ifFalse, ifTrue, mask); }
+		inline void store(float* out, vfloat a) { _mm256_storeu_ps(out, a); }
+#elif defined(SAMPLE_KERNELS_SSE)
+		const size_t width = 4;
+		typedef __m128 vfloat;
+
+		// SSE has no gather, the four lanes are loaded one by one
+		inline vfloat gather(const std::vector<float>& v, const uint32_t* idx) {
+			return _mm_set_ps(v[idx[3]], v[idx[2]], v[idx[1]], v[idx[0]]);
+		}
+		inline vfloat set1(float a) { return _mm_set1_ps(a); }
+		inline vfloat add(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+		inline vfloat sub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+		inline vfloat mul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+		inline vfloat div(vfloat a, vfloat b) { return _mm_div_ps(a, b); }
+		inline vfloat vmin(vfloat a, vfloat b) { return _mm_min_ps(a, b); }
+		inline vfloat vmax(vfloat a, vfloat b) { return _mm_max_ps(a, b); }
+		inline vfloat vsqrt(vfloat a) { return _mm_sqrt_ps(a); }
+		inline vfloat vabs(vfloat a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+		inline vfloat negativeMask(vfloat a) { return _mm_cmplt_ps(a, _mm_setzero_ps()); }
+		inline vfloat select(vfloat mask, vfloat ifTrue, vfloat ifFalse) { return _mm_or_ps(_mm_and_ps(mask, ifTrue), _mm_andnot_ps(mask, ifFalse)); }
+		inline void store(float* out, vfloat a) { _mm_storeu_ps(out, a); }
+#endif
+
+#if defined(SAMPLE_KERNELS_AVX2) || defined(SAMPLE_KERNELS_SSE)
+		inline vfloat cross(vfloat ax, vfloat ay, vfloat az, vfloat bx, vfloat by, vfloat bz, vfloat& cy, vfloat& cz) {
+			cy = sub(mul(az, bx), mul(ax, bz));
+			cz = sub(mul(ax, by), mul(ay, bx));
+			return sub(mul(ay, bz), mul(az, by));
+		}
+
+		inline vfloat vacos(vfloat x) {
+			// min/max with the constant first so NaNs propagate, like std::acos would
+			x = vmax(set1(-1.0f), vmin(set1(1.0f), x));
+			const vfloat negative = negativeMask(x);
+			const vfloat ax = vabs(x);
+			vfloat p = set1(acosCoeffs[7]);
+			for (int i = 6; i >= 0; i--) {
+				p = add(mul(p, ax), set1(acosCoeffs[i]));
+			}
+			const vfloat r = mul(p, vsqrt(sub(set1(1.0f), ax)));
+			return select(negative, sub(set1((float)M_PI), r), r);
+		}
+#endif
+	}
+
+	void distanceToPoint(const SoAPoints& P, const float c[3], const uint32_t* a, float* out, size_t n) {
+		size_t i = 0;
+#if defined(SAMPLE_KERNELS_AVX2) || defined(SAMPLE_KERNELS_SSE)
+		const vfloat cx = set1(c[0]), cy = set1(c[1]), cz = set1(c[2]);
+		for (; i + width <= n; i += width) {
+			const vfloat dx = sub(gather(P.x, a + i), cx);
+			const vfloat dy = sub(gather(P.y, a + i), cy);
+			const vfloat dz = sub(gather(P.z, a + i), cz);
+			store(out + i, vsqrt(add(add(mul(dx, dx), mul(dy, dy)), mul(dz, dz))));
+		}
+#endif
+		for (; i < n; i++) {
+			out[i] = scalarDistanceToPoint(P, c, a[i]);
+		}
+	}
+
+	void distance(const SoAPoints& P, const uint32_t* a, const uint32_t* b, float* out, size_t n) {
+		size_t i = 0;
+#if defined(SAMPLE_KERNELS_AVX2) || defined(SAMPLE_KERNELS_SSE)
+		for (; i + width <= n; i += width) {
+			const vfloat dx = sub(gather(P.x, b + i), gather(P.x, a + i));
+			const vfloat dy = sub(gather(P.y, b + i), gather(P.y, a + i));
+			const vfloat dz = sub(gather(P.z, b + i), gather(P.z, a + i));
+			store(out + i, vsqrt(add(add(mul(dx, dx), mul(dy, dy)), mul(dz, dz))));
+		}
+#endif
+		for (; i < n; i++) {
+			out[i] = scalarDistance(P, a[i], b[i]);
+		}
+	}
+
+	void sqrtTriangleArea(const SoAPoints& P, const uint32_t* a, const uint32_t* b, const uint32_t* c, float* out, size_t n) {
+		size_t i = 0;
+#if defined(SAMPLE_KERNELS_AVX2) || defined(SAMPLE_KERNELS_SSE)
+		for (; i + width <= n; i += width) {
+			const vfloat ax = gather(P.x, a + i), ay = gather(P.y, a + i), az = gather(P.z, a + i);
+			const vfloat bax = sub(ax, gather(P.x, b + i)), bay = sub(ay, gather(P.y, b + i)), baz = sub(az, gather(P.z, b + i));
+			const vfloat cax = sub(ax, gather(P.x, c + i)), cay = sub(ay, gather(P.y, c + i)), caz = sub(az, gather(P.z, c + i));
+			vfloat ny, nz;
+			const vfloat nx = cross(bax, bay, baz, cax, cay, caz, ny, nz);
+			const vfloat doubleArea = vsqrt(add(add(mul(nx, nx), mul(ny, ny)), mul(nz, nz)));
+			store(out + i, vsqrt(mul(doubleArea, set1(0.5f))));
+		}
+#endif
+		for (; i < n; i++) {
+			out[i] = scalarSqrtTriangleArea(P, a[i], b[i], c[i]);
+		}
+	}
+
+	void tetrahedronVolume(const SoAPoints& P, const uint32_t* a, const uint32_t* b, const uint32_t* c, const uint32_t* d, float* out, size_t n) {
+		size_t i = 0;
+#if defined(SAMPLE_KERNELS_AVX2) || defined(SAMPLE_KERNELS_SSE)
+		for (; i + width <= n; i += width) {
+			const vfloat dx = gather(P.x, d + i), dy = gather(P.y, d + i), dz = gather(P.z, d + i);
+			const vfloat adx = sub(gather(P.x, a + i), dx), ady = sub(gather(P.y, a + i), dy), adz = sub(gather(P.z, a + i), dz);
+			const vfloat bdx = sub(gather(P.x, b + i), dx), bdy = sub(gather(P.y, b + i), dy), bdz = sub(gather(P.z, b + i), dz);
+			const vfloat cdx = sub(gather(P.x, c + i), dx), cdy = sub(gather(P.y, c + i), dy), cdz = sub(gather(P.z, c + i), dz);
+			vfloat ny, nz;
+			const vfloat nx = cross(bdx, bdy, bdz, cdx, cdy, cdz, ny, nz);
+			const vfloat triple = add(add(mul(adx, nx), mul(ady, ny)), mul(adz, nz));
+			store(out + i, div(vabs(triple), set1(6.0f)));
+		}
+#endif
+		for (; i < n; i++) {
+			out[i] = scalarTetrahedronVolume(P, a[i], b[i], c[i], d[i]);
+		}
+	}
+
+	void angle(const SoAPoints& P, const uint32_t* a, const uint32_t* b, const uint32_t* c, float* out, size_t n) {
+		size_t i = 0;
+#if defined(SAMPLE_KERNELS_AVX2) || defined(SAMPLE_KERNELS_SSE)
+		for (; i + width <= n; i += width) {
+			const vfloat bx = gather(P.x, b + i), by = gather(P.y, b + i), bz = gather(P.z, b + i);
+			const vfloat abx = sub(bx, gather(P.x, a + i)), aby = sub(by, gather(P.y, a + i)), abz = sub(bz, gather(P.z, a + i));
+			const vfloat bcx = sub(gather(P.x, c + i), bx), bcy = sub(gather(P.y, c + i), by), bcz = sub(gather(P.z, c + i), bz);
+			const vfloat dot = add(add(mul(abx, bcx), mul(aby, bcy)), mul(abz, bcz));
+			const vfloat ab2 = add(add(mul(abx, abx), mul(aby, aby)), mul(abz, abz));
+			const vfloat bc2 = add(add(mul(bcx, bcx), mul(bcy, bcy)), mul(bcz, bcz));
+			store(out + i, vacos(div(dot, vsqrt(mul(ab2, bc2)))));
+		}
+#endif
+		for (; i < n; i++) {
+			out[i] = scalarAngle(P, a[i], b[i], c[i]);
+		}
+	}
+}
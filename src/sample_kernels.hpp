@@ -0,0 +1,37 @@
+#ifndef __SAMPLE_KERNELS_HPP__
+#define __SAMPLE_KERNELS_HPP__
+
+#include <Eigen/Core>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Batched evaluation of the shape-distribution samples (A3, D1, D2, D3, D4).
+// Each kernel takes n index tuples as separate index arrays and writes n values.
+// Uses AVX2 gathers when compiled with AVX2, SSE otherwise, plain C++ on other architectures.
+namespace SampleKernels {
+
+	// Points split per coordinate so a batch of indices can be gathered with one instruction per axis
+	struct SoAPoints {
+		std::vector<float> x;
+		std::vector<float> y;
+		std::vector<float> z;
+
+		inline size_t size() const { return x.size(); }
+	};
+
+	SoAPoints toSoA(const Eigen::MatrixXf& V);
+
+	// D1: distance between the point c and P[a]
+	void distanceToPoint(const SoAPoints& P, const float c[3], const uint32_t* a, float* out, size_t n);
+	// D2: distance between P[a] and P[b]
+	void distance(const SoAPoints& P, const uint32_t* a, const uint32_t* b, float* out, size_t n);
+	// D3: square root of the area of the triangle P[a] P[b] P[c]
+	void sqrtTriangleArea(const SoAPoints& P, const uint32_t* a, const uint32_t* b, const uint32_t* c, float* out, size_t n);
+	// D4: volume of the tetrahedron P[a] P[b] P[c] P[d]
+	void tetrahedronVolume(const SoAPoints& P, const uint32_t* a, const uint32_t* b, const uint32_t* c, const uint32_t* d, float* out, size_t n);
+	// A3: angle between AB and BC for A = P[a], B = P[b], C = P[c]
+	void angle(const SoAPoints& P, const uint32_t* a, const uint32_t* b, const uint32_t* c, float* out, size_t n);
+};
+
+#endif
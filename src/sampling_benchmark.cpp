@@ -0,0 +1,69 @@
+#include "mesh.hpp"
+#include "descriptors.hpp"
+#include <chrono>
+
+// Histogram variance over repeated seeds as a function of the sample budget, for the pseudo-random
+// and the Halton sample sequence. Lower variance at the same budget means fewer samples are needed.
+int main(int argc, char* args[]) {
+	if (argc < 2) {
+		std::cout << "USAGE:" << std::endl << args[0] << " path-to-mesh [repetitions] [output.csv]" << std::endl;
+		return 1;
+	}
+	std::string meshPath = args[1];
+	const int repetitions = (argc > 2) ? std::max(2, (int)std::strtol(args[2], nullptr, 0)) : 20;
+	std::string fileName = (argc > 3) ? args[3] : "sampling_benchmark.csv";
+
+	const Features shapeFeatures[] = { FEAT_A3_3D, FEAT_D1_3D, FEAT_D2_3D, FEAT_D3_3D, FEAT_D4_3D };
+	const char* featureNames[] = { "A3", "D1", "D2", "D3", "D4" };
+	const unsigned int flags = Descriptors::descriptor_a3 | Descriptors::descriptor_d1 | Descriptors::descriptor_d2 | Descriptors::descriptor_d3 | Descriptors::descriptor_d4;
+	const std::pair<Descriptors::SampleSequence, const char*> sequences[] = {
+		{ Descriptors::SampleSequence::Random, "random" },
+		{ Descriptors::SampleSequence::Halton, "halton" }
+	};
+
+	Mesh mesh(meshPath);
+	std::ofstream benchmarkFile;
+	benchmarkFile.open(fileName);
+	benchmarkFile << "descriptor,sequence,samples,variance,ms\n";
+
+	for (const auto& sequence : sequences) {
+		for (int samples = 1024; samples <= 524288; samples *= 2) {
+			std::vector<std::vector<std::vector<float>>> runs(5);
+			double ms = 0.0;
+			for (int r = 0; r < repetitions; r++) {
+				Descriptors::SamplingOptions options;
+				options.seed = Random::streamSeed(Random::defaultSeed, r);
+				options.samples = samples;
+				options.sequence = sequence.first;
+
+				auto t1 = std::chrono::high_resolution_clock::now();
+				mesh.computeFeatures(flags, options);
+				auto t2 = std::chrono::high_resolution_clock::now();
+				ms += std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+				for (int f = 0; f < 5; f++) {
+					runs[f].push_back(mesh.getFeatures().histogramVector(shapeFeatures[f]));
+				}
+			}
+
+			// Sum over the bins of the per-bin sample variance across the repetitions
+			for (int f = 0; f < 5; f++) {
+				const int bins = FeatureRecord::histogramBins;
+				double variance = 0.0;
+				for (int b = 0; b < bins; b++) {
+					double mean = 0.0, sq = 0.0;
+					for (const auto& h : runs[f]) {
+						mean += h[b];
+						sq += h[b] * h[b];
+					}
+					mean /= repetitions;
+					variance += (sq - repetitions * mean * mean) / (repetitions - 1);
+				}
+				benchmarkFile << featureNames[f] << "," << sequence.second << "," << samples << "," << variance << "," << ms / repetitions << std::endl;
+			}
+			std::cout << sequence.second << " " << samples << " samples done" << std::endl;
+		}
+	}
+	benchmarkFile.close();
+	return 0;
+}
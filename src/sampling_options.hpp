@@ -0,0 +1,36 @@
+#ifndef __SAMPLING_OPTIONS_HPP__
+#define __SAMPLING_OPTIONS_HPP__
+
+#include "random.hpp"
+
+namespace Descriptors {
+	enum class ConvergenceMetric { L1, EMD };
+
+	// Where the sampled index tuples come from: independent pseudo-random draws, or a scrambled
+	// Halton sequence (quasi-Monte-Carlo) that covers the index space more evenly
+	enum class SampleSequence { Random, Halton };
+
+	// What the tuples index into: the mesh vertices, or a pool of points drawn uniformly over the
+	// surface by area, which makes the distributions independent of the tessellation
+	enum class SampleDomain { Vertices, Surface };
+
+	// How the shape distributions (A3, D1-D4) are sampled.
+	// With adaptive set, sampling runs in rounds starting at initialSamples and doubling each round,
+	// until the normalized histogram moves by less than tolerance between two rounds or samples is reached.
+	// poolPoints is the size of the point pool all five distributions index into: the number of surface
+	// points in the Surface domain, and in the Vertices domain a random subset of the vertices for meshes
+	// with more of them (0 keeps every vertex).
+	struct SamplingOptions {
+		uint64_t seed = Random::defaultSeed;
+		int samples = 500000;
+		bool adaptive = false;
+		int initialSamples = 4096;
+		float tolerance = 0.005f;
+		ConvergenceMetric metric = ConvergenceMetric::L1;
+		SampleSequence sequence = SampleSequence::Random;
+		SampleDomain domain = SampleDomain::Vertices;
+		int poolPoints = 8192;
+	};
+};
+
+#endif
@@ -1,10 +1,16 @@
 #include "shape_retriever.hpp"
 #include "utils.hpp"
+#include "feature_record.hpp"
 #include "earth_movers_distance.hpp"
-#include "annoylib.h"
-#include "kissrandom.h"
-#include "rapidcsv.h"
+#include "distance_kernels.hpp"
+#include "top_k.hpp"
 #include <array>
+#include <cmath>
+#include <numeric>
+#include <limits>
+#include <atomic>
+#include <future>
+#include <thread>
 
 namespace Retriever {
 
@@ -16,341 +22,521 @@ namespace Retriever {
 		return classPath.substr(found + 1);
 	};
 
-	int buildTree(Annoy::AnnoyIndex<int, float, Annoy::Angular, Annoy::Kiss32Random, Annoy::AnnoyIndexSingleThreadedBuildPolicy> &idx, rapidcsv::Document &feats) {
-		int i = 0;
-		float v[DESCRIPTORS_NUM];
-		for (i = 0; i < feats.GetRowCount(); i++) {
-			int j = 0;
-			v[j++] = (feats.GetCell<float>("3D_Area", i));
-			v[j++] = (feats.GetCell<float>("3D_MVolume", i));
-			v[j++] = (feats.GetCell<float>("3D_BBVolume", i));
-			v[j++] = (feats.GetCell<float>("3D_Diameter", i));
-			v[j++] = (feats.GetCell<float>("3D_Compactness", i));
-			v[j++] = (feats.GetCell<float>("3D_Eccentricity", i));
-			const auto a3Histogram = Histogram::parseHistogram(feats.GetCell<std::string>("3D_A3", i));
-			for(auto val : a3Histogram)
-				v[j++] = val;
-			const auto d1Histogram = Histogram::parseHistogram(feats.GetCell<std::string>("3D_D1", i));
-			for(auto val : d1Histogram)
-				v[j++] = val;
-			const auto d2Histogram = Histogram::parseHistogram(feats.GetCell<std::string>("3D_D2", i));
-			for(auto val : d2Histogram)
-				v[j++] = val;
-			const auto d3Histogram = Histogram::parseHistogram(feats.GetCell<std::string>("3D_D3", i));
-			for(auto val : d3Histogram)
-				v[j++] = val;
-			const auto d4Histogram = Histogram::parseHistogram(feats.GetCell<std::string>("3D_D4", i));
-			for(auto val : d4Histogram)
-				v[j++] = val;
-			idx.add_item(i, v);
-		}
-		return i;
+	// Support of the shape distribution histograms for the EMD
+	const float histogramValues[FeatureRecord::histogramBins] = { 0.1f, 0.2f, 0.3f, 0.4f, 0.5f, 0.6f, 0.7f, 0.8f, 0.9f, 1.0f };
+	typedef EarthMovers::EqualSupport<FeatureRecord::histogramBins> HistogramSupport;
+	const HistogramSupport histogramSupport(histogramValues);
+
+	// Rows per scan task, the distance buffer of a chunk stays in L1
+	const size_t scanChunkRows = 4096;
+	static_assert(PivotIndex::bucketRows <= scanChunkRows, "a bucket is scanned with the buffers of a chunk");
+
+	const std::array<float, 6> quadraticScalarWeights = { 3.0f / 12.0f, 3.0f / 12.0f , 0.5f / 12.0f, 0.5f / 12.0f, 3.0f / 12.0f, 2.0f / 12.0f };
+	const std::array<float, 6> quadraticFunctionWeights = { .8f / 12.0f, 1.9f / 12.0f, 3.6f / 12.0f, 1.9f / 12.0f, 1.9f / 12.0f, 1.9f / 12.0f };
+
+	// The space of HNSW and PQ. quadratic_Weights weights the squared scalar differences by w0 * sw_f and sums
+	// w_h * EMD over the histograms, so scalar f is scaled by sqrt(w0 * sw_f) and every bin of histogram h by
+	// sqrt(w_h): the squared Euclidean distance is then the scalar term exactly plus an L2 stand-in for the EMDs
+	const auto weightedScales = [] {
+		std::array<float, DESCRIPTORS_NUM> scales;
+		for (int f = 0; f < FeatureRecord::scalars; f++) {
+			scales[f] = std::sqrt(quadraticFunctionWeights[0] * quadraticScalarWeights[f]);
+		}
+		for (int h = 0; h < FeatureRecord::histograms; h++) {
+			for (int b = 0; b < FeatureRecord::histogramBins; b++) {
+				scales[FeatureRecord::scalars + h * FeatureRecord::histogramBins + b] = std::sqrt(quadraticFunctionWeights[h + 1]);
+			}
+		}
+		return scales;
+	}();
+
+	bool ShapeDatabase::open(const std::filesystem::path& dbPath) {
+		m_dbPath = dbPath;
+		m_pathIndex.clear();
+		m_contentIndex.clear();
+		if (!m_store.open(dbPath)) {
+			return false;
+		}
+		// emplace keeps the first row of duplicated keys, as the linear search did
+		m_pathIndex.reserve(m_store.rows());
+		m_contentIndex.reserve(m_store.rows());
+		for (size_t i = 0; i < m_store.rows(); i++) {
+			const std::filesystem::path rowPath = std::string(m_store.path(i));
+			m_pathIndex.emplace(extractClass(rowPath) + "/" + rowPath.filename().string(), (int)i);
+			// 0 marks rows converted from feats.csv, whose meshes were never hashed
+			if (m_store.contentHash(i) != 0) {
+				m_contentIndex.emplace(m_store.contentHash(i), (int)i);
+			}
+		}
+
+		// Without a table the EMDs of every row that survives the scalar terms are computed, with the same results
+		if (!m_pivots.open(dbPath, m_store, histogramSupport.deltas)) {
+			std::cout << "No pivot table for " << (dbPath / PivotIndex::fileName) << ", run FeaturesExtractor to build it" << std::endl;
+		}
+		return true;
 	}
 
-	void retrieveSimiliarShapesANN(const MeshPtr& mesh, std::filesystem::path dbPath, int shapes, bool includeSelf) {
+	bool ShapeDatabase::buildPivots(const std::filesystem::path& dbPath, const FeatureStore& store) {
+		PivotIndex pivots;
+		return pivots.build(dbPath, store, histogramSupport.deltas);
+	}
 
-		std::filesystem::path featsAvgPath = dbPath;
-		featsAvgPath /= "feats_avg.csv";
-		if (!std::filesystem::exists(featsAvgPath)) {
-			std::cout << "Could not find " << featsAvgPath << ".\nRun FeaturesExtractor on the mesh DB to generate the average feature file first" << std::endl;
-			return;
-		}
-		rapidcsv::Document feats((dbPath / "feats.csv").string(), rapidcsv::LabelParams(0, -1));
-
-		DescriptorMap descriptorMap;
-		// Initialize the query mesh histograms before searching the db for the q mesh
-		std::vector<float> qa3Histogram;
-		std::vector<float> qd1Histogram;
-		std::vector<float> qd2Histogram;
-		std::vector<float> qd3Histogram;
-		std::vector<float> qd4Histogram;
-
-		auto idx = Annoy::AnnoyIndex<int, float, Annoy::Angular, Annoy::Kiss32Random, Annoy::AnnoyIndexSingleThreadedBuildPolicy>(DESCRIPTORS_NUM);
-		float v[DESCRIPTORS_NUM];
-		int i = 0;
-		auto row_count = feats.GetRowCount();
-		rapidcsv::Document feats_avg(featsAvgPath.string(), rapidcsv::LabelParams(0, -1));
-
-		int meshIndex = 0;
-		bool meshInDB = false;
+	int ShapeDatabase::findMesh(const MeshPtr& mesh) const {
 		auto meshPath = mesh->getPath();
-		auto className = extractClass(meshPath);
-		if (meshPath.string().find(dbPath.string()) != std::string::npos) {
-			auto meshFilename = className + "/" + meshPath.filename().string();
-			for (int i = 0; i < feats.GetRowCount(); i++) {
-				if (feats.GetCell<std::string>("Path", i).find(meshFilename) != std::string::npos) {
-					meshIndex = i;
-					meshInDB = true;
-					descriptorMap[FEAT_AREA_3D] = feats.GetCell<float>("3D_Area", i);
-					descriptorMap[FEAT_MVOLUME_3D] = feats.GetCell<float>("3D_MVolume", i);
-					descriptorMap[FEAT_BBVOLUME_3D] = feats.GetCell<float>("3D_BBVolume", i);
-					descriptorMap[FEAT_DIAMETER_3D] = feats.GetCell<float>("3D_Diameter", i);
-					descriptorMap[FEAT_COMPACTNESS_3D] = feats.GetCell<float>("3D_Compactness", i);
-					descriptorMap[FEAT_ECCENTRICITY_3D] = feats.GetCell<float>("3D_Eccentricity", i);
-
-					const auto a3 = feats.GetCell<std::string>("3D_A3", i);
-					const auto d1 = feats.GetCell<std::string>("3D_D1", i);
-					const auto d2 = feats.GetCell<std::string>("3D_D2", i);
-					const auto d3 = feats.GetCell<std::string>("3D_D3", i);
-					const auto d4 = feats.GetCell<std::string>("3D_D4", i);
-					const auto dba3Histogram = Histogram::parseHistogram(a3);
-					const auto dbd1Histogram = Histogram::parseHistogram(d1);
-					const auto dbd2Histogram = Histogram::parseHistogram(d2);
-					const auto dbd3Histogram = Histogram::parseHistogram(d3);
-					const auto dbd4Histogram = Histogram::parseHistogram(d4);
-
-					qa3Histogram = dba3Histogram;
-					qd1Histogram = dbd1Histogram;
-					qd2Histogram = dbd2Histogram;
-					qd3Histogram = dbd3Histogram;
-					qd4Histogram = dbd4Histogram;
-					break;
+		if (meshPath.string().find(m_dbPath.string()) != std::string::npos) {
+			const auto found = m_pathIndex.find(extractClass(meshPath) + "/" + meshPath.filename().string());
+			if (found != m_pathIndex.end()) {
+				return found->second;
+			}
+		}
+		if (m_contentIndex.empty()) {
+			return -1;
+		}
+		const auto found = m_contentIndex.find(mesh->getContentHash());
+		return found != m_contentIndex.end() ? found->second : -1;
+	}
+
+	FeatureRecord ShapeDatabase::queryRecord(const MeshPtr& mesh) const {
+		// Same descriptors as FeaturesExtractor, the diameter included
+		mesh->computeFeatures(Descriptors::descriptor_all, Descriptors::SamplingOptions(), true);
+		FeatureRecord record = mesh->getFeatures();
+
+		for (int f = 0; f < FeatureRecord::scalars; f++) {
+			record.setScalar((Features)f, (record.scalar((Features)f) - m_store.average((Features)f)) / m_store.deviation((Features)f));
+		}
+		return record;
+	}
+
+	RetrievalEngine::RetrievalEngine(const std::filesystem::path& dbPath) {
+		m_db.open(dbPath);
+		setThreads(0);
+	}
+
+	void RetrievalEngine::setThreads(unsigned int threads) {
+		m_threads = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	void RetrievalEngine::setAnnOptions(const AnnOptions& options) {
+		const std::lock_guard<std::mutex> lock(m_annMutex);
+		m_annOptions = options;
+		// Searches still running keep the forest they started with
+		m_annTree.reset();
+	}
+
+	void RetrievalEngine::setHnswOptions(const HnswOptions& options) {
+		const std::lock_guard<std::mutex> lock(m_hnswMutex);
+		m_hnswOptions = options;
+		m_hnsw.reset();
+	}
+
+	void RetrievalEngine::setPqOptions(const PqOptions& options) {
+		const std::lock_guard<std::mutex> lock(m_pqMutex);
+		// Only a change of the codes needs them loaded or trained again
+		if (options.subspaces != m_pqOptions.subspaces || options.rotate != m_pqOptions.rotate ||
+			options.trainRows != m_pqOptions.trainRows || options.iterations != m_pqOptions.iterations) {
+			m_pq.reset();
+		}
+		m_pqOptions = options;
+	}
+
+	RetrievalEngine::QueryShape RetrievalEngine::resolve(const MeshPtr& mesh) const {
+		QueryShape query;
+		query.row = m_db.findMesh(mesh);
+		if (query.row >= 0) {
+			// If the mesh is in the database the values have already been normalized
+			query.record = m_db.getStore().record(query.row);
+		} else {
+			query.record = m_db.queryRecord(mesh);
+		}
+		return query;
+	}
+
+	RetrievalEngine::QueryShape RetrievalEngine::resolve(size_t row) const {
+		QueryShape query;
+		query.row = (int)row;
+		query.record = m_db.getStore().record(row);
+		return query;
+	}
+
+	SimilarShapes RetrievalEngine::queryANN(const MeshPtr& mesh, int shapes, bool includeSelf) {
+		if (!isOpen()) {
+			return SimilarShapes();
+		}
+		return searchANN(resolve(mesh), shapes, includeSelf);
+	}
+
+	SimilarShapes RetrievalEngine::searchANN(const QueryShape& query, int shapes, bool includeSelf) {
+		std::shared_ptr<const AnnTree> tree;
+		{
+			// The DB forest is loaded once and kept for the next queries
+			const std::lock_guard<std::mutex> lock(m_annMutex);
+			if (!m_annTree) {
+				auto opened = std::make_shared<AnnTree>();
+				if (!opened->open(m_db.getPath(), m_db.getStore(), m_annOptions)) {
+					return SimilarShapes();
 				}
+				m_annTree = opened;
 			}
+			tree = m_annTree;
 		}
 
-		if (!meshInDB) {
-			i = buildTree(idx, feats);
-
-			mesh->computeFeatures(Descriptors::descriptor_all & ~Descriptors::descriptor_diameter);
-			mesh->getConvexHull()->computeFeatures(Descriptors::descriptor_diameter);
-			descriptorMap = mesh->getDescriptorMap();
-			descriptorMap[FEAT_DIAMETER_3D] = mesh->getConvexHull()->getDescriptor(FEAT_DIAMETER_3D);
-			qa3Histogram = std::get<Histogram>(descriptorMap[FEAT_A3_3D]).getFrequency();
-			qd1Histogram = std::get<Histogram>(descriptorMap[FEAT_D1_3D]).getFrequency();
-			qd2Histogram = std::get<Histogram>(descriptorMap[FEAT_D2_3D]).getFrequency();
-			qd3Histogram = std::get<Histogram>(descriptorMap[FEAT_D3_3D]).getFrequency();
-			qd4Histogram = std::get<Histogram>(descriptorMap[FEAT_D4_3D]).getFrequency();
-
-			const auto avgArea = feats_avg.GetColumn<float>("3D_Area_AVG")[0];
-			const auto stdArea = feats_avg.GetColumn<float>("3D_Area_STD")[0];
-			const auto avgMVolume = feats_avg.GetColumn<float>("3D_MVolume_AVG")[0];
-			const auto stdMVolume = feats_avg.GetColumn<float>("3D_MVolume_STD")[0];
-			const auto avgBBVolume = feats_avg.GetColumn<float>("3D_BBVolume_AVG")[0];
-			const auto stdBBVolume = feats_avg.GetColumn<float>("3D_BBVolume_STD")[0];
-			const auto avgDiameter = feats_avg.GetColumn<float>("3D_Diameter_AVG")[0];
-			const auto stdDiameter = feats_avg.GetColumn<float>("3D_Diameter_STD")[0];
-			const auto avgCompactness = feats_avg.GetColumn<float>("3D_Compactness_AVG")[0];
-			const auto stdCompactness = feats_avg.GetColumn<float>("3D_Compactness_STD")[0];
-			const auto avgEccentricity = feats_avg.GetColumn<float>("3D_Eccentricity_AVG")[0];
-			const auto stdEccentricity = feats_avg.GetColumn<float>("3D_Eccentricity_STD")[0];
-
-			int j = 0;
-			v[j++] = ((std::get<float>(descriptorMap[FEAT_AREA_3D]) - avgArea) / stdArea);
-			v[j++] = ((std::get<float>(descriptorMap[FEAT_MVOLUME_3D]) - avgMVolume) / stdMVolume);
-			v[j++] = ((std::get<float>(descriptorMap[FEAT_BBVOLUME_3D]) - avgBBVolume) / stdBBVolume);
-			v[j++] = ((std::get<float>(descriptorMap[FEAT_DIAMETER_3D]) - avgDiameter) / stdDiameter);
-			v[j++] = ((std::get<float>(descriptorMap[FEAT_COMPACTNESS_3D]) - avgCompactness) / stdCompactness);
-			v[j++] =  ((std::get<float>(descriptorMap[FEAT_ECCENTRICITY_3D]) - avgEccentricity) / stdEccentricity);
-
-			for (auto val : qa3Histogram)
-				v[j++] = val;
-			for (auto val : qd1Histogram)
-				v[j++] = (val);
-			for (auto val : qd2Histogram)
-				v[j++] = (val);
-			for (auto val : qd3Histogram)
-				v[j++] = (val);
-			for (auto val : qd4Histogram)
-				v[j++] = (val);
-			idx.add_item(i, v);
-			meshIndex = i;
-			idx.build(DESCRIPTORS_NUM * 2);
+		std::vector<int> result;
+		std::vector<float> distances;
+		if (query.row >= 0) {
+			tree->queryRow(query.row, shapes + (includeSelf ? 0 : 1), result, distances);
 		} else {
-			if(std::filesystem::exists(dbPath/"ann_tree.ann")){
-				idx.load((dbPath/"ann_tree.ann").string().c_str());
-			} else {
-				i = buildTree(idx, feats);
-				idx.build(DESCRIPTORS_NUM * 2);
-				idx.save((dbPath/"ann_tree.ann").string().c_str());
+			// The query is not in the forest, only its feature vector is needed
+			tree->queryVector(query.record.data(), shapes, result, distances);
+		}
+		return collect(query, result, distances, shapes, includeSelf);
+	}
+
+	SimilarShapes RetrievalEngine::queryHNSW(const MeshPtr& mesh, int shapes, bool includeSelf) {
+		if (!isOpen()) {
+			return SimilarShapes();
+		}
+		return searchHNSW(resolve(mesh), shapes, includeSelf);
+	}
+
+	SimilarShapes RetrievalEngine::searchHNSW(const QueryShape& query, int shapes, bool includeSelf) {
+		std::shared_ptr<const HnswIndex> hnsw;
+		{
+			// The graph is mapped, or built, once and kept for the next queries
+			const std::lock_guard<std::mutex> lock(m_hnswMutex);
+			if (!m_hnsw) {
+				HnswOptions options = m_hnswOptions;
+				if (!options.threads) {
+					options.threads = m_threads;
+				}
+				auto opened = std::make_shared<HnswIndex>();
+				if (!opened->open(m_db.getPath(), m_db.getStore(), weightedScales.data(), options)) {
+					return SimilarShapes();
+				}
+				m_hnsw = opened;
 			}
+			hnsw = m_hnsw;
 		}
 
 		std::vector<int> result;
-		result.reserve(shapes);
 		std::vector<float> distances;
-		distances.reserve(shapes);
+		hnsw->search(query.record.data(), shapes + (query.row >= 0 && !includeSelf ? 1 : 0), result, distances);
+		return collect(query, result, distances, shapes, includeSelf);
+	}
+
+	SimilarShapes RetrievalEngine::queryPQ(const MeshPtr& mesh, int shapes, bool includeSelf) {
+		if (!isOpen()) {
+			return SimilarShapes();
+		}
+		return searchPQ(resolve(mesh), shapes, includeSelf);
+	}
 
-		// If the mesh is outside the DB we want to return shapes + 1 as the first entry is itself (but it's not stored in the DB so we can't access it in the feats file)
-		// If the mesh is inside the DB and we want to return itself, then we want to just use shapes
-		int startIndex = includeSelf && meshInDB ? 0 : 1;
-		int numToRetrieve = includeSelf && meshInDB ? shapes : shapes + 1;
+	SimilarShapes RetrievalEngine::searchPQ(const QueryShape& query, int shapes, bool includeSelf) {
+		std::shared_ptr<const PqIndex> pq;
+		int rerank = 0;
+		{
+			// The codes are loaded, or trained, once and kept for the next queries
+			const std::lock_guard<std::mutex> lock(m_pqMutex);
+			if (!m_pq) {
+				PqOptions options = m_pqOptions;
+				if (!options.threads) {
+					options.threads = m_threads;
+				}
+				auto opened = std::make_shared<PqIndex>();
+				if (!opened->open(m_db.getPath(), m_db.getStore(), weightedScales.data(), options)) {
+					return SimilarShapes();
+				}
+				m_pq = opened;
+			}
+			pq = m_pq;
+			rerank = m_pqOptions.rerank;
+		}
 
-		idx.get_nns_by_item(meshIndex, numToRetrieve, -1, &result, &distances);
-		idx.unload();
-		std::vector<std::pair<std::string, float>> similarShapes;
-		for(i = startIndex; i < result.size(); i++){
-			similarShapes.push_back(std::make_pair(feats.GetCell<std::string>("Path", result[i]), distances[i]));
+		std::vector<int> result;
+		std::vector<float> distances;
+		const int k = shapes + (query.row >= 0 && !includeSelf ? 1 : 0);
+		pq->search(query.record.data(), rerank > 0 ? k * rerank : k, m_threads, result, distances);
+		if (rerank > 0) {
+			rerankQuadratic(query, result, distances);
 		}
-		mesh->setSimilarShapes(similarShapes);
+		return collect(query, result, distances, shapes, includeSelf);
 	}
 
-	void retrieveSimiliarShapesCUST(const MeshPtr& mesh, std::filesystem::path dbPath, bool includeSelf, std::array<float, 6> scalarWeights, std::array<float, 6> functionWeights, bool squareDistance, bool useEMD, bool useSqrt) {
+	void RetrievalEngine::rerankQuadratic(const QueryShape& query, std::vector<int>& rows, std::vector<float>& distances) const {
+		// The same kernels and the same order of terms as scanCUST, so a kept row gets the distance of the exact scan
+		DistanceKernels::ScanWeights weights;
+		std::copy(quadraticScalarWeights.begin(), quadraticScalarWeights.end(), weights.scalarWeights);
+		std::copy(quadraticFunctionWeights.begin(), quadraticFunctionWeights.end(), weights.functionWeights);
+		weights.squareDistance = true;
+		weights.useSqrt = false;
+		weights.flatHistograms = false;
+
+		const FeatureStore& store = m_db.getStore();
+		const std::vector<uint32_t> list(rows.begin(), rows.end());
+		std::vector<float> buffer(list.size());
+		for (size_t j = 0; j < list.size(); j++) {
+			DistanceKernels::weightedDistances(store.columns(), query.record.data(), weights, list[j], list[j] + 1, &buffer[j]);
+		}
+		for (int h = 0; h < FeatureRecord::histograms; h++) {
+			const Features f = (Features)(FEAT_A3_3D + h);
+			float queryCdf[HistogramSupport::steps];
+			HistogramSupport::cdf(query.record.histogram(f), queryCdf);
+			DistanceKernels::addEarthMoversDistances(m_db.cdfColumns(f), queryCdf, histogramSupport.deltas, quadraticFunctionWeights[h + 1], list.data(), list.size(), buffer.data());
+		}
 
-		std::vector<std::pair<std::string, float>> similarShapes;
+		TopK best(list.size());
+		for (size_t j = 0; j < list.size(); j++) {
+			best.push(buffer[j], list[j]);
+		}
+		rows.clear();
+		distances.clear();
+		for (const auto& e : best.sorted()) {
+			rows.push_back((int)e.row);
+			distances.push_back(e.distance);
+		}
+	}
 
-		std::filesystem::path featsPath = dbPath;
-		featsPath /= "feats.csv";
-		if (!std::filesystem::exists(featsPath)) {
-			std::cout << "Could not find " << featsPath << ".\nRun FeaturesExtractor on the mesh DB to generate the feature file first" << std::endl;
-			return;
+	SimilarShapes RetrievalEngine::collect(const QueryShape& query, const std::vector<int>& rows, const std::vector<float>& distances, int shapes, bool includeSelf) const {
+		// A DB mesh is found at distance 0, it is left out by row rather than by position as a duplicate can tie with it
+		const bool skipSelf = query.row >= 0 && !includeSelf;
+		SimilarShapes similarShapes;
+		for (size_t i = 0; i < rows.size() && similarShapes.size() < (size_t)shapes; i++) {
+			if (skipSelf && rows[i] == query.row) {
+				continue;
+			}
+			similarShapes.push_back(std::make_pair(std::string(m_db.getStore().path(rows[i])), distances[i]));
 		}
+		return similarShapes;
+	}
 
-		std::filesystem::path featsAvgPath = dbPath;
-		featsAvgPath /= "feats_avg.csv";
-		if (!std::filesystem::exists(featsAvgPath)) {
-			std::cout << "Could not find " << featsAvgPath << ".\nRun FeaturesExtractor on the mesh DB to generate the average feature file first" << std::endl;
-			return;
+	SimilarShapes RetrievalEngine::queryCUST(const MeshPtr& mesh, int shapes, bool includeSelf, std::array<float, 6> scalarWeights, std::array<float, 6> functionWeights, bool squareDistance, bool useEMD, bool useSqrt) {
+		if (!isOpen()) {
+			return SimilarShapes();
 		}
+		return scanCUST(resolve(mesh), shapes, includeSelf, scalarWeights, functionWeights, squareDistance, useEMD, useSqrt);
+	}
 
-		rapidcsv::Document feats_avg(featsAvgPath.string(), rapidcsv::LabelParams(0, -1));
-		rapidcsv::Document feats(featsPath.string(), rapidcsv::LabelParams(0, -1));
+	SimilarShapes RetrievalEngine::scanCUST(const QueryShape& queryShape, int shapes, bool includeSelf, std::array<float, 6> scalarWeights, std::array<float, 6> functionWeights, bool squareDistance, bool useEMD, bool useSqrt) {
 
-		DescriptorMap descriptorMap;
-		std::vector<float> qa3Histogram;
-		std::vector<float> qd1Histogram;
-		std::vector<float> qd2Histogram;
-		std::vector<float> qd3Histogram;
-		std::vector<float> qd4Histogram;
-		std::vector<float> featureVector;
+		SimilarShapes similarShapes;
+		const FeatureStore& store = m_db.getStore();
+		const FeatureRecord& query = queryShape.record;
 
-		bool meshInDB = false;
-		auto meshPath = mesh->getPath();
-		auto className = extractClass(meshPath);
-		if (meshPath.string().find(dbPath.string()) != std::string::npos) {
-			auto meshFilename = className + "/" + meshPath.filename().string();
-			for (int i = 0; i < feats.GetRowCount(); i++) {
-				if (feats.GetCell<std::string>("Path", i).find(meshFilename) != std::string::npos) {
-					meshInDB = true;
-					// If the mesh is in the database the values have already been normalized
-					featureVector.push_back(feats.GetCell<float>("3D_Area", i));
-					featureVector.push_back(feats.GetCell<float>("3D_MVolume", i));
-					featureVector.push_back(feats.GetCell<float>("3D_BBVolume", i));
-					featureVector.push_back(feats.GetCell<float>("3D_Diameter", i));
-					featureVector.push_back(feats.GetCell<float>("3D_Compactness", i));
-					featureVector.push_back(feats.GetCell<float>("3D_Eccentricity", i));
-
-					const auto a3 = feats.GetCell<std::string>("3D_A3", i);
-					const auto d1 = feats.GetCell<std::string>("3D_D1", i);
-					const auto d2 = feats.GetCell<std::string>("3D_D2", i);
-					const auto d3 = feats.GetCell<std::string>("3D_D3", i);
-					const auto d4 = feats.GetCell<std::string>("3D_D4", i);
-
-					qa3Histogram = Histogram::parseHistogram(a3);
-					qd1Histogram = Histogram::parseHistogram(d1);
-					qd2Histogram = Histogram::parseHistogram(d2);
-					qd3Histogram = Histogram::parseHistogram(d3);
-					qd4Histogram = Histogram::parseHistogram(d4);
-
-					break;
-				}
+		// The scalar term of every row, and the histogram terms too when they are flat, come from the SIMD scan
+		DistanceKernels::ScanWeights weights;
+		std::copy(scalarWeights.begin(), scalarWeights.end(), weights.scalarWeights);
+		std::copy(functionWeights.begin(), functionWeights.end(), weights.functionWeights);
+		weights.squareDistance = squareDistance;
+		weights.useSqrt = useSqrt;
+		weights.flatHistograms = !useEMD && !squareDistance;
+
+		float queryCdfs[FeatureRecord::histograms][HistogramSupport::steps];
+		for (int h = 0; h < FeatureRecord::histograms; h++) {
+			HistogramSupport::cdf(query.histogram((Features)(FEAT_A3_3D + h)), queryCdfs[h]);
+		}
+		std::vector<std::vector<float>> queryHistograms;
+		if (!useEMD && !weights.flatHistograms) {
+			for (int h = 0; h < FeatureRecord::histograms; h++) {
+				queryHistograms.push_back(query.histogramVector((Features)(FEAT_A3_3D + h)));
 			}
 		}
 
-		if (!meshInDB) {
-			mesh->computeFeatures(Descriptors::descriptor_all & ~Descriptors::descriptor_diameter);
-			mesh->getConvexHull()->computeFeatures(Descriptors::descriptor_diameter);
-			descriptorMap = mesh->getDescriptorMap();
-			descriptorMap[FEAT_DIAMETER_3D] = mesh->getConvexHull()->getDescriptor(FEAT_DIAMETER_3D);
-			qa3Histogram = std::get<Histogram>(descriptorMap[FEAT_A3_3D]).getFrequency();
-			qd1Histogram = std::get<Histogram>(descriptorMap[FEAT_D1_3D]).getFrequency();
-			qd2Histogram = std::get<Histogram>(descriptorMap[FEAT_D2_3D]).getFrequency();
-			qd3Histogram = std::get<Histogram>(descriptorMap[FEAT_D3_3D]).getFrequency();
-			qd4Histogram = std::get<Histogram>(descriptorMap[FEAT_D4_3D]).getFrequency();
-
-			const auto avgArea = feats_avg.GetColumn<float>("3D_Area_AVG")[0];
-			const auto stdArea = feats_avg.GetColumn<float>("3D_Area_STD")[0];
-			const auto avgMVolume = feats_avg.GetColumn<float>("3D_MVolume_AVG")[0];
-			const auto stdMVolume = feats_avg.GetColumn<float>("3D_MVolume_STD")[0];
-			const auto avgBBVolume = feats_avg.GetColumn<float>("3D_BBVolume_AVG")[0];
-			const auto stdBBVolume = feats_avg.GetColumn<float>("3D_BBVolume_STD")[0];
-			const auto avgDiameter = feats_avg.GetColumn<float>("3D_Diameter_AVG")[0];
-			const auto stdDiameter = feats_avg.GetColumn<float>("3D_Diameter_STD")[0];
-			const auto avgCompactness = feats_avg.GetColumn<float>("3D_Compactness_AVG")[0];
-			const auto stdCompactness = feats_avg.GetColumn<float>("3D_Compactness_STD")[0];
-			const auto avgEccentricity = feats_avg.GetColumn<float>("3D_Eccentricity_AVG")[0];
-			const auto stdEccentricity = feats_avg.GetColumn<float>("3D_Eccentricity_STD")[0];
-
-			featureVector.push_back((std::get<float>(descriptorMap[FEAT_AREA_3D]) - avgArea) / stdArea);
-			featureVector.push_back((std::get<float>(descriptorMap[FEAT_MVOLUME_3D]) - avgMVolume) / stdMVolume);
-			featureVector.push_back((std::get<float>(descriptorMap[FEAT_BBVOLUME_3D]) - avgBBVolume) / stdBBVolume);
-			featureVector.push_back((std::get<float>(descriptorMap[FEAT_DIAMETER_3D]) - avgDiameter) / stdDiameter);
-			featureVector.push_back((std::get<float>(descriptorMap[FEAT_COMPACTNESS_3D]) - avgCompactness) / stdCompactness);
-			featureVector.push_back((std::get<float>(descriptorMap[FEAT_ECCENTRICITY_3D]) - avgEccentricity) / stdEccentricity);
-		}
-
-		for (int i = 0; i < feats.GetRowCount(); i++) {
-
-			// Compute the single-value distance (euclidean)
-			std::vector<float> dbFeatureVector;
-			dbFeatureVector.push_back(feats.GetCell<float>("3D_Area", i));
-			dbFeatureVector.push_back(feats.GetCell<float>("3D_MVolume", i));
-			dbFeatureVector.push_back(feats.GetCell<float>("3D_BBVolume", i));
-			dbFeatureVector.push_back(feats.GetCell<float>("3D_Diameter", i));
-			dbFeatureVector.push_back(feats.GetCell<float>("3D_Compactness", i));
-			dbFeatureVector.push_back(feats.GetCell<float>("3D_Eccentricity", i));
-
-			auto singleValueDistance = vectorDistance(featureVector.begin(), featureVector.end(), dbFeatureVector.begin(), scalarWeights.begin(), squareDistance, useSqrt);
-
-			// Compute earth mover's distance
-			const auto a3 = feats.GetCell<std::string>("3D_A3", i);
-			const auto d1 = feats.GetCell<std::string>("3D_D1", i);
-			const auto d2 = feats.GetCell<std::string>("3D_D2", i);
-			const auto d3 = feats.GetCell<std::string>("3D_D3", i);
-			const auto d4 = feats.GetCell<std::string>("3D_D4", i);
-			const auto dba3Histogram = Histogram::parseHistogram(a3);
-			const auto dbd1Histogram = Histogram::parseHistogram(d1);
-			const auto dbd2Histogram = Histogram::parseHistogram(d2);
-			const auto dbd3Histogram = Histogram::parseHistogram(d3);
-			const auto dbd4Histogram = Histogram::parseHistogram(d4);
-
-			auto a3distance = 0.0f;
-			auto d1distance = 0.0f;
-			auto d2distance = 0.0f;
-			auto d3distance = 0.0f;
-			auto d4distance = 0.0f;
+		// With non-negative weights every term is >= 0, so the running sum of a row never decreases and the row
+		// can be abandoned once it is above the k-th best distance found so far. The terms are still added in
+		// the same order, the rows that are kept get the same floats as a full evaluation.
+		const bool cascade = std::all_of(functionWeights.begin() + 1, functionWeights.end(), [](float w) { return w >= 0.0f; });
+
+		// Before the EMDs are computed, the pivots bound them from below by the smallest EMD weight times the
+		// triangle inequality bound of their sum
+		const PivotIndex& pivots = m_db.getPivots();
+		const float pivotWeight = *std::min_element(functionWeights.begin() + 1, functionWeights.end());
+		const bool usePivots = useEMD && cascade && pivots.pivots() > 0 && pivotWeight > 0.0f;
+		std::vector<float> queryPivots(pivots.pivots());
+		if (usePivots) {
+			pivots.queryDistances(&queryCdfs[0][0], queryPivots.data());
+		}
 
-			if (useEMD) {
-				std::vector<float> values = { 0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9, 1.0 };
-
-				a3distance = std::earthMoversDistance(values, qa3Histogram, values, dba3Histogram);
-				d1distance = std::earthMoversDistance(values, qd1Histogram, values, dbd1Histogram);
-				d2distance = std::earthMoversDistance(values, qd2Histogram, values, dbd2Histogram);
-				d3distance = std::earthMoversDistance(values, qd3Histogram, values, dbd3Histogram);
-				d4distance = std::earthMoversDistance(values, qd4Histogram, values, dbd4Histogram);
-			} else {
-				a3distance = vectorDistance(qa3Histogram.begin(), qa3Histogram.end(), dba3Histogram.begin(), scalarWeights.begin(), squareDistance, useSqrt);
-				d1distance = vectorDistance(qd1Histogram.begin(), qd1Histogram.end(), dbd1Histogram.begin(), scalarWeights.begin(), squareDistance, useSqrt);
-				d2distance = vectorDistance(qd2Histogram.begin(), qd2Histogram.end(), dbd2Histogram.begin(), scalarWeights.begin(), squareDistance, useSqrt);
-				d3distance = vectorDistance(qd3Histogram.begin(), qd3Histogram.end(), dbd3Histogram.begin(), scalarWeights.begin(), squareDistance, useSqrt);
-				d4distance = vectorDistance(qd4Histogram.begin(), qd4Histogram.end(), dbd4Histogram.begin(), scalarWeights.begin(), squareDistance, useSqrt);
+		// Every worker keeps its own top k, the merge does not depend on which worker scanned which rows, as TopK
+		// orders equal distances by row. A row above the k-th best distance of any worker can not make it into
+		// the merged top k either, so the lowest of them is shared and every worker prunes with it.
+		std::atomic<float> sharedThreshold(std::numeric_limits<float>::infinity());
+		const auto publish = [&sharedThreshold](const TopK& best) {
+			const float threshold = best.threshold();
+			float current = sharedThreshold.load();
+			while (threshold < current && !sharedThreshold.compare_exchange_weak(current, threshold)) {
+			}
+		};
+
+		// Distances of the rows [begin, end) into buffer, then into best. Returns the abandoned rows.
+		// inBuckets reads them from the bucket ordered copies of the pivot index, begin and end are positions
+		// of the bucket order then
+		const auto scanChunk = [&](bool inBuckets, size_t begin, size_t end, float* buffer, uint32_t* rows, TopK& best, size_t& pivotAbandoned) {
+			const size_t count = end - begin;
+			const float* const* columns = inBuckets ? pivots.bucketColumns() : store.columns();
+			const float* const* cdfColumns = inBuckets ? pivots.bucketCdfColumns() : store.cdfColumns();
+			const float* const* pivotColumns = inBuckets ? pivots.bucketPivotColumns() : pivots.columns();
+			DistanceKernels::weightedDistances(columns, query.data(), weights, begin, end, buffer);
+			std::iota(rows, rows + count, (uint32_t)begin);
+
+			const float threshold = cascade ? std::min(best.threshold(), sharedThreshold.load()) : std::numeric_limits<float>::infinity();
+			size_t n = DistanceKernels::keepBelow(rows, buffer, count, threshold);
+			if (usePivots && n && threshold < std::numeric_limits<float>::infinity()) {
+				const size_t bounded = DistanceKernels::keepPivotBound(pivotColumns, queryPivots.data(), pivots.pivots(), pivotWeight, PivotIndex::slack, rows, buffer, n, threshold);
+				pivotAbandoned += n - bounded;
+				n = bounded;
 			}
 
+			if (useEMD) {
+				// Closed-form EMD against the CDFs precomputed with the DB, contiguous while no row has been dropped
+				for (int h = 0; h < FeatureRecord::histograms && n; h++) {
+					const float* const* histogramCdfs = cdfColumns + h * HistogramSupport::steps;
+					if (n == count) {
+						DistanceKernels::addEarthMoversDistances(histogramCdfs, queryCdfs[h], histogramSupport.deltas, functionWeights[h + 1], begin, end, buffer);
+					} else {
+						DistanceKernels::addEarthMoversDistances(histogramCdfs, queryCdfs[h], histogramSupport.deltas, functionWeights[h + 1], rows, n, buffer);
+					}
+					n = DistanceKernels::keepBelow(rows, buffer, n, threshold);
+				}
+			} else if (!weights.flatHistograms) {
+				for (size_t j = 0; j < n; j++) {
+					const FeatureRecord record = store.record(rows[j]);
+					float histogramDistances[FeatureRecord::histograms];
+					for (int h = 0; h < FeatureRecord::histograms; h++) {
+						const auto dbHistogram = record.histogramVector((Features)(FEAT_A3_3D + h));
+						histogramDistances[h] = vectorDistance(queryHistograms[h].begin(), queryHistograms[h].end(), dbHistogram.begin(), scalarWeights.begin(), squareDistance, useSqrt);
+						histogramDistances[h] = histogramDistances[h] * functionWeights[h + 1];
+					}
+					buffer[j] = buffer[j] + histogramDistances[0] + histogramDistances[1] + histogramDistances[2] + histogramDistances[3] + histogramDistances[4];
+				}
+			}
 
-			singleValueDistance = singleValueDistance * functionWeights[0];
-			a3distance = a3distance * functionWeights[1];
-			d1distance = d1distance * functionWeights[2];
-			d2distance = d2distance * functionWeights[3];
-			d3distance = d3distance * functionWeights[4];
-			d4distance = d4distance * functionWeights[5];
-
-			similarShapes.push_back(std::make_pair(feats.GetCell<std::string>("Path", i), singleValueDistance + a3distance + d1distance + d2distance + d3distance + d4distance));
+			for (size_t j = 0; j < n; j++) {
+				best.push(buffer[j], inBuckets ? pivots.bucketRow(rows[j]) : rows[j]);
+			}
+			return count - n;
+		};
+
+		// A DB query is found at distance 0, one more row is selected so it can be dropped by row afterwards.
+		// shapes <= 0 keeps every row, like before the selection
+		const bool skipSelf = queryShape.row >= 0 && !includeSelf;
+		const size_t k = shapes > 0 ? (size_t)shapes + (skipSelf ? 1 : 0) : store.rows();
+
+		std::atomic<size_t> scanned(0);
+		std::atomic<size_t> abandoned(0);
+		std::atomic<size_t> pivotAbandoned(0);
+
+		// With the EMD and no negative weight the buckets of the pivot index are bounded as a whole. The nearest
+		// ones fill a first top k on this thread, then only the buckets whose bound is not above its k-th best
+		// distance are left. They are visited best bound first and a worker stops at the first bound above the
+		// threshold, every later bucket is farther. Without buckets every worker takes the next chunk of rows.
+		const bool useBuckets = useEMD && cascade && shapes > 0 && pivots.buckets() > 0 && functionWeights[0] >= 0.0f &&
+			std::all_of(scalarWeights.begin(), scalarWeights.end(), [](float w) { return w >= 0.0f; });
+		TopK seeds(k);
+		std::vector<std::pair<float, uint32_t>> bucketOrder;
+		if (useBuckets) {
+			std::vector<float> bounds(pivots.buckets());
+			pivots.bucketBounds(query.data(), &queryCdfs[0][0], queryPivots.data(), weights, pivotWeight, bounds.data());
+			// A NaN bound can not skip anything, it goes first
+			bucketOrder.reserve(bounds.size());
+			for (uint32_t b = 0; b < bounds.size(); b++) {
+				bucketOrder.push_back({ bounds[b] != bounds[b] ? -std::numeric_limits<float>::infinity() : bounds[b], b });
+			}
+			const size_t seedBuckets = std::min(bucketOrder.size(), k / PivotIndex::bucketRows + 2);
+			std::partial_sort(bucketOrder.begin(), bucketOrder.begin() + seedBuckets, bucketOrder.end());
+			std::vector<float> buffer(PivotIndex::bucketRows);
+			std::vector<uint32_t> rows(PivotIndex::bucketRows);
+			size_t seedPivotAbandoned = 0;
+			for (size_t i = 0; i < seedBuckets; i++) {
+				const uint32_t b = bucketOrder[i].second;
+				abandoned += scanChunk(true, pivots.bucketBegin(b), pivots.bucketEnd(b), buffer.data(), rows.data(), seeds, seedPivotAbandoned);
+				scanned += pivots.bucketEnd(b) - pivots.bucketBegin(b);
+			}
+			pivotAbandoned += seedPivotAbandoned;
+			publish(seeds);
+			const float threshold = seeds.threshold();
+			bucketOrder.erase(std::remove_if(bucketOrder.begin() + seedBuckets, bucketOrder.end(), [threshold](const std::pair<float, uint32_t>& e) { return e.first > threshold; }), bucketOrder.end());
+			bucketOrder.erase(bucketOrder.begin(), bucketOrder.begin() + seedBuckets);
+			std::sort(bucketOrder.begin(), bucketOrder.end());
 		}
 
-		std::sort(similarShapes.begin(), similarShapes.end(), []
-		(const std::pair<std::string, float>& a, const std::pair<std::string, float>& b) {
-				return a.second < b.second;
+		const size_t tasks = useBuckets ? bucketOrder.size() : (store.rows() + scanChunkRows - 1) / scanChunkRows;
+		const size_t workers = std::max<size_t>(1, std::min<size_t>(m_threads, tasks));
+		std::atomic<size_t> nextTask(0);
+		std::vector<TopK> heaps(workers, TopK(k));
+		const auto work = [&](size_t w) {
+			std::vector<float> buffer(scanChunkRows);
+			std::vector<uint32_t> rows(scanChunkRows);
+			size_t workerScanned = 0;
+			size_t workerAbandoned = 0;
+			size_t workerPivotAbandoned = 0;
+			for (size_t t = nextTask++; t < tasks; t = nextTask++) {
+				if (useBuckets) {
+					const uint32_t b = bucketOrder[t].second;
+					if (bucketOrder[t].first > std::min(heaps[w].threshold(), sharedThreshold.load())) {
+						break;
+					}
+					workerAbandoned += scanChunk(true, pivots.bucketBegin(b), pivots.bucketEnd(b), buffer.data(), rows.data(), heaps[w], workerPivotAbandoned);
+					workerScanned += pivots.bucketEnd(b) - pivots.bucketBegin(b);
+				} else {
+					const size_t begin = t * scanChunkRows;
+					const size_t end = std::min(begin + scanChunkRows, store.rows());
+					workerAbandoned += scanChunk(false, begin, end, buffer.data(), rows.data(), heaps[w], workerPivotAbandoned);
+					workerScanned += end - begin;
+				}
+				publish(heaps[w]);
 			}
-		);
+			scanned += workerScanned;
+			abandoned += workerAbandoned;
+			pivotAbandoned += workerPivotAbandoned;
+		};
+		std::vector<std::future<void>> futures;
+		for (size_t w = 1; w < workers; w++) {
+			futures.push_back(std::async(std::launch::async, work, w));
+		}
+		work(0);
+		for (auto& f : futures) {
+			f.get();
+		}
+		TopK best(k);
+		best.merge(seeds);
+		for (const auto& heap : heaps) {
+			best.merge(heap);
+		}
+		m_scannedRows += scanned;
+		m_skippedRows += store.rows() - scanned;
+		m_abandonedRows += abandoned;
+		m_pivotAbandonedRows += pivotAbandoned;
+
+		// Paths are only turned into strings for the selected rows
+		const auto selected = best.sorted();
+		similarShapes.reserve(selected.size());
+		for (const auto& entry : selected) {
+			if (skipSelf && entry.row == (size_t)queryShape.row) {
+				continue;
+			}
+			if (shapes > 0 && similarShapes.size() == (size_t)shapes) {
+				break;
+			}
+			similarShapes.push_back(std::make_pair(std::string(store.path(entry.row)), entry.distance));
+		}
 
-		if (!includeSelf) {
-			similarShapes.erase(similarShapes.begin());
+		return similarShapes;
+	}
+
+	SimilarShapes RetrievalEngine::query(const MeshPtr& mesh, int shapes, DistanceMethod method, bool includeSelf) {
+		if (!isOpen()) {
+			return SimilarShapes();
 		}
+		return dispatch(resolve(mesh), shapes, method, includeSelf);
+	}
 
-		mesh->setSimilarShapes(similarShapes);
+	SimilarShapes RetrievalEngine::query(size_t row, int shapes, DistanceMethod method, bool includeSelf) {
+		if (!isOpen() || row >= m_db.rows()) {
+			return SimilarShapes();
+		}
+		return dispatch(resolve(row), shapes, method, includeSelf);
 	}
 
-	void retrieveSimiliarShapes(const MeshPtr& mesh, std::filesystem::path dbPath, int shapes, DistanceMethod method, bool includeSelf) {
+	SimilarShapes RetrievalEngine::dispatch(const QueryShape& query, int shapes, DistanceMethod method, bool includeSelf) {
 		std::array<float, 6> functionWeights;
 		std::array<float, 6> scalarWeights;
 		bool useSqrt = false;
@@ -361,29 +547,82 @@ namespace Retriever {
 			useSqrt = true;
 			scalarWeights = { 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f };
 			functionWeights = { 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f };
-			retrieveSimiliarShapesCUST(mesh, dbPath, includeSelf, scalarWeights, functionWeights, squareDistance, useEMD, useSqrt);
-			break;
+			return scanCUST(query, shapes, includeSelf, scalarWeights, functionWeights, squareDistance, useEMD, useSqrt);
 		case DistanceMethod::quadratic_Weights:
-			scalarWeights = { 3.0f / 12.0f, 3.0f / 12.0f , 0.5f / 12.0f, 0.5f / 12.0f, 3.0f / 12.0f, 2.0f / 12.0f };
-			functionWeights = { .8f / 12.0f, 1.9f / 12.0f, 3.6f / 12.0f, 1.9f / 12.0f, 1.9f / 12.0f, 1.9f / 12.0f };
-			retrieveSimiliarShapesCUST(mesh, dbPath, includeSelf, scalarWeights, functionWeights, squareDistance, useEMD, useSqrt);
-			break;
+			scalarWeights = quadraticScalarWeights;
+			functionWeights = quadraticFunctionWeights;
+			return scanCUST(query, shapes, includeSelf, scalarWeights, functionWeights, squareDistance, useEMD, useSqrt);
 		case DistanceMethod::flat_NoWeights:
 			squareDistance = false;
 			useEMD = false;
 			scalarWeights = { 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f };
 			functionWeights = { 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f };
-			retrieveSimiliarShapesCUST(mesh, dbPath, includeSelf, scalarWeights, functionWeights, squareDistance, useEMD, useSqrt);
-			break;
+			return scanCUST(query, shapes, includeSelf, scalarWeights, functionWeights, squareDistance, useEMD, useSqrt);
 		case DistanceMethod::emd_NoWeights:
 			squareDistance = false;
 			scalarWeights = { 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f };
 			functionWeights = { 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f };
-			retrieveSimiliarShapesCUST(mesh, dbPath, includeSelf, scalarWeights, functionWeights, squareDistance, useEMD, useSqrt);
-			break;
+			return scanCUST(query, shapes, includeSelf, scalarWeights, functionWeights, squareDistance, useEMD, useSqrt);
 		case DistanceMethod::spotify_ANN:
-			retrieveSimiliarShapesANN(mesh, dbPath, shapes, includeSelf);
-			break;
+			return searchANN(query, shapes, includeSelf);
+		case DistanceMethod::hnsw_ANN:
+			return searchHNSW(query, shapes, includeSelf);
+		case DistanceMethod::pq_ADC:
+			return searchPQ(query, shapes, includeSelf);
+		}
+		return SimilarShapes();
+	}
+
+	namespace {
+		std::mutex engineMutex;
+		std::shared_ptr<RetrievalEngine> cachedEngine;
+	}
+
+	std::shared_ptr<RetrievalEngine> getEngine(const std::filesystem::path& dbPath) {
+		const std::lock_guard<std::mutex> lock(engineMutex);
+		if (!cachedEngine || !cachedEngine->isOpen() || cachedEngine->getDatabase().getPath() != dbPath) {
+			cachedEngine = std::make_shared<RetrievalEngine>(dbPath);
+		}
+		return cachedEngine;
+	}
+
+	void releaseEngine() {
+		const std::lock_guard<std::mutex> lock(engineMutex);
+		cachedEngine.reset();
+	}
+
+	void retrieveSimiliarShapesANN(const MeshPtr& mesh, std::filesystem::path dbPath, int shapes, bool includeSelf) {
+		const auto engine = getEngine(dbPath);
+		if (engine->isOpen()) {
+			mesh->setSimilarShapes(engine->queryANN(mesh, shapes, includeSelf));
+		}
+	}
+
+	void retrieveSimiliarShapesHNSW(const MeshPtr& mesh, std::filesystem::path dbPath, int shapes, bool includeSelf) {
+		const auto engine = getEngine(dbPath);
+		if (engine->isOpen()) {
+			mesh->setSimilarShapes(engine->queryHNSW(mesh, shapes, includeSelf));
+		}
+	}
+
+	void retrieveSimiliarShapesPQ(const MeshPtr& mesh, std::filesystem::path dbPath, int shapes, bool includeSelf) {
+		const auto engine = getEngine(dbPath);
+		if (engine->isOpen()) {
+			mesh->setSimilarShapes(engine->queryPQ(mesh, shapes, includeSelf));
+		}
+	}
+
+	void retrieveSimiliarShapesCUST(const MeshPtr& mesh, std::filesystem::path dbPath, int shapes, bool includeSelf, std::array<float, 6> scalarWeights, std::array<float, 6> functionWeights, bool squareDistance, bool useEMD, bool useSqrt) {
+		const auto engine = getEngine(dbPath);
+		if (engine->isOpen()) {
+			mesh->setSimilarShapes(engine->queryCUST(mesh, shapes, includeSelf, scalarWeights, functionWeights, squareDistance, useEMD, useSqrt));
+		}
+	}
+
+	void retrieveSimiliarShapes(const MeshPtr& mesh, std::filesystem::path dbPath, int shapes, DistanceMethod method, bool includeSelf) {
+		const auto engine = getEngine(dbPath);
+		if (engine->isOpen()) {
+			mesh->setSimilarShapes(engine->query(mesh, shapes, method, includeSelf));
 		}
 	}
 }
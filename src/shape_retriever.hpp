@@ -2,6 +2,15 @@
 #define __SHAPE_RETRIEVER_HPP__
 
 #include "mesh.hpp"
+#include "feature_store.hpp"
+#include "pivot_index.hpp"
+#include "ann_tree.hpp"
+#include "hnsw_index.hpp"
+#include "pq_index.hpp"
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
 
 typedef std::shared_ptr<Mesh> MeshPtr;
 
@@ -12,11 +21,130 @@ namespace Retriever {
 		quadratic_Weights = 1,
 		flat_NoWeights = 2,
 		emd_NoWeights = 3,
-		spotify_ANN = 4
+		spotify_ANN = 4,
+		hnsw_ANN = 5,
+		pq_ADC = 6
 	};
-	void retrieveSimiliarShapesCUST(const MeshPtr& mesh, std::filesystem::path dbPath, bool includeSelf, std::array<float, 6> scalarWeights, std::array<float, 6> functionWeights, bool squareDistance, bool useEMD, bool useSqrt);
+
+	typedef std::vector<std::pair<std::string, float>> SimilarShapes;
+
+	// Everything the retrieval needs from a DB root, read once: the mapped feature store with its
+	// normalization statistics, the "class/filename" and content hash indices used to recognise DB meshes,
+	// and the pivot table bounding the EMDs of the DB histograms
+	class ShapeDatabase {
+		public:
+			bool open(const std::filesystem::path& dbPath);
+			inline bool isOpen() const { return m_store.isOpen(); }
+			// Builds and saves the pivot table open loads, FeaturesExtractor runs it after writing the store
+			static bool buildPivots(const std::filesystem::path& dbPath, const FeatureStore& store);
+			inline const std::filesystem::path& getPath() const { return m_dbPath; }
+			inline const FeatureStore& getStore() const { return m_store; }
+			inline size_t rows() const { return m_store.rows(); }
+
+			// Row of the DB mesh the query was loaded from, -1 if it does not come from the DB.
+			// Looked up by path under the DB root, then by content for copies of DB meshes stored elsewhere
+			int findMesh(const MeshPtr& mesh) const;
+			// Features of a query mesh, with the global descriptors standardized like the DB rows
+			FeatureRecord queryRecord(const MeshPtr& mesh) const;
+			// Columns of the precomputed CDFs of one shape distribution, for the closed-form EMD
+			inline const float* const* cdfColumns(Features f) const { return m_store.cdfColumns(f); }
+			inline const PivotIndex& getPivots() const { return m_pivots; }
+
+		private:
+			std::filesystem::path m_dbPath;
+			FeatureStore m_store;
+			std::unordered_map<std::string, int> m_pathIndex;
+			std::unordered_map<uint64_t, int> m_contentIndex;
+			PivotIndex m_pivots;
+	};
+
+	// Answers repeated queries against one DB without going back to the filesystem,
+	// apart from loading ann_tree.ann (or building it, if FeaturesExtractor did not) the first time ANN is used
+	// and mapping (or building) feats_hnsw.bin and feats_pq.bin the first time HNSW and PQ are
+	class RetrievalEngine {
+		public:
+			explicit RetrievalEngine(const std::filesystem::path& dbPath);
+			inline bool isOpen() const { return m_db.isOpen(); }
+			inline const ShapeDatabase& getDatabase() const { return m_db; }
+			// Threads of the exact scan, 0 for one per hardware thread (the default)
+			void setThreads(unsigned int threads);
+			inline unsigned int getThreads() const { return m_threads; }
+			// Options of the ANN forest, it is opened again with them on the next ANN query.
+			// Queries already running finish on the forest they started with
+			void setAnnOptions(const AnnOptions& options);
+			inline const AnnOptions& getAnnOptions() const { return m_annOptions; }
+			// Same for the HNSW graph, it is unmapped once the queries running on it are done
+			void setHnswOptions(const HnswOptions& options);
+			inline const HnswOptions& getHnswOptions() const { return m_hnswOptions; }
+			// Same for the product quantizer, its rerank applies to the next query right away
+			void setPqOptions(const PqOptions& options);
+			inline const PqOptions& getPqOptions() const { return m_pqOptions; }
+			// Rows seen by the exact scan and rows it abandoned before their last term, since the last reset.
+			// The pivot count is the part of the abandoned rows dropped by the PivotIndex bound, the skipped
+			// rows are the ones in PivotIndex buckets the scan never visited
+			inline uint64_t getScannedRows() const { return m_scannedRows; }
+			inline uint64_t getSkippedRows() const { return m_skippedRows; }
+			inline uint64_t getAbandonedRows() const { return m_abandonedRows; }
+			inline uint64_t getPivotAbandonedRows() const { return m_pivotAbandonedRows; }
+			inline void resetCounters() { m_scannedRows = 0; m_skippedRows = 0; m_abandonedRows = 0; m_pivotAbandonedRows = 0; }
+
+			SimilarShapes queryCUST(const MeshPtr& mesh, int shapes, bool includeSelf, std::array<float, 6> scalarWeights, std::array<float, 6> functionWeights, bool squareDistance, bool useEMD, bool useSqrt);
+			SimilarShapes queryANN(const MeshPtr& mesh, int shapes, bool includeSelf);
+			// Nearest shapes in the HNSW graph, by the Euclidean distance weighted like quadratic_Weights
+			SimilarShapes queryHNSW(const MeshPtr& mesh, int shapes, bool includeSelf);
+			// Nearest shapes by their product quantization codes, in the same space as HNSW. With a PqOptions
+			// rerank, the best codes are ranked again by the quadratic_Weights distance of the exact scan
+			SimilarShapes queryPQ(const MeshPtr& mesh, int shapes, bool includeSelf);
+			SimilarShapes query(const MeshPtr& mesh, int shapes, DistanceMethod method, bool includeSelf = false);
+			// Same as query for the mesh of a DB row, without loading it
+			SimilarShapes query(size_t row, int shapes, DistanceMethod method, bool includeSelf = false);
+
+		private:
+			// The DB row of a query, -1 outside the DB, and its standardized features
+			struct QueryShape {
+				int row;
+				FeatureRecord record;
+			};
+			QueryShape resolve(const MeshPtr& mesh) const;
+			QueryShape resolve(size_t row) const;
+			SimilarShapes scanCUST(const QueryShape& query, int shapes, bool includeSelf, std::array<float, 6> scalarWeights, std::array<float, 6> functionWeights, bool squareDistance, bool useEMD, bool useSqrt);
+			SimilarShapes searchANN(const QueryShape& query, int shapes, bool includeSelf);
+			SimilarShapes searchHNSW(const QueryShape& query, int shapes, bool includeSelf);
+			SimilarShapes searchPQ(const QueryShape& query, int shapes, bool includeSelf);
+			// Sorts rows again by their quadratic_Weights distance to query, which replaces distances
+			void rerankQuadratic(const QueryShape& query, std::vector<int>& rows, std::vector<float>& distances) const;
+			// The first shapes of the rows found for query, itself left out unless includeSelf
+			SimilarShapes collect(const QueryShape& query, const std::vector<int>& rows, const std::vector<float>& distances, int shapes, bool includeSelf) const;
+			SimilarShapes dispatch(const QueryShape& query, int shapes, DistanceMethod method, bool includeSelf);
+			ShapeDatabase m_db;
+			unsigned int m_threads;
+			std::atomic<uint64_t> m_scannedRows{ 0 };
+			std::atomic<uint64_t> m_skippedRows{ 0 };
+			std::atomic<uint64_t> m_abandonedRows{ 0 };
+			std::atomic<uint64_t> m_pivotAbandonedRows{ 0 };
+			AnnOptions m_annOptions;
+			// Shared with the searches using it, so a change of options never closes it under them
+			std::shared_ptr<AnnTree> m_annTree;
+			std::mutex m_annMutex;
+			HnswOptions m_hnswOptions;
+			std::shared_ptr<HnswIndex> m_hnsw;
+			std::mutex m_hnswMutex;
+			PqOptions m_pqOptions;
+			std::shared_ptr<PqIndex> m_pq;
+			std::mutex m_pqMutex;
+	};
+
+	// Engine for dbPath, created on first use and kept until another DB is asked for
+	std::shared_ptr<RetrievalEngine> getEngine(const std::filesystem::path& dbPath);
+	// Drops the cached engine, e.g. after the DB features have been recomputed
+	void releaseEngine();
+
+	// Wrappers over the cached engine, the results are stored with Mesh::setSimilarShapes
+	void retrieveSimiliarShapesCUST(const MeshPtr& mesh, std::filesystem::path dbPath, int shapes, bool includeSelf, std::array<float, 6> scalarWeights, std::array<float, 6> functionWeights, bool squareDistance, bool useEMD, bool useSqrt);
 	void retrieveSimiliarShapes(const MeshPtr& mesh, std::filesystem::path dbPath, int shapes, DistanceMethod method, bool includeSelf = false);
 	void retrieveSimiliarShapesANN(const MeshPtr& mesh, std::filesystem::path dbPath, int shapes, bool includeSelf = false);
+	void retrieveSimiliarShapesHNSW(const MeshPtr& mesh, std::filesystem::path dbPath, int shapes, bool includeSelf = false);
+	void retrieveSimiliarShapesPQ(const MeshPtr& mesh, std::filesystem::path dbPath, int shapes, bool includeSelf = false);
 }
 
 #endif
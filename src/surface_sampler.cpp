@@ -0,0 +1,98 @@
+#include "surface_sampler.hpp"
+#include <cmath>
+#include <algorithm>
+
+namespace SurfaceSampler {
+
+	AliasTable::AliasTable(const std::vector<double>& weights) : m_probability(weights.size(), 1.0f), m_alias(weights.size()) {
+		const size_t n = weights.size();
+		double total = 0.0;
+		for (auto w : weights) total += w;
+		if (n == 0 || total <= 0.0) return;
+
+		// Scale so the average weight is 1, then pair every under-full slot with an over-full one
+		std::vector<double> scaled(n);
+		std::vector<uint32_t> small, large;
+		for (size_t i = 0; i < n; i++) {
+			scaled[i] = weights[i] * n / total;
+			m_alias[i] = (uint32_t)i;
+			if (scaled[i] < 1.0) small.push_back((uint32_t)i);
+			else large.push_back((uint32_t)i);
+		}
+		while (!small.empty() && !large.empty()) {
+			const uint32_t s = small.back(); small.pop_back();
+			const uint32_t l = large.back();
+			m_probability[s] = (float)scaled[s];
+			m_alias[s] = l;
+			scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+			if (scaled[l] < 1.0) {
+				large.pop_back();
+				small.push_back(l);
+			}
+		}
+		// Whatever is left is 1 up to rounding
+		for (auto i : small) m_probability[i] = 1.0f;
+		for (auto i : large) m_probability[i] = 1.0f;
+	}
+
+	SampleKernels::SoAPoints samplePoints(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, int n, Random::Engine& rng) {
+		std::vector<double> areas(F.rows());
+		double total = 0.0;
+		for (int f = 0; f < F.rows(); f++) {
+			const Eigen::Vector3f a = V.row(F(f, 0));
+			const Eigen::Vector3f b = V.row(F(f, 1));
+			const Eigen::Vector3f c = V.row(F(f, 2));
+			areas[f] = 0.5 * (b - a).cross(c - a).norm();
+			total += areas[f];
+		}
+		if (F.rows() == 0 || !(total > 0.0)) {
+			return SampleKernels::toSoA(V);
+		}
+
+		const AliasTable faces(areas);
+		SampleKernels::SoAPoints P;
+		P.x.resize(n);
+		P.y.resize(n);
+		P.z.resize(n);
+		for (int i = 0; i < n; i++) {
+			const uint32_t f = faces.sample(rng);
+			// Uniform barycentric coordinates: (1 - sqrt(r1), sqrt(r1) (1 - r2), sqrt(r1) r2)
+			const float r1 = std::sqrt(rng.uniform());
+			const float r2 = rng.uniform();
+			const float u = 1.0f - r1;
+			const float v = r1 * (1.0f - r2);
+			const float w = r1 * r2;
+			const int ia = F(f, 0), ib = F(f, 1), ic = F(f, 2);
+			P.x[i] = u * V(ia, 0) + v * V(ib, 0) + w * V(ic, 0);
+			P.y[i] = u * V(ia, 1) + v * V(ib, 1) + w * V(ic, 1);
+			P.z[i] = u * V(ia, 2) + v * V(ib, 2) + w * V(ic, 2);
+		}
+		return P;
+	}
+
+	SampleKernels::SoAPoints sampleVertices(const Eigen::MatrixXf& V, int n, Random::Engine& rng) {
+		const uint32_t rows = (uint32_t)V.rows();
+		if (n <= 0 || (uint32_t)n >= rows) {
+			return SampleKernels::toSoA(V);
+		}
+
+		// Partial Fisher-Yates, then gather in ascending order so V is read front to back
+		std::vector<uint32_t> indices(rows);
+		for (uint32_t i = 0; i < rows; i++) indices[i] = i;
+		for (uint32_t i = 0; i < (uint32_t)n; i++) {
+			std::swap(indices[i], indices[i + rng.index(rows - i)]);
+		}
+		std::sort(indices.begin(), indices.begin() + n);
+
+		SampleKernels::SoAPoints P;
+		P.x.resize(n);
+		P.y.resize(n);
+		P.z.resize(n);
+		for (int i = 0; i < n; i++) {
+			P.x[i] = V(indices[i], 0);
+			P.y[i] = V(indices[i], 1);
+			P.z[i] = V(indices[i], 2);
+		}
+		return P;
+	}
+};
@@ -0,0 +1,37 @@
+#ifndef __SURFACE_SAMPLER_HPP__
+#define __SURFACE_SAMPLER_HPP__
+
+#include "Eigen/Dense"
+#include "random.hpp"
+#include "sample_kernels.hpp"
+#include <vector>
+
+// Uniform sampling of points over the surface of a triangle mesh, independent of how it is tessellated
+namespace SurfaceSampler {
+
+	// Walker's alias method (Vose's construction): O(n) to build, O(1) per draw
+	class AliasTable {
+		public:
+			AliasTable(const std::vector<double>& weights);
+
+			inline uint32_t sample(Random::Engine& rng) const {
+				const uint32_t i = rng.index((uint32_t)m_probability.size());
+				return (rng.uniform() < m_probability[i]) ? i : m_alias[i];
+			}
+
+			inline size_t size() const { return m_probability.size(); }
+
+		private:
+			std::vector<float> m_probability;
+			std::vector<uint32_t> m_alias;
+	};
+
+	// n points, faces picked proportionally to their area and a uniform point taken inside each.
+	// Falls back to the vertices themselves when the mesh has no faces or no area.
+	SampleKernels::SoAPoints samplePoints(const Eigen::MatrixXf& V, const Eigen::MatrixXi& F, int n, Random::Engine& rng);
+
+	// n distinct vertices picked uniformly (all of them if the mesh has n or fewer), gathered contiguously
+	SampleKernels::SoAPoints sampleVertices(const Eigen::MatrixXf& V, int n, Random::Engine& rng);
+};
+
+#endif
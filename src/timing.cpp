@@ -5,15 +5,50 @@
 
 int main(int argc, char* args[]) {
 	if (argc < 2) {
-		std::cout << "USAGE:" << std::endl << args[0] << " db-path [ANN=true|false]" << std::endl;
+		std::cout << "USAGE:" << std::endl << args[0] << " db-path [ANN=true|false] [HNSW=true|false] [PQ=true|false] [threads=N] [trees=N] [search_k=N] [ef_search=N] [rerank=N] [opq=true|false]" << std::endl;
 		return 1;
 	}
 	std::string dbPath = args[1];
 	bool useANN = false;
+	bool useHNSW = false;
+	bool usePQ = false;
 	const int kMax = 380;
 
-	if(argc == 3 && strncmp(args[2], "ANN=true", strlen("ANN=true")) == 0)
-		useANN = true;
+	unsigned int threads = 0;
+	AnnOptions ann;
+	HnswOptions hnsw;
+	PqOptions pq;
+	for (int a = 2; a < argc; a++) {
+		if (strncmp(args[a], "ANN=true", strlen("ANN=true")) == 0)
+			useANN = true;
+		else if (strncmp(args[a], "HNSW=true", strlen("HNSW=true")) == 0)
+			useHNSW = true;
+		else if (strncmp(args[a], "PQ=true", strlen("PQ=true")) == 0)
+			usePQ = true;
+		else if (strncmp(args[a], "rerank=", strlen("rerank=")) == 0)
+			pq.rerank = atoi(args[a] + strlen("rerank="));
+		else if (strncmp(args[a], "opq=true", strlen("opq=true")) == 0)
+			pq.rotate = true;
+		else if (strncmp(args[a], "threads=", strlen("threads=")) == 0)
+			threads = atoi(args[a] + strlen("threads="));
+		else if (strncmp(args[a], "trees=", strlen("trees=")) == 0)
+			ann.trees = atoi(args[a] + strlen("trees="));
+		else if (strncmp(args[a], "search_k=", strlen("search_k=")) == 0)
+			ann.searchK = atoi(args[a] + strlen("search_k="));
+		else if (strncmp(args[a], "ef_search=", strlen("ef_search=")) == 0)
+			hnsw.efSearch = atoi(args[a] + strlen("ef_search="));
+	}
+
+	// The DB features are read once, so the timings only cover the queries
+	const auto engine = Retriever::getEngine(dbPath);
+	if (!engine->isOpen()) {
+		return 1;
+	}
+	engine->setThreads(threads);
+	engine->setAnnOptions(ann);
+	engine->setHnswOptions(hnsw);
+	engine->setPqOptions(pq);
+	const auto method = (usePQ) ? Retriever::DistanceMethod::pq_ADC : (useHNSW) ? Retriever::DistanceMethod::hnsw_ANN : (useANN) ? Retriever::DistanceMethod::spotify_ANN : Retriever::DistanceMethod::quadratic_Weights;
 
 	std::vector<float> mss(kMax);
 	for (auto& p : std::filesystem::recursive_directory_iterator(dbPath)) {
@@ -25,15 +60,16 @@ int main(int argc, char* args[]) {
 			MeshPtr meshPtr = std::make_shared<Mesh>(p.path().string());
 			for(int i = 1; i <= kMax; i++){
 				auto t1 = std::chrono::high_resolution_clock::now();
-				Retriever::retrieveSimiliarShapes(meshPtr, dbPath, i, (useANN) ? Retriever::DistanceMethod::spotify_ANN : Retriever::DistanceMethod::quadratic_Weights, true);
+				meshPtr->setSimilarShapes(engine->query(meshPtr, i, method, true));
 				auto t2 = std::chrono::high_resolution_clock::now();
-				auto diff = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
-				mss[i] += diff.count();
+				// Queries take microseconds now, whole milliseconds would round them to 0
+				std::chrono::duration<float, std::milli> diff = t2 - t1;
+				mss[i - 1] += diff.count();
 			}
 		}
 	}
 	std::string fileName = "timing_";
-	fileName.append(((useANN) ? "ANN.csv" : "CUST.csv"));
+	fileName.append(((usePQ) ? "PQ.csv" : (useHNSW) ? "HNSW.csv" : (useANN) ? "ANN.csv" : "CUST.csv"));
 	std::ofstream timingFile;
 	timingFile.open(fileName);
 	timingFile << "k,ms\n";
@@ -42,6 +78,13 @@ int main(int argc, char* args[]) {
 		timingFile << i++ << "," << ms / (float)kMax << std::endl;
 	}
 	timingFile.close();
+	if (engine->getScannedRows() + engine->getSkippedRows()) {
+		std::cout << "Skipped " << 100.0 * engine->getSkippedRows() / (engine->getScannedRows() + engine->getSkippedRows()) << "% of the rows in whole pivot buckets" << std::endl;
+	}
+	if (engine->getScannedRows()) {
+		std::cout << "Abandoned " << 100.0 * engine->getAbandonedRows() / engine->getScannedRows() << "% of the scanned rows early, " <<
+			100.0 * engine->getPivotAbandonedRows() / engine->getScannedRows() << "% on the pivot bound" << std::endl;
+	}
 
 	return 0;
 }
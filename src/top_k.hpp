@@ -0,0 +1,70 @@
+#ifndef __TOP_K_HPP__
+#define __TOP_K_HPP__
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cstddef>
+
+// The k smallest distances seen so far with their DB rows, kept in a bounded max-heap.
+// Equal distances are ordered by row and NaNs after everything else, so the result does not
+// depend on the order the rows are pushed in.
+class TopK {
+	public:
+		struct Entry {
+			float distance;
+			size_t row;
+		};
+
+		explicit TopK(size_t k) : m_k(k) { m_heap.reserve(k); }
+
+		inline size_t capacity() const { return m_k; }
+		inline size_t size() const { return m_heap.size(); }
+		inline bool full() const { return m_heap.size() >= m_k; }
+
+		// Distance a row has to beat to get in, infinity until k rows have been pushed
+		inline float threshold() const {
+			return full() && m_k ? key(m_heap.front().distance) : std::numeric_limits<float>::infinity();
+		}
+
+		inline bool push(float distance, size_t row) {
+			const Entry e = { distance, row };
+			if (!full()) {
+				m_heap.push_back(e);
+				std::push_heap(m_heap.begin(), m_heap.end(), less);
+				return true;
+			}
+			if (!m_k || !less(e, m_heap.front())) {
+				return false;
+			}
+			std::pop_heap(m_heap.begin(), m_heap.end(), less);
+			m_heap.back() = e;
+			std::push_heap(m_heap.begin(), m_heap.end(), less);
+			return true;
+		}
+
+		inline void merge(const TopK& other) {
+			for (const auto& e : other.m_heap) {
+				push(e.distance, e.row);
+			}
+		}
+
+		// Closest first
+		inline std::vector<Entry> sorted() const {
+			std::vector<Entry> entries = m_heap;
+			std::sort(entries.begin(), entries.end(), less);
+			return entries;
+		}
+
+	private:
+		static inline float key(float d) { return d != d ? std::numeric_limits<float>::infinity() : d; }
+		static inline bool less(const Entry& a, const Entry& b) {
+			const float ka = key(a.distance), kb = key(b.distance);
+			return ka < kb || (ka == kb && a.row < b.row);
+		}
+
+		size_t m_k;
+		std::vector<Entry> m_heap;
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "utils.hpp"
 #include "normalization.hpp"
+#include "moments.hpp"
 #include "glm/geometric.hpp"
 #include <filesystem>
 #include "assimp/Importer.hpp"
@@ -10,9 +11,16 @@
 #include "igl/readOFF.h"
 #include "igl/readPLY.h"
 #include "mesh.hpp"
+#include "feature_record.hpp"
+#include "feature_store.hpp"
+#include "ann_tree.hpp"
+#include "shape_retriever.hpp"
 #include "rapidcsv.h"
 #include <future>
 #include <mutex>
+#include <numeric>
+#include <algorithm>
+#include <array>
 
 
 namespace Importer {
@@ -119,14 +127,13 @@ namespace Stats {
 		std::cout << modelFilePath << std::endl;
 		const auto classType = getParentFolderName(modelFilePath);
 		Mesh mesh(modelFilePath);
-		Eigen::Vector3f c;
-		mesh.getCentroid(c);
+		const auto moments = Moments::computeMoments(mesh.getVertices(), mesh.getFaces());
+		const Eigen::Vector3f& c = moments.centroid;
 		glm::vec3 bbMin(paiMesh->mAABB.mMin.x, paiMesh->mAABB.mMin.y, paiMesh->mAABB.mMin.z);
 		glm::vec3 bbMax(paiMesh->mAABB.mMax.x, paiMesh->mAABB.mMax.y, paiMesh->mAABB.mMax.z);
 		glm::vec3 res = bbMax - bbMin;
 
-		const auto covarianceMatirx = Normalization::calculateCovarianceMatrix(mesh.getVertices(), c);
-		const auto eigenResults = Normalization::calculateEigen(covarianceMatirx);
+		const auto eigenResults = Normalization::calculateEigen(moments.covariance);
 		const auto majorEigenVector = eigenResults[2].first;
 		const auto minorEigenVector = eigenResults[1].first;
 
@@ -202,41 +209,48 @@ namespace Stats {
 		myfile.close();
 	}
 
-	void getDatabaseFeatures(std::string dbPath){
+	void getDatabaseFeatures(std::string dbPath, const Descriptors::SamplingOptions& sampling, const AnnOptions& ann){
 		std::filesystem::path fp = dbPath;
 		std::filesystem::path currPath = std::filesystem::current_path();
 		std::filesystem::current_path(fp);
 		std::mutex fileMutex;
 		std::vector<std::future<void>> futures;
 		std::vector<std::filesystem::path> classPaths;
-		std::vector<DescriptorMap> features;
+		std::vector<FeatureRecord> features;
 		std::vector<std::string> names;
+		std::vector<uint64_t> hashes;
 		for (auto& p : std::filesystem::recursive_directory_iterator(".")) {
 			if(p.is_directory()){
 				classPaths.push_back(p.path());
 			}
 		}
 		for(auto& cp : classPaths){
-			futures.push_back(std::async(std::launch::async, [&cp, &names, &features, &fileMutex]{
+			futures.push_back(std::async(std::launch::async, [&cp, &names, &features, &hashes, &fileMutex, &sampling]{
 				for(auto &p : std::filesystem::recursive_directory_iterator(cp)){
 					std::string extension = p.path().extension().string();
 					std::string offExt(".off");
 					std::string plyExt(".ply");
 					if (extension == offExt || extension == plyExt) {
-						std::cout << "Compute features for " << p.path().string() << std::endl;
 						Mesh mesh(p.path().string());
-						mesh.computeFeatures(Descriptors::descriptor_all & 
-								~Descriptors::descriptor_diameter);
-						mesh.getConvexHull()->computeFeatures(Descriptors::descriptor_diameter);
-						try{
-							const std::lock_guard<std::mutex> lock(fileMutex);
-							names.push_back(p.path().string());
-							DescriptorMap dm = mesh.getDescriptorMap();
-							dm[FEAT_DIAMETER_3D] = mesh.getConvexHull()->getDescriptor(FEAT_DIAMETER_3D);
-							features.push_back(dm);
-						} catch(std::bad_variant_access e){
-							std::cout << "Error retrieving features for " << p.path().string() << ": " << e.what();
-						}
+						// Hashed as loaded, before the features touch the mesh, so a copy opened elsewhere matches
+						const uint64_t hash = mesh.getContentHash();
+						Descriptors::SamplingOptions meshSampling = sampling;
+						// Seed from the path inside the DB so a mesh gets the same features whichever thread picks it up
+						meshSampling.seed = Random::streamSeed(sampling.seed, Random::hashString(p.path().generic_string()));
+						// The diameter comes from the hull of the vertices, computed once inside computeFeatures
+						mesh.computeFeatures(Descriptors::descriptor_all, meshSampling);
+						FeatureRecord record = mesh.getFeatures();
+
+						const std::lock_guard<std::mutex> lock(fileMutex);
+						std::cout << "Compute features for " << p.path().string() << " (samples A3/D1/D2/D3/D4: " <<
+							record.samples(FEAT_A3_3D) << "/" <<
+							record.samples(FEAT_D1_3D) << "/" <<
+							record.samples(FEAT_D2_3D) << "/" <<
+							record.samples(FEAT_D3_3D) << "/" <<
+							record.samples(FEAT_D4_3D) << ")" << std::endl;
+						names.push_back(p.path().string());
+						features.push_back(record);
+						hashes.push_back(hash);
 					}
 				}
 			}));
@@ -245,105 +259,131 @@ namespace Stats {
 			a.get();
 		}
 
+		// Threads finish in any order, sort the rows so that a fixed seed always writes the same feats.csv
+		std::vector<size_t> order(names.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&names](size_t a, size_t b) { return names[a] < names[b]; });
+		std::vector<std::string> sortedNames;
+		std::vector<FeatureRecord> sortedFeatures;
+		std::vector<uint64_t> sortedHashes;
+		for (auto i : order) {
+			sortedNames.push_back(names[i]);
+			sortedFeatures.push_back(features[i]);
+			sortedHashes.push_back(hashes[i]);
+		}
+		names.swap(sortedNames);
+		features.swap(sortedFeatures);
+		hashes.swap(sortedHashes);
+
 		std::cout << "Normalization..." << std::endl;
-		DescriptorMap avgs;
-		DescriptorMap deviations;
-		avgs[FEAT_AREA_3D] = 0.0f;
-		avgs[FEAT_MVOLUME_3D] = 0.0f;
-		avgs[FEAT_BBVOLUME_3D] = 0.0f;
-		avgs[FEAT_DIAMETER_3D] = 0.0f;
-		avgs[FEAT_COMPACTNESS_3D] = 0.0f; 
-		avgs[FEAT_ECCENTRICITY_3D] = 0.0f;
-		deviations[FEAT_AREA_3D] = 0.0f;
-		deviations[FEAT_MVOLUME_3D] = 0.0f;
-		deviations[FEAT_BBVOLUME_3D] = 0.0f;
-		deviations[FEAT_DIAMETER_3D] = 0.0f;
-		deviations[FEAT_COMPACTNESS_3D] = 0.0f; 
-		deviations[FEAT_ECCENTRICITY_3D] = 0.0f;
+		// The global descriptors are standardized, the histograms are already normalized
+		std::array<float, FeatureRecord::scalars> avgs;
+		std::array<float, FeatureRecord::scalars> deviations;
+		avgs.fill(0.0f);
+		deviations.fill(0.0f);
 		for(auto& a : features){
-			avgs[FEAT_AREA_3D] = std::get<float>(avgs[FEAT_AREA_3D]) + std::get<float>(a[FEAT_AREA_3D]);
-			avgs[FEAT_MVOLUME_3D] = std::get<float>(avgs[FEAT_MVOLUME_3D]) + std::get<float>(a[FEAT_MVOLUME_3D]);
-			avgs[FEAT_BBVOLUME_3D] = std::get<float>(avgs[FEAT_BBVOLUME_3D]) + std::get<float>(a[FEAT_BBVOLUME_3D]);
-			avgs[FEAT_DIAMETER_3D] = std::get<float>(avgs[FEAT_DIAMETER_3D]) + std::get<float>(a[FEAT_DIAMETER_3D]);
-			avgs[FEAT_COMPACTNESS_3D] = std::get<float>(avgs[FEAT_COMPACTNESS_3D]) + std::get<float>(a[FEAT_COMPACTNESS_3D]);
-			avgs[FEAT_ECCENTRICITY_3D] = std::get<float>(avgs[FEAT_ECCENTRICITY_3D]) + std::get<float>(a[FEAT_ECCENTRICITY_3D]);
+			for(int f = 0; f < FeatureRecord::scalars; f++){
+				avgs[f] += a.scalar((Features)f);
+			}
+		}
+		for(int f = 0; f < FeatureRecord::scalars; f++){
+			avgs[f] = avgs[f] / features.size();
 		}
-		avgs[FEAT_AREA_3D] = std::get<float>(avgs[FEAT_AREA_3D]) / features.size();
-		avgs[FEAT_MVOLUME_3D] = std::get<float>(avgs[FEAT_MVOLUME_3D]) / features.size();
-		avgs[FEAT_BBVOLUME_3D] = std::get<float>(avgs[FEAT_BBVOLUME_3D]) / features.size();
-		avgs[FEAT_DIAMETER_3D] = std::get<float>(avgs[FEAT_DIAMETER_3D]) / features.size();
-		avgs[FEAT_COMPACTNESS_3D] = std::get<float>(avgs[FEAT_COMPACTNESS_3D]) / features.size();
-		avgs[FEAT_ECCENTRICITY_3D] = std::get<float>(avgs[FEAT_ECCENTRICITY_3D]) / features.size();
 
 		for(auto& a : features){
-			deviations[FEAT_AREA_3D] = std::get<float>(deviations[FEAT_AREA_3D]) + std::pow(std::get<float>(a[FEAT_AREA_3D]) - std::get<float>(avgs[FEAT_AREA_3D]), 2.0f);
-			deviations[FEAT_MVOLUME_3D] = std::get<float>(deviations[FEAT_MVOLUME_3D]) + std::pow(std::get<float>(a[FEAT_MVOLUME_3D]) - std::get<float>(avgs[FEAT_MVOLUME_3D]), 2.0f);
-			deviations[FEAT_BBVOLUME_3D] = std::get<float>(deviations[FEAT_BBVOLUME_3D]) + std::pow(std::get<float>(a[FEAT_BBVOLUME_3D]) - std::get<float>(avgs[FEAT_BBVOLUME_3D]), 2.0f);
-			deviations[FEAT_DIAMETER_3D] = std::get<float>(deviations[FEAT_DIAMETER_3D]) + std::pow(std::get<float>(a[FEAT_DIAMETER_3D]) - std::get<float>(avgs[FEAT_DIAMETER_3D]), 2.0f);
-			deviations[FEAT_COMPACTNESS_3D] = std::get<float>(deviations[FEAT_COMPACTNESS_3D]) + std::pow(std::get<float>(a[FEAT_COMPACTNESS_3D]) - std::get<float>(avgs[FEAT_COMPACTNESS_3D]), 2.0f);
-			deviations[FEAT_ECCENTRICITY_3D] = std::get<float>(deviations[FEAT_ECCENTRICITY_3D]) + std::pow(std::get<float>(a[FEAT_ECCENTRICITY_3D]) - std::get<float>(avgs[FEAT_ECCENTRICITY_3D]), 2.0f);
+			for(int f = 0; f < FeatureRecord::scalars; f++){
+				deviations[f] = deviations[f] + std::pow(a.scalar((Features)f) - avgs[f], 2.0f);
+			}
+		}
+		for(int f = 0; f < FeatureRecord::scalars; f++){
+			deviations[f] = std::sqrt(deviations[f] / features.size());
 		}
-		deviations[FEAT_AREA_3D] = std::sqrt(std::get<float>(deviations[FEAT_AREA_3D])/features.size());
-		deviations[FEAT_MVOLUME_3D] = std::sqrt(std::get<float>(deviations[FEAT_MVOLUME_3D])/features.size());
-		deviations[FEAT_BBVOLUME_3D] = std::sqrt(std::get<float>(deviations[FEAT_BBVOLUME_3D])/features.size());
-		deviations[FEAT_DIAMETER_3D] = std::sqrt(std::get<float>(deviations[FEAT_DIAMETER_3D])/features.size());
-		deviations[FEAT_COMPACTNESS_3D] = std::sqrt(std::get<float>(deviations[FEAT_COMPACTNESS_3D])/features.size());
-		deviations[FEAT_ECCENTRICITY_3D] = std::sqrt(std::get<float>(deviations[FEAT_ECCENTRICITY_3D])/features.size());
 
-	
 		std::ofstream featsFile;
 		featsFile.open("feats.csv");
 		featsFile << "Path,3D_Area,3D_MVolume,3D_BBVolume,3D_Diameter,3D_Compactness,3D_Eccentricity,3D_A3,3D_D1,3D_D2,3D_D3,3D_D4\n";
 		for(int i = 0; i < names.size(); i++){
-			featsFile << names[i] << "," <<
-				(std::get<float>(features[i][FEAT_AREA_3D]) - std::get<float>(avgs[FEAT_AREA_3D])) / std::get<float>(deviations[FEAT_AREA_3D]) << "," <<
-				(std::get<float>(features[i][FEAT_MVOLUME_3D]) - std::get<float>(avgs[FEAT_MVOLUME_3D])) / std::get<float>(deviations[FEAT_MVOLUME_3D]) << "," <<
-				(std::get<float>(features[i][FEAT_BBVOLUME_3D]) - std::get<float>(avgs[FEAT_BBVOLUME_3D])) / std::get<float>(deviations[FEAT_BBVOLUME_3D]) << "," <<
-				(std::get<float>(features[i][FEAT_DIAMETER_3D]) - std::get<float>(avgs[FEAT_DIAMETER_3D])) / std::get<float>(deviations[FEAT_DIAMETER_3D]) << "," <<
-				(std::get<float>(features[i][FEAT_COMPACTNESS_3D]) - std::get<float>(avgs[FEAT_COMPACTNESS_3D])) / std::get<float>(deviations[FEAT_COMPACTNESS_3D]) << "," << 
-				(std::get<float>(features[i][FEAT_ECCENTRICITY_3D]) - std::get<float>(avgs[FEAT_ECCENTRICITY_3D])) / std::get<float>(deviations[FEAT_ECCENTRICITY_3D]) << "," <<
-				(std::get<Histogram>(features[i][FEAT_A3_3D])).toString() << "," <<
-				(std::get<Histogram>(features[i][FEAT_D1_3D])).toString() << "," <<
-				(std::get<Histogram>(features[i][FEAT_D2_3D])).toString() << "," <<
-				(std::get<Histogram>(features[i][FEAT_D3_3D])).toString() << "," <<
-				(std::get<Histogram>(features[i][FEAT_D4_3D])).toString() <<
+			featsFile << names[i] << ",";
+			for(int f = 0; f < FeatureRecord::scalars; f++){
+				featsFile << (features[i].scalar((Features)f) - avgs[f]) / deviations[f] << ",";
+			}
+			featsFile <<
+				features[i].histogramString(FEAT_A3_3D) << "," <<
+				features[i].histogramString(FEAT_D1_3D) << "," <<
+				features[i].histogramString(FEAT_D2_3D) << "," <<
+				features[i].histogramString(FEAT_D3_3D) << "," <<
+				features[i].histogramString(FEAT_D4_3D) <<
 				std::endl;
 		}
 		featsFile.close();
 		std::ofstream featsStatsFile;
 		featsStatsFile.open("feats_avg.csv");
 		featsStatsFile << "3D_Area_AVG,3D_Area_STD,3D_MVolume_AVG,3D_MVolume_STD,3D_BBVolume_AVG,3D_BBVolume_STD,3D_Diameter_AVG,3D_Diameter_STD,3D_Compactness_AVG,3D_Compactness_STD,3D_Eccentricity_AVG,3D_Eccentricity_STD\n";
-		featsStatsFile << 
-			std::get<float>(avgs[FEAT_AREA_3D]) << "," <<
-			std::get<float>(deviations[FEAT_AREA_3D]) << "," <<
-			std::get<float>(avgs[FEAT_MVOLUME_3D]) << "," <<
-			std::get<float>(deviations[FEAT_MVOLUME_3D]) << "," <<
-			std::get<float>(avgs[FEAT_BBVOLUME_3D]) << "," <<
-			std::get<float>(deviations[FEAT_BBVOLUME_3D]) << "," <<
-			std::get<float>(avgs[FEAT_DIAMETER_3D]) << "," <<
-			std::get<float>(deviations[FEAT_DIAMETER_3D]) << "," <<
-			std::get<float>(avgs[FEAT_COMPACTNESS_3D]) << "," <<
-			std::get<float>(deviations[FEAT_COMPACTNESS_3D]) << "," <<
-			std::get<float>(avgs[FEAT_ECCENTRICITY_3D]) << "," <<
-			std::get<float>(deviations[FEAT_ECCENTRICITY_3D]) <<
-			std::endl;
+		for(int f = 0; f < FeatureRecord::scalars; f++){
+			featsStatsFile << avgs[f] << "," << deviations[f] << ((f + 1 < FeatureRecord::scalars) ? "," : "");
+		}
+		featsStatsFile << std::endl;
 		featsStatsFile.close();
+
+		// Same rows as feats.csv, in the binary layout the retriever maps
+		std::vector<FeatureRecord> standardized = features;
+		for(auto& a : standardized){
+			for(int f = 0; f < FeatureRecord::scalars; f++){
+				a.setScalar((Features)f, (a.scalar((Features)f) - avgs[f]) / deviations[f]);
+			}
+		}
+		// The pivot table and the ANN forest are built here once, retrieval only loads them
+		FeatureStore store;
+		AnnTree tree;
+		if (!FeatureStore::write(FeatureStore::fileName, names, standardized, avgs, deviations, hashes)) {
+			std::cout << "Could not write " << FeatureStore::fileName << ", the pivot table and the ANN forest are not built" << std::endl;
+		} else if (store.open(".")) {
+			Retriever::ShapeDatabase::buildPivots(".", store);
+			if (tree.open(".", store, ann) && ann.searchK) {
+				// An unchanged forest is only loaded, the requested search_k still has to be saved
+				tree.saveOptions();
+			}
+		}
 	
 		std::filesystem::current_path(currPath);
 	}
 }
 
 namespace FeatureVector {
+	FeatureRecord readFeatureRecord(rapidcsv::Document& feats, int row) {
+		FeatureRecord record;
+		record.setScalar(FEAT_AREA_3D, feats.GetCell<float>("3D_Area", row));
+		record.setScalar(FEAT_MVOLUME_3D, feats.GetCell<float>("3D_MVolume", row));
+		record.setScalar(FEAT_BBVOLUME_3D, feats.GetCell<float>("3D_BBVolume", row));
+		record.setScalar(FEAT_DIAMETER_3D, feats.GetCell<float>("3D_Diameter", row));
+		record.setScalar(FEAT_COMPACTNESS_3D, feats.GetCell<float>("3D_Compactness", row));
+		record.setScalar(FEAT_ECCENTRICITY_3D, feats.GetCell<float>("3D_Eccentricity", row));
+		record.setHistogram(FEAT_A3_3D, Histogram::parseHistogram(feats.GetCell<std::string>("3D_A3", row)));
+		record.setHistogram(FEAT_D1_3D, Histogram::parseHistogram(feats.GetCell<std::string>("3D_D1", row)));
+		record.setHistogram(FEAT_D2_3D, Histogram::parseHistogram(feats.GetCell<std::string>("3D_D2", row)));
+		record.setHistogram(FEAT_D3_3D, Histogram::parseHistogram(feats.GetCell<std::string>("3D_D3", row)));
+		record.setHistogram(FEAT_D4_3D, Histogram::parseHistogram(feats.GetCell<std::string>("3D_D4", row)));
+		return record;
+	}
+
 	void getFeatureVectorClassToIndicesName(std::filesystem::path dbPath, Eigen::VectorXd& dbFeatureVector, ClassToMeshIndexNameMap& classTypeToIndicesNames, int& origDimensionality, int& numOfDataPoints) {
-		std::filesystem::path featsPath = dbPath;
-		featsPath /= "feats.csv";
-		rapidcsv::Document feats(featsPath.string(), rapidcsv::LabelParams(0, -1));
-		numOfDataPoints = feats.GetRowCount();
+		FeatureStore store;
+		if (!store.open(dbPath)) {
+			numOfDataPoints = 0;
+			return;
+		}
+		numOfDataPoints = store.rows();
 
-		std::vector<float> tempFeatureVector;
+		std::vector<float> tempFeatureVector(store.rows() * DESCRIPTORS_NUM);
+		for (size_t i = 0; i < store.rows(); i++) {
+			store.copyRow(i, tempFeatureVector.data() + i * DESCRIPTORS_NUM);
+		}
+		if (numOfDataPoints && !origDimensionality) {
+			origDimensionality = DESCRIPTORS_NUM;
+		}
 		for (int i = 0; i < numOfDataPoints; i++) {
 
-			const auto meshPath = std::filesystem::path(feats.GetCell<std::string>("Path", i));
+			const auto meshPath = std::filesystem::path(std::string(store.path(i)));
 			const auto meshName = meshPath.filename().string();
 			const auto classType = meshPath.parent_path().filename().string();
 			if (classTypeToIndicesNames.find(classType) == classTypeToIndicesNames.end()) {
@@ -354,35 +394,6 @@ namespace FeatureVector {
 			else {
 				classTypeToIndicesNames.at(classType).push_back(std::make_pair(i, meshName));
 			}
-
-			// Compute the single-value distance (euclidean)
-			tempFeatureVector.push_back(feats.GetCell<float>("3D_Area", i));
-			tempFeatureVector.push_back(feats.GetCell<float>("3D_MVolume", i));
-			tempFeatureVector.push_back(feats.GetCell<float>("3D_BBVolume", i));
-			tempFeatureVector.push_back(feats.GetCell<float>("3D_Diameter", i));
-			tempFeatureVector.push_back(feats.GetCell<float>("3D_Compactness", i));
-			tempFeatureVector.push_back(feats.GetCell<float>("3D_Eccentricity", i));
-
-			// Compute earth mover's distance
-			const auto a3 = feats.GetCell<std::string>("3D_A3", i);
-			const auto d1 = feats.GetCell<std::string>("3D_D1", i);
-			const auto d2 = feats.GetCell<std::string>("3D_D2", i);
-			const auto d3 = feats.GetCell<std::string>("3D_D3", i);
-			const auto d4 = feats.GetCell<std::string>("3D_D4", i);
-			const auto a3Histogram = Histogram::parseHistogram(a3);
-			const auto d1Histogram = Histogram::parseHistogram(d1);
-			const auto d2Histogram = Histogram::parseHistogram(d2);
-			const auto d3Histogram = Histogram::parseHistogram(d3);
-			const auto d4Histogram = Histogram::parseHistogram(d4);
-
-			tempFeatureVector.insert(tempFeatureVector.end(), a3Histogram.begin(), a3Histogram.end());
-			tempFeatureVector.insert(tempFeatureVector.end(), d1Histogram.begin(), d1Histogram.end());
-			tempFeatureVector.insert(tempFeatureVector.end(), d2Histogram.begin(), d2Histogram.end());
-			tempFeatureVector.insert(tempFeatureVector.end(), d3Histogram.begin(), d3Histogram.end());
-			tempFeatureVector.insert(tempFeatureVector.end(), d4Histogram.begin(), d4Histogram.end());
-			if (!origDimensionality) {
-				origDimensionality = tempFeatureVector.size();
-			}
 		}
 
 		std::vector<double> doubleFeatureVector(tempFeatureVector.begin(), tempFeatureVector.end());
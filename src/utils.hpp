@@ -12,6 +12,9 @@
 #include <iostream>
 #include <filesystem>
 #include <Eigen/Core>
+#include "random.hpp"
+#include "sampling_options.hpp"
+#include "ann_options.hpp"
 
 #define DESCRIPTORS_NUM 56
 typedef unsigned char BYTE;
@@ -76,10 +79,17 @@ inline float vectorDistance(Iter_T first, Iter_T last, Iter2_T first2, Iter3_T w
 namespace Stats {
 	ModelStatistics getModelStatistics(std::string modelFilePath);
 	void getDatabaseStatistics(std::string databasePath, std::string fp = "stats.csv");
-	void getDatabaseFeatures(std::string dbPath);
+	// Every mesh is sampled with the given options, seeded from sampling.seed and its path in the DB.
+	// The ANN forest of the new features is built with the given options
+	void getDatabaseFeatures(std::string dbPath, const Descriptors::SamplingOptions& sampling = Descriptors::SamplingOptions(), const AnnOptions& ann = AnnOptions());
 };
 
+class FeatureRecord;
+namespace rapidcsv { class Document; }
+
 namespace FeatureVector {
+	// One row of feats.csv, as written by Stats::getDatabaseFeatures
+	FeatureRecord readFeatureRecord(rapidcsv::Document& feats, int row);
 	void getFeatureVectorClassToIndicesName(std::filesystem::path dbPath, Eigen::VectorXd& dbFeatureVector, ClassToMeshIndexNameMap& classTypeToIndicesNames, int& origDimensionality, int& numOfDataPoints);
 	void formatReducedFeatureVector(std::vector<double> flatFeatureVectors, int numOfDataPoints, Eigen::MatrixXd& reducedFeatureVectors);
 };